@@ -0,0 +1,35 @@
+// Converts an OBJ file into the binary mesh cache main maps at startup
+#include "mesh_cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <input.obj> <output.mesh>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto mesh = loadIndexedObjFile(argv[1]);
+
+    if (mesh.indices.empty())
+    {
+        fprintf(stderr, "No triangles in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (!writeMeshCache(argv[2], mesh))
+    {
+        fprintf(stderr, "Could not write %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("%s: %zu vertices, %zu triangles in %.1f ms\n", argv[2], mesh.vertices.size(), mesh.indices.size() / 3, ms);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+// Nothing closer to the camera than this is drawn, which keeps 1 / z finite
+static constexpr auto NEAR_PLANE = 0.01f;
+
+// How a PixelBuffer stores depth. The quantized formats trade precision for
+// memory traffic: every depth test reads the stored value and every passing
+// fragment writes it back, at high resolutions that is as much as the color.
+enum class DepthFormat
+{
+    // View z as float, smaller is nearer
+    Float,
+    // 1 / z as float, larger is nearer; cleared to 0, the precision is densest
+    // near the camera where 1 / z changes fastest
+    ReversedFloat,
+    // 16 bit code, logarithmic in z, see UnormDepthTraits
+    Unorm16,
+    // 24 bit code in the low bits of a 32 bit word (D24X8), the spare byte keeps
+    // the pixels aligned. Finer than Unorm16 but moves as many bytes as Float.
+    Unorm24,
+};
+
+inline const char *depthFormatName(DepthFormat format)
+{
+    switch (format)
+    {
+    case DepthFormat::Float:
+        return "float";
+    case DepthFormat::ReversedFloat:
+        return "reversed";
+    case DepthFormat::Unorm16:
+        return "unorm16";
+    case DepthFormat::Unorm24:
+        return "unorm24";
+    }
+
+    return "unknown";
+}
+
+// Stored value, encoding and test of a format. encode() takes both z and 1 / z,
+// rasterizers have the second one already. decode() is the nearest view z that
+// encodes to a value, the hierarchical z-buffer compares against it.
+template <DepthFormat Format>
+struct DepthTraits;
+
+template <>
+struct DepthTraits<DepthFormat::Float>
+{
+    using Value = float;
+    static constexpr Value CLEAR = std::numeric_limits<float>::max();
+
+    static Value encode(float z, float)
+    {
+        return z;
+    }
+
+    static bool isNearer(Value a, Value b)
+    {
+        return a < b;
+    }
+
+    static float decode(Value value)
+    {
+        return value;
+    }
+};
+
+template <>
+struct DepthTraits<DepthFormat::ReversedFloat>
+{
+    using Value = float;
+    static constexpr Value CLEAR = 0.0f;
+
+    static Value encode(float, float iz)
+    {
+        return iz;
+    }
+
+    static bool isNearer(Value a, Value b)
+    {
+        return a > b;
+    }
+
+    static float decode(Value value)
+    {
+        return value > 0.0f ? 1 / value : std::numeric_limits<float>::infinity();
+    }
+};
+
+// The code of z is its float bit pattern relative to NEAR_PLANE, shifted down to
+// Bits - 5 mantissa bits: piecewise linear in log2(z), with the same relative
+// precision across the 32 octaves past the near plane (up to about 4e7). Nearer
+// values clamp to 0 and farther ones to the last code before CLEAR, so nothing
+// vanishes for being too far. The vector kernels repeat encode() step for step.
+template <int Bits>
+struct UnormDepthTraits
+{
+    using Value = std::conditional_t<Bits <= 16, uint16_t, uint32_t>;
+    static constexpr int32_t SHIFT = 23 - (Bits - 5);
+    static constexpr Value CLEAR = Value((uint32_t{1} << Bits) - 1);
+    static constexpr int32_t MAX_CODE = int32_t(CLEAR) - 1;
+
+    static int32_t getNearBits()
+    {
+        int32_t bits;
+        memcpy(&bits, &NEAR_PLANE, sizeof(bits));
+        return bits;
+    }
+
+    static Value encode(float z, float)
+    {
+        int32_t bits;
+        memcpy(&bits, &z, sizeof(bits));
+
+        // Wraps like the vector subtraction does, NaNs and negative z end up far
+        const auto code = int32_t(uint32_t(bits) - uint32_t(getNearBits())) >> SHIFT;
+        return Value(code < 0 ? 0 : code > MAX_CODE ? MAX_CODE : code);
+    }
+
+    static bool isNearer(Value a, Value b)
+    {
+        return a < b;
+    }
+
+    static float decode(Value value)
+    {
+        if (value == CLEAR)
+        {
+            return std::numeric_limits<float>::infinity();
+        }
+
+        const auto bits = (int32_t(value) << SHIFT) + getNearBits();
+        float z;
+        memcpy(&z, &bits, sizeof(z));
+        return z;
+    }
+};
+
+template <>
+struct DepthTraits<DepthFormat::Unorm16> : UnormDepthTraits<16>
+{
+};
+
+template <>
+struct DepthTraits<DepthFormat::Unorm24> : UnormDepthTraits<24>
+{
+};
+
+// Calls f with std::integral_constant<DepthFormat, format>, so runtime formats
+// reach code templated on them
+template <typename F>
+decltype(auto) visitDepthFormat(DepthFormat format, const F &f)
+{
+    switch (format)
+    {
+    case DepthFormat::ReversedFloat:
+        return f(std::integral_constant<DepthFormat, DepthFormat::ReversedFloat>{});
+    case DepthFormat::Unorm16:
+        return f(std::integral_constant<DepthFormat, DepthFormat::Unorm16>{});
+    case DepthFormat::Unorm24:
+        return f(std::integral_constant<DepthFormat, DepthFormat::Unorm24>{});
+    case DepthFormat::Float:
+        break;
+    }
+
+    return f(std::integral_constant<DepthFormat, DepthFormat::Float>{});
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#include "spsc_queue.h"
+
+// Runs the geometry and the raster stage of consecutive frames on a thread each,
+// so frame N + 1 is binned while frame N is rasterized and frame N - 1 is
+// presented by the thread that submitted them. Frames leave in submission order.
+// Each stage sees one frame at a time. Frames carry whatever they draw into: the
+// caller keeps a target per frame in flight, fewer than QUEUE_CAPACITY.
+template <typename Frame_T>
+struct FramePipeline
+{
+    // More than the frames in flight, pushes between the stages never wait
+    static constexpr size_t QUEUE_CAPACITY = 4;
+
+    using Stage = std::function<void(Frame_T &)>;
+
+    FramePipeline(Stage geometry, Stage raster)
+        : m_geometry(std::move(geometry)),
+          m_raster(std::move(raster)),
+          m_finishedFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          m_geometryThread([this]()
+                           { geometryLoop(); }),
+          m_rasterThread([this]()
+                         { rasterLoop(); })
+    {
+    }
+
+    FramePipeline(const FramePipeline &) = delete;
+    FramePipeline &operator=(const FramePipeline &) = delete;
+
+    // Lets the frames already submitted finish, then stops the stages
+    ~FramePipeline()
+    {
+        m_toGeometry.push(std::nullopt);
+        m_geometryThread.join();
+        m_rasterThread.join();
+
+        if (m_finishedFd >= 0)
+        {
+            close(m_finishedFd);
+        }
+    }
+
+    // False while QUEUE_CAPACITY frames wait for the geometry stage
+    bool submit(Frame_T frame)
+    {
+        return m_toGeometry.tryPush(std::move(frame));
+    }
+
+    // The oldest frame both stages are done with, if there is one
+    std::optional<Frame_T> takeFinished()
+    {
+        // Reset before looking, a frame finishing meanwhile makes it readable again
+        uint64_t count;
+        std::ignore = read(m_finishedFd, &count, sizeof(count));
+
+        std::optional<Frame_T> frame;
+        m_finished.tryPop(frame);
+        return frame;
+    }
+
+    // Blocks until a frame is finished
+    Frame_T waitFinished()
+    {
+        return *m_finished.pop();
+    }
+
+    // Readable while finished frames may be waiting, for poll()
+    int getFinishedFd() const
+    {
+        return m_finishedFd;
+    }
+
+private:
+    // An empty optional is passed down to stop the stages
+    using Queue = SpscQueue<std::optional<Frame_T>, QUEUE_CAPACITY>;
+
+    void geometryLoop()
+    {
+        while (auto frame = m_toGeometry.pop())
+        {
+            m_geometry(*frame);
+            m_toRaster.push(std::move(frame));
+        }
+
+        m_toRaster.push(std::nullopt);
+    }
+
+    void rasterLoop()
+    {
+        while (auto frame = m_toRaster.pop())
+        {
+            m_raster(*frame);
+            m_finished.push(std::move(frame));
+
+            const uint64_t one = 1;
+            std::ignore = write(m_finishedFd, &one, sizeof(one));
+        }
+    }
+
+    Stage m_geometry;
+    Stage m_raster;
+    Queue m_toGeometry;
+    Queue m_toRaster;
+    Queue m_finished;
+    int m_finishedFd;
+    // Last, they start once everything they use is constructed
+    std::thread m_geometryThread;
+    std::thread m_rasterThread;
+};
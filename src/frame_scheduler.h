@@ -0,0 +1,78 @@
+#pragma once
+
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+
+// Paces the frames of the window loop. Between frames the thread sleeps in
+// ppoll() on the display connection, so input still wakes it up at once, and
+// while nothing needs drawing it sleeps until the server sends something.
+// Frame times come from the monotonic clock.
+struct FrameScheduler
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Longest step handed to the animation, after a stall or a pause it resumes
+    // where it was instead of jumping ahead
+    static constexpr auto MAX_FRAME_TIME = std::chrono::milliseconds{250};
+
+    // targetFps 0 renders frames back to back
+    explicit FrameScheduler(double targetFps)
+        : m_period(targetFps > 0.0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / targetFps)) : Clock::duration::zero()),
+          m_nextFrame(Clock::now()),
+          m_lastFrame(m_nextFrame)
+    {
+    }
+
+    bool isUncapped() const
+    {
+        return m_period == Clock::duration::zero();
+    }
+
+    bool isFrameDue() const
+    {
+        return isUncapped() || Clock::now() >= m_nextFrame;
+    }
+
+    // Blocks until fd or wakeFd is readable or, if a frame is wanted, until it
+    // is due. Returns whether one of them is readable.
+    bool wait(int fd, bool frameWanted, int wakeFd = -1) const
+    {
+        timespec timeout{};
+        timespec *deadline = nullptr;
+
+        if (frameWanted)
+        {
+            const auto left = std::max(Clock::duration::zero(), isUncapped() ? Clock::duration::zero() : m_nextFrame - Clock::now());
+            const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(left);
+            timeout = {.tv_sec = time_t(seconds.count()), .tv_nsec = long(std::chrono::duration_cast<std::chrono::nanoseconds>(left - seconds).count())};
+            deadline = &timeout;
+        }
+
+        // Negative descriptors are skipped
+        pollfd fds[] = {{.fd = fd, .events = POLLIN, .revents = 0}, {.fd = wakeFd, .events = POLLIN, .revents = 0}};
+        return ppoll(fds, 2, deadline, nullptr) > 0;
+    }
+
+    // Starts a frame and returns the seconds since the previous one
+    float beginFrame()
+    {
+        const auto now = Clock::now();
+        const auto elapsed = std::min<Clock::duration>(now - m_lastFrame, MAX_FRAME_TIME);
+        m_lastFrame = now;
+
+        // Due times stay on the grid of the period. A frame that ran more than a
+        // period late restarts the grid, the missed ones are not rendered back
+        // to back to catch up.
+        m_nextFrame = now - m_nextFrame > m_period ? now + m_period : m_nextFrame + m_period;
+
+        return std::chrono::duration<float>(elapsed).count();
+    }
+
+private:
+    Clock::duration m_period;
+    Clock::time_point m_nextFrame;
+    Clock::time_point m_lastFrame;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+template <typename T>
+struct Matrix3D
+{
+    T data[3][3];
+};
+
+template <typename T>
+struct Point
+{
+    T x;
+    T y;
+};
+
+template <typename T>
+struct Vector3D
+{
+    Point<T> as2DPoint() const
+    {
+        return Point<T>{.x = x, .y = y};
+    }
+
+    T x;
+    T y;
+    T z;
+};
+
+template <typename T>
+struct TexturedVertexType
+{
+    T x;
+    T y;
+    T z;
+
+    TexturedVertexType(const Vector3D<T> &from)
+        : x(from.x),
+          y(from.y),
+          z(from.z),
+          u(0),
+          v(0)
+    {
+    }
+
+    TexturedVertexType(T x, T y, T z, T u, T v)
+        : x(x),
+          y(y),
+          z(z),
+          u(u),
+          v(v)
+    {
+    }
+
+    Vector3D<T> getPointVector() const
+    {
+        return {x, y, z};
+    }
+
+    T u;
+    T v;
+};
+
+using Vector3DI32 = Vector3D<int32_t>;
+using Vector3DFloat = Vector3D<float>;
+using TexturedVertextFloat = TexturedVertexType<float>;
+using Matrix3DI32 = Matrix3D<int32_t>;
+using PointInt32 = Point<int32_t>;
+using PointFloat = Point<float>;
+
+// Axis aligned, min > max when empty
+struct BoundingBox
+{
+    void extend(const Vector3DFloat &point)
+    {
+        min = {std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z)};
+        max = {std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z)};
+    }
+
+    bool isEmpty() const
+    {
+        return min.x > max.x;
+    }
+
+    Vector3DFloat min = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+    Vector3DFloat max = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+};
+
+struct BoundingSphere
+{
+    // Encloses the box, looser than fromVertices but needs no vertex data
+    static BoundingSphere fromBox(const BoundingBox &box)
+    {
+        if (box.isEmpty())
+        {
+            return {};
+        }
+
+        const auto center = getBoxCenter(box);
+        return {center, distance(center, box.max)};
+    }
+
+    // Centered on the bounding box of the vertices, reaching the farthest one
+    template <typename Vertices_T>
+    static BoundingSphere fromVertices(const Vertices_T &vertices)
+    {
+        BoundingBox box;
+        for (const auto &vertice : vertices)
+        {
+            box.extend({vertice.x, vertice.y, vertice.z});
+        }
+
+        if (box.isEmpty())
+        {
+            return {};
+        }
+
+        BoundingSphere res{getBoxCenter(box), 0.0f};
+        for (const auto &vertice : vertices)
+        {
+            res.radius = std::max(res.radius, distance(res.center, {vertice.x, vertice.y, vertice.z}));
+        }
+
+        return res;
+    }
+
+    static Vector3DFloat getBoxCenter(const BoundingBox &box)
+    {
+        return {(box.min.x + box.max.x) * 0.5f, (box.min.y + box.max.y) * 0.5f, (box.min.z + box.max.z) * 0.5f};
+    }
+
+    static float distance(const Vector3DFloat &a, const Vector3DFloat &b)
+    {
+        return std::sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+    }
+
+    Vector3DFloat center = {0.0f, 0.0f, 0.0f};
+    // Negative when there is nothing to enclose
+    float radius = -1.0f;
+};
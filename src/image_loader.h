@@ -0,0 +1,330 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+// Decoders for the uncompressed image formats: binary PPM (P6, 8 bit), TGA (true
+// color, raw or run-length encoded, 24 or 32 bit) and BMP (BI_RGB or
+// BI_BITFIELDS, 24 or 32 bit). They read straight from the file contents, a
+// memory mapping in practice; rows stored as 32 bit BGRA are already in the
+// ARGB word layout and are copied as they are.
+//
+// onSize(width, height) is called once, then onRow(y, argb) for every row, in
+// file order, with y counted from the top. They return false on malformed or
+// unsupported files.
+
+namespace image_detail
+{
+    inline uint32_t readLe16(const uint8_t *p)
+    {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8);
+    }
+
+    inline uint32_t readLe32(const uint8_t *p)
+    {
+        return readLe16(p) | (readLe16(p + 2) << 16);
+    }
+
+    // Bytes per pixel 3 (BGR) or 4 (BGRA)
+    inline void convertBgrRow(const uint8_t *source, uint32_t width, uint32_t bytesPerPixel, bool hasAlpha, int32_t *row)
+    {
+        if (bytesPerPixel == 4 && hasAlpha)
+        {
+            memcpy(row, source, size_t(width) * 4);
+            return;
+        }
+
+        for (auto x = uint32_t{0}; x < width; x++)
+        {
+            const auto *p = source + size_t(x) * bytesPerPixel;
+            row[x] = int32_t(0xFF000000u | (uint32_t(p[2]) << 16) | (uint32_t(p[1]) << 8) | p[0]);
+        }
+    }
+
+    // Sizes that fit the int32_t texel indices of Texture
+    inline bool isSupportedSize(uint32_t width, uint32_t height)
+    {
+        constexpr auto MAX_SIZE = uint32_t{1} << 14;
+        return width > 0 && height > 0 && width <= MAX_SIZE && height <= MAX_SIZE;
+    }
+}
+
+template <typename Size_T, typename Row_T>
+bool decodePpm(std::string_view data, const Size_T &onSize, const Row_T &onRow)
+{
+    size_t pos = 2;
+
+    // Whitespace separated width, height and maximum value, # starts a comment
+    const auto readNumber = [&](uint32_t &value)
+    {
+        while (pos < data.size())
+        {
+            if (data[pos] == '#')
+            {
+                while (pos < data.size() && data[pos] != '\n')
+                {
+                    pos++;
+                }
+            }
+            else if (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' || data[pos] == '\n')
+            {
+                pos++;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        const auto start = pos;
+        value = 0;
+        while (pos < data.size() && data[pos] >= '0' && data[pos] <= '9' && pos - start < 9)
+        {
+            value = value * 10 + uint32_t(data[pos++] - '0');
+        }
+
+        return pos > start;
+    };
+
+    uint32_t width, height, maxValue;
+    if (data.size() < 2 || data[0] != 'P' || data[1] != '6' ||
+        !readNumber(width) || !readNumber(height) || !readNumber(maxValue) ||
+        maxValue != 255 || pos >= data.size() || !image_detail::isSupportedSize(width, height))
+    {
+        return false;
+    }
+
+    // A single whitespace character separates the header from the pixels
+    pos++;
+
+    const auto rowSize = size_t(width) * 3;
+    if (data.size() - pos < rowSize * height)
+    {
+        return false;
+    }
+
+    onSize(width, height);
+
+    std::vector<int32_t> row(width);
+    const auto *pixels = reinterpret_cast<const uint8_t *>(data.data() + pos);
+
+    for (auto y = uint32_t{0}; y < height; y++)
+    {
+        const auto *source = pixels + y * rowSize;
+        for (auto x = uint32_t{0}; x < width; x++)
+        {
+            row[x] = int32_t(0xFF000000u | (uint32_t(source[3 * x]) << 16) | (uint32_t(source[3 * x + 1]) << 8) | source[3 * x + 2]);
+        }
+
+        onRow(y, row.data());
+    }
+
+    return true;
+}
+
+template <typename Size_T, typename Row_T>
+bool decodeTga(std::string_view data, const Size_T &onSize, const Row_T &onRow)
+{
+    constexpr size_t HEADER_SIZE = 18;
+    constexpr uint8_t TRUE_COLOR = 2;
+    constexpr uint8_t TRUE_COLOR_RLE = 10;
+    constexpr uint8_t TOP_LEFT_ORIGIN = 0x20;
+
+    if (data.size() < HEADER_SIZE)
+    {
+        return false;
+    }
+
+    const auto *header = reinterpret_cast<const uint8_t *>(data.data());
+    const auto idLength = header[0];
+    const auto colorMapType = header[1];
+    const auto imageType = header[2];
+    const auto width = image_detail::readLe16(header + 12);
+    const auto height = image_detail::readLe16(header + 14);
+    const auto bitsPerPixel = header[16];
+    const auto topDown = (header[17] & TOP_LEFT_ORIGIN) != 0;
+
+    if (colorMapType != 0 || (imageType != TRUE_COLOR && imageType != TRUE_COLOR_RLE) ||
+        (bitsPerPixel != 24 && bitsPerPixel != 32) || !image_detail::isSupportedSize(width, height))
+    {
+        return false;
+    }
+
+    const auto bytesPerPixel = uint32_t(bitsPerPixel / 8);
+    const auto *pixels = header + HEADER_SIZE + idLength;
+    const auto *end = header + data.size();
+
+    if (pixels > end)
+    {
+        return false;
+    }
+
+    if (imageType == TRUE_COLOR && size_t(end - pixels) < size_t(width) * height * bytesPerPixel)
+    {
+        return false;
+    }
+
+    onSize(width, height);
+
+    std::vector<int32_t> row(width);
+
+    // Run-length packets may cross rows: count and value of the current one
+    uint32_t packetLeft = 0;
+    bool packetRepeats = false;
+    int32_t repeated = 0;
+
+    for (auto line = uint32_t{0}; line < height; line++)
+    {
+        if (imageType == TRUE_COLOR)
+        {
+            image_detail::convertBgrRow(pixels, width, bytesPerPixel, bytesPerPixel == 4, row.data());
+            pixels += size_t(width) * bytesPerPixel;
+        }
+        else
+        {
+            for (auto x = uint32_t{0}; x < width; x++)
+            {
+                if (packetLeft == 0)
+                {
+                    if (pixels >= end)
+                    {
+                        return false;
+                    }
+
+                    packetRepeats = (*pixels & 0x80) != 0;
+                    packetLeft = (*pixels & 0x7F) + 1u;
+                    pixels++;
+
+                    if (packetRepeats)
+                    {
+                        if (size_t(end - pixels) < bytesPerPixel)
+                        {
+                            return false;
+                        }
+
+                        image_detail::convertBgrRow(pixels, 1, bytesPerPixel, bytesPerPixel == 4, &repeated);
+                        pixels += bytesPerPixel;
+                    }
+                }
+
+                if (packetRepeats)
+                {
+                    row[x] = repeated;
+                }
+                else
+                {
+                    if (size_t(end - pixels) < bytesPerPixel)
+                    {
+                        return false;
+                    }
+
+                    image_detail::convertBgrRow(pixels, 1, bytesPerPixel, bytesPerPixel == 4, &row[x]);
+                    pixels += bytesPerPixel;
+                }
+
+                packetLeft--;
+            }
+        }
+
+        onRow(topDown ? line : height - 1 - line, row.data());
+    }
+
+    return true;
+}
+
+template <typename Size_T, typename Row_T>
+bool decodeBmp(std::string_view data, const Size_T &onSize, const Row_T &onRow)
+{
+    constexpr size_t FILE_HEADER_SIZE = 14;
+    constexpr size_t INFO_HEADER_SIZE = 40;
+    constexpr uint32_t BI_RGB = 0;
+    constexpr uint32_t BI_BITFIELDS = 3;
+
+    if (data.size() < FILE_HEADER_SIZE + INFO_HEADER_SIZE || data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+
+    const auto *file = reinterpret_cast<const uint8_t *>(data.data());
+    const auto *info = file + FILE_HEADER_SIZE;
+
+    const auto pixelOffset = image_detail::readLe32(file + 10);
+    const auto infoSize = image_detail::readLe32(info);
+    const auto width = int32_t(image_detail::readLe32(info + 4));
+    const auto signedHeight = int32_t(image_detail::readLe32(info + 8));
+    const auto planes = image_detail::readLe16(info + 12);
+    const auto bitsPerPixel = image_detail::readLe16(info + 14);
+    const auto compression = image_detail::readLe32(info + 16);
+
+    // Negative heights are stored top-down
+    const auto topDown = signedHeight < 0;
+    const auto height = uint32_t(topDown ? -int64_t(signedHeight) : signedHeight);
+
+    if (infoSize < INFO_HEADER_SIZE || planes != 1 || width <= 0 || (bitsPerPixel != 24 && bitsPerPixel != 32) ||
+        !image_detail::isSupportedSize(uint32_t(width), height))
+    {
+        return false;
+    }
+
+    // Only the standard BGRA masks are supported, BI_RGB has no alpha
+    auto hasAlpha = false;
+    if (compression == BI_BITFIELDS)
+    {
+        const auto *masks = info + INFO_HEADER_SIZE;
+        if (bitsPerPixel != 32 || data.size() < FILE_HEADER_SIZE + INFO_HEADER_SIZE + 12 ||
+            image_detail::readLe32(masks) != 0x00FF0000u || image_detail::readLe32(masks + 4) != 0x0000FF00u ||
+            image_detail::readLe32(masks + 8) != 0x000000FFu)
+        {
+            return false;
+        }
+
+        // The alpha mask follows the color masks in the larger headers, which
+        // a truncated file may only claim to have
+        hasAlpha = infoSize >= INFO_HEADER_SIZE + 16 && data.size() >= FILE_HEADER_SIZE + INFO_HEADER_SIZE + 16 &&
+                   image_detail::readLe32(masks + 12) == 0xFF000000u;
+    }
+    else if (compression != BI_RGB)
+    {
+        return false;
+    }
+
+    const auto bytesPerPixel = uint32_t(bitsPerPixel / 8);
+    // Rows are padded to 4 bytes
+    const auto stride = (size_t(width) * bytesPerPixel + 3) & ~size_t{3};
+
+    if (pixelOffset > data.size() || (data.size() - pixelOffset) / stride < height)
+    {
+        return false;
+    }
+
+    onSize(uint32_t(width), height);
+
+    std::vector<int32_t> row(width);
+
+    for (auto line = uint32_t{0}; line < height; line++)
+    {
+        image_detail::convertBgrRow(file + pixelOffset + line * stride, uint32_t(width), bytesPerPixel, hasAlpha, row.data());
+        onRow(topDown ? line : height - 1 - line, row.data());
+    }
+
+    return true;
+}
+
+// Picks the decoder from the file signature (PPM, BMP) or falls back to TGA, which has none
+template <typename Size_T, typename Row_T>
+bool decodeImage(std::string_view data, const Size_T &onSize, const Row_T &onRow)
+{
+    if (data.starts_with("P6"))
+    {
+        return decodePpm(data, onSize, onRow);
+    }
+
+    if (data.starts_with("BM"))
+    {
+        return decodeBmp(data, onSize, onRow);
+    }
+
+    return decodeTga(data, onSize, onRow);
+}
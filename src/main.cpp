@@ -3,7 +3,10 @@
 #include <stdlib.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
-#include <iostream>
+#include <X11/extensions/XShm.h>
+#include <X11/keysym.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include <cassert>
 
@@ -17,6 +20,34 @@
 #include <cassert>
 #include <fstream>
 #include <limits>
+#include <span>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "geometry.h"
+#include "obj_loader.h"
+#include "mesh_cache.h"
+#include "texture.h"
+#include "texture_manager.h"
+#include "perf_counter.h"
+#include "depth_format.h"
+#include "profiler.h"
+#include "transform.h"
+#include "models.h"
+#include "pixel_buffer.h"
+#include "tiled_rasterizer.h"
+#include "renderer.h"
+#include "frame_scheduler.h"
+#include "frame_pipeline.h"
+
 bool quited = false;
 
 static constexpr auto colorIndices = std::array{
@@ -27,1052 +58,1701 @@ static constexpr auto colorIndices = std::array{
     0xFFFFFF00,
 };
 
-template <typename T>
-struct Matrix3D
-{
-    T data[3][3];
-};
-
-template <typename T>
-struct Point
+// Owns the XImages frames are rasterized into, one per frame in flight. With
+// MIT-SHM the images live in shared memory segments the server reads directly,
+// otherwise it falls back to client side XImages pushed through the socket with
+// XPutImage.
+struct X11Presenter
 {
-    T x;
-    T y;
-};
-
-template <typename T>
-struct Vector3D
-{
-    Point<T> as2DPoint() const
+    X11Presenter(Display *display, Window window, GC gc, int32_t width, int32_t height, bool allowShm, size_t imageCount = 1)
+        : m_display(display),
+          m_window(window),
+          m_gc(gc),
+          m_width(width),
+          m_height(height),
+          m_images(imageCount)
     {
-        return Point<T>{.x = x, .y = y};
+        if (allowShm && XShmQueryExtension(display) && createShmImages())
+        {
+            m_completionType = XShmGetEventBase(display) + ShmCompletion;
+            return;
+        }
+
+        for (auto &image : m_images)
+        {
+            createPlainImage(image);
+        }
     }
 
-    T x;
-    T y;
-    T z;
-};
+    X11Presenter(const X11Presenter &) = delete;
+    X11Presenter &operator=(const X11Presenter &) = delete;
 
-template <typename T>
-struct TexturedVertexType
-{
-    T x;
-    T y;
-    T z;
+    ~X11Presenter()
+    {
+        for (auto i = size_t{0}; i < m_images.size(); i++)
+        {
+            if (m_usesShm)
+            {
+                waitForPresent(i);
+            }
+
+            destroyImage(m_images[i]);
+        }
+    }
 
-    TexturedVertexType(const Vector3D<T> &from)
-        : x(from.x),
-          y(from.y),
-          z(from.z),
-          u(0),
-          v(0)
+    int32_t *pixels(size_t image = 0) const
     {
+        return reinterpret_cast<int32_t *>(m_images[image].image->data);
     }
 
-    TexturedVertexType(T x, T y, T z, T u, T v)
-        : x(x),
-          y(y),
-          z(z),
-          u(u),
-          v(v)
+    size_t getImageCount() const
     {
+        return m_images.size();
     }
 
-    Vector3D<T> getPointVector() const
+    bool usesShm() const
     {
-        return {x, y, z};
+        return m_usesShm;
     }
 
-    T u;
-    T v;
-};
+    // overlay lines are drawn as text over the image, in the window only
+    void present(const std::vector<std::string> &overlay = {}, size_t image = 0)
+    {
+        auto &presented = m_images[image];
 
-using Vector3DI32 = Vector3D<int32_t>;
-using Vector3DFloat = Vector3D<float>;
-using TexturedVertextFloat = TexturedVertexType<float>;
-using Matrix3DI32 = Matrix3D<int32_t>;
-using PointInt32 = Point<int32_t>;
-using PointFloat = Point<float>;
+        if (m_usesShm)
+        {
+            XShmPutImage(m_display, m_window, m_gc, presented.image, 0, 0, 0, 0, m_width, m_height, True);
+            presented.presentPending = true;
+        }
+        else
+        {
+            std::ignore = XPutImage(m_display, m_window, m_gc, presented.image, 0, 0, 0, 0, m_width, m_height);
+        }
 
-Vector3DFloat readVector(const std::string_view &line)
-{
-    auto currSpacePos = line.find_first_of(' ');
+        if (!overlay.empty())
+        {
+            constexpr auto LINE_HEIGHT = 14;
+
+            XSetForeground(m_display, m_gc, BlackPixel(m_display, DefaultScreen(m_display)));
+            for (auto i = size_t{0}; i < overlay.size(); i++)
+            {
+                XDrawString(m_display, m_window, m_gc, 8, int(LINE_HEIGHT * (i + 1)), overlay[i].c_str(), int(overlay[i].size()));
+            }
+        }
 
-    float v[4] = {};
-    size_t i = 0;
+        XFlush(m_display);
+    }
 
-    while (currSpacePos != std::string::npos)
+    // The server reads a shared segment asynchronously, it must not be written
+    // again until the completion event for the last put of it arrives
+    bool isPresenting(size_t image) const
     {
-        auto nextSpacePos = line.find_first_of(' ', currSpacePos + 1);
-        const auto end = nextSpacePos != std::string::npos ? line.begin() + nextSpacePos : line.end();
-        std::string buffer{line.begin() + currSpacePos, end};
-        float val = (float)atof(buffer.c_str());
-        v[i] = val;
-        i++;
-        currSpacePos = nextSpacePos;
-        assert(i < sizeof(v));
+        return m_images[image].presentPending;
     }
 
-    return {.x = v[0], .y = v[1], .z = v[2]};
-}
-
-std::tuple<int, int, int> readFace(const std::string_view &line)
-{
-    auto currSpacePos = line.find_first_of(' ');
+    void waitForPresent(size_t image = 0)
+    {
+        if (!m_images[image].presentPending)
+        {
+            return;
+        }
 
-    int f[4] = {};
-    size_t i = 0;
+        m_waitedImage = &m_images[image];
+        XEvent event;
+        XIfEvent(m_display, &event, &X11Presenter::isCompletionEvent, reinterpret_cast<XPointer>(this));
+        m_images[image].presentPending = false;
+    }
 
-    while (currSpacePos != std::string::npos)
+    // Completion events may also be pulled by the main event loop
+    bool handleEvent(const XEvent &event)
     {
-        auto nextSpacePos = line.find_first_of(' ', currSpacePos + 1);
-        const auto end = nextSpacePos != std::string::npos ? line.begin() + nextSpacePos : line.end();
-        std::string buffer{line.begin() + currSpacePos, end};
-        int val = atoi(buffer.c_str());
-        assert(val > 0);
-        f[i] = val - 1;
-        i++;
-        currSpacePos = nextSpacePos;
-        assert(i < sizeof(f));
+        if (!m_usesShm || event.type != m_completionType)
+        {
+            return false;
+        }
+
+        for (auto &image : m_images)
+        {
+            if (image.shmInfo.shmseg == reinterpret_cast<const XShmCompletionEvent &>(event).shmseg)
+            {
+                image.presentPending = false;
+            }
+        }
+
+        return true;
     }
 
-    return {f[0], f[1], f[2]};
-}
+private:
+    struct Image
+    {
+        XImage *image = nullptr;
+        // Referenced by the XImage, so images are never moved once created
+        XShmSegmentInfo shmInfo = {};
+        bool presentPending = false;
+    };
 
-std::vector<TexturedVertextFloat> loadObjFile(const std::string &filename)
-{
-    std::ifstream objFile{filename};
+    static int ignoreXError(Display *, XErrorEvent *)
+    {
+        s_attachFailed = true;
+        return 0;
+    }
 
-    if (!objFile.is_open())
+    static Bool isCompletionEvent(Display *, XEvent *event, XPointer self)
     {
-        std::cout << "Could not open file " << filename << std::endl;
-        return {};
+        const auto *presenter = reinterpret_cast<X11Presenter *>(self);
+        return event->type == presenter->m_completionType &&
+               reinterpret_cast<XShmCompletionEvent *>(event)->shmseg == presenter->m_waitedImage->shmInfo.shmseg;
     }
 
-    std::vector<Vector3DFloat> allVertices;
-    std::vector<std::tuple<int, int, int>> allFaces;
+    // All or none, the images are presented the same way
+    bool createShmImages()
+    {
+        for (auto &image : m_images)
+        {
+            if (!createShmImage(image))
+            {
+                for (auto &created : m_images)
+                {
+                    destroyImage(created);
+                }
+                return false;
+            }
+        }
 
-    std::string linebuffer;
-    while (std::getline(objFile, linebuffer))
+        m_usesShm = true;
+        return true;
+    }
+
+    bool createShmImage(Image &target)
     {
-        if (linebuffer[0] == 'v')
+        const auto screen = DefaultScreen(m_display);
+        auto &shmInfo = target.shmInfo;
+
+        auto *image = XShmCreateImage(m_display, DefaultVisual(m_display, screen), DefaultDepth(m_display, screen),
+                                      ZPixmap, nullptr, &shmInfo, m_width, m_height);
+        if (image == nullptr)
         {
-            allVertices.emplace_back(readVector(linebuffer));
+            return false;
         }
-        else if (linebuffer[0] == 'f')
+
+        if (image->bits_per_pixel != 32 || image->bytes_per_line != m_width * (int32_t)sizeof(int32_t))
         {
-            allFaces.emplace_back(readFace(linebuffer));
+            XDestroyImage(image);
+            return false;
         }
-        // empty line
-        else if (linebuffer.size() < 2)
+
+        shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+        if (shmInfo.shmid < 0)
         {
-            continue;
+            XDestroyImage(image);
+            return false;
         }
-        else
+
+        shmInfo.shmaddr = image->data = static_cast<char *>(shmat(shmInfo.shmid, nullptr, 0));
+        shmInfo.readOnly = False;
+
+        if (shmInfo.shmaddr == reinterpret_cast<char *>(-1))
         {
-            assert(0 && "Not implemented");
+            shmInfo.shmaddr = nullptr;
+            shmctl(shmInfo.shmid, IPC_RMID, nullptr);
+            image->data = nullptr;
+            XDestroyImage(image);
+            return false;
         }
+
+        // Attaching fails with BadAccess on a remote server, which would otherwise kill the client
+        s_attachFailed = false;
+        const auto previousHandler = XSetErrorHandler(&X11Presenter::ignoreXError);
+        XShmAttach(m_display, &shmInfo);
+        XSync(m_display, False);
+        XSetErrorHandler(previousHandler);
+
+        // Marked for removal now, the segment goes away once both sides detach
+        shmctl(shmInfo.shmid, IPC_RMID, nullptr);
+
+        if (s_attachFailed)
+        {
+            shmdt(shmInfo.shmaddr);
+            shmInfo.shmaddr = nullptr;
+            image->data = nullptr;
+            XDestroyImage(image);
+            return false;
+        }
+
+        target.image = image;
+        return true;
     }
 
-    std::vector<TexturedVertextFloat> res;
+    void createPlainImage(Image &target)
+    {
+        // Released by XDestroyImage, so it has to come from malloc
+        auto pixelData = static_cast<int32_t *>(calloc(m_width * m_height, sizeof(int32_t)));
+
+        target.image = XCreateImage(m_display, CopyFromParent, DefaultDepth(m_display, DefaultScreen(m_display)), ZPixmap, 0,
+                                    (char *)pixelData, m_width, m_height, 32, m_width * sizeof(int32_t));
+    }
 
-    for (const auto &[a, b, c] : allFaces)
+    void destroyImage(Image &target)
     {
-        assert(a < (int)allVertices.size());
-        assert(b < (int)allVertices.size());
-        assert(c < (int)allVertices.size());
+        if (target.image == nullptr)
+        {
+            return;
+        }
 
-        res.push_back(allVertices[a]);
-        res.push_back(allVertices[b]);
-        res.push_back(allVertices[c]);
+        if (target.shmInfo.shmaddr != nullptr)
+        {
+            XShmDetach(m_display, &target.shmInfo);
+            XDestroyImage(target.image);
+            shmdt(target.shmInfo.shmaddr);
+        }
+        else
+        {
+            XDestroyImage(target.image);
+        }
+
+        target.image = nullptr;
     }
 
-    return res;
-}
+    static inline bool s_attachFailed = false;
 
-Vector3DFloat toScreenSpace(const Vector3DFloat &vec, int32_t screenWidth, int32_t screenHeight)
-{
-    return {
-        .x = (vec.x + 1.0f) * (screenWidth / 2.0f),
-        .y = (-vec.y + 1.0f) * (screenHeight / 2.0f),
-        .z = vec.z};
-}
+    Display *m_display;
+    Window m_window;
+    GC m_gc;
+    int32_t m_width;
+    int32_t m_height;
+    std::vector<Image> m_images;
+    // The one waitForPresent() is waiting for
+    const Image *m_waitedImage = nullptr;
+    bool m_usesShm = false;
+    int m_completionType = -1;
+};
 
-Vector3DFloat applyNonOrthoProj(const Vector3DFloat &vec)
+void on_delete(Display *display, Window window)
 {
-    return {
-        .x = vec.x / vec.z,
-        .y = vec.y / vec.z,
-        .z = vec.z};
+    XDestroyWindow(display, window);
+    quited = true;
 }
 
-std::vector<TexturedVertextFloat> getTranslated(const Vector3DFloat &transl, const std::vector<TexturedVertextFloat> &vertices)
+// Received X events as text, written out in one go per batch of events rather
+// than flushed line by line
+struct EventLog
 {
-    std::vector<TexturedVertextFloat> res = vertices;
+    explicit EventLog(bool enabled)
+        : m_enabled(enabled)
+    {
+    }
 
-    for (auto &vertice : res)
+    void add(const XEvent &event)
     {
-        vertice.x += transl.x;
-        vertice.y += transl.y;
-        vertice.z += transl.z;
+        if (m_enabled)
+        {
+            m_buffer += "Got event: " + std::to_string(event.type) + "\n";
+        }
     }
 
-    return res;
-}
+    void flush()
+    {
+        if (!m_buffer.empty())
+        {
+            fwrite(m_buffer.data(), 1, m_buffer.size(), stdout);
+            fflush(stdout);
+            m_buffer.clear();
+        }
+    }
 
-std::vector<TexturedVertextFloat> getRotatedZ(float angle, const std::vector<TexturedVertextFloat> &vertices)
-{
-    const auto cosangle = cosf(angle);
-    const auto sinangle = sinf(angle);
+private:
+    bool m_enabled;
+    std::string m_buffer;
+};
 
-    std::vector<TexturedVertextFloat> res = vertices;
+// What the window's events asked for
+struct WindowInput
+{
+    bool paused = false;
+    // Something other than the animation changed, the next frame is wanted even when paused
+    bool needsRedraw = true;
+};
 
-    for (auto &vertice : res)
+// Handles the events Xlib has queued or can read without blocking
+void handleWindowEvents(Display *display, Atom wmDeleteWindow, X11Presenter &presenter, EventLog &eventLog, WindowInput &input)
+{
+    XEvent event;
+    while (XPending(display) > 0)
     {
-        const auto nx = cosangle * vertice.x - sinangle * vertice.y;
-        const auto ny = sinangle * vertice.x + cosangle * vertice.y;
+        XNextEvent(display, &event);
+        eventLog.add(event);
+
+        if (presenter.handleEvent(event))
+        {
+            continue;
+        }
 
-        vertice.x = nx;
-        vertice.y = ny;
+        switch (event.type)
+        {
+        case ClientMessage:
+        {
+            if (event.xclient.data.l[0] == (long)wmDeleteWindow)
+            {
+                on_delete(event.xclient.display, event.xclient.window);
+            }
+        }
+        break;
+        case Expose:
+            input.needsRedraw = true;
+            break;
+        case ButtonPress:
+        case ButtonRelease:
+        case EnterNotify:
+        case MotionNotify:
+        case LeaveNotify:
+            // if(_mouseHandler)
+            //     _mouseHandler->HandleInput(lDisplay, &xEvent);
+            break;
+        case KeyPress:
+            if (XLookupKeysym(&event.xkey, 0) == XK_space)
+            {
+                input.paused = !input.paused;
+            }
+            break;
+        case KeyRelease:
+            // if(_keyboardHandler)
+            //     _keyboardHandler->HandleInput(lDisplay, &xEvent);
+            break;
+        default:
+            // if(_keyboardHandler)
+            //     _keyboardHandler->HandleInput(lDisplay, &xEvent);
+            break;
+        }
     }
 
-    return res;
+    eventLog.flush();
 }
 
-std::vector<TexturedVertextFloat> getRotatedX(float angle, const std::vector<TexturedVertextFloat> &vertices)
+struct SceneState
 {
-    const auto cosangle = cosf(angle);
-    const auto sinangle = sinf(angle);
-
-    std::vector<TexturedVertextFloat> res = vertices;
+    // The animation moves by one step every 1/60 s. Headless frames are one step
+    // each, so their output does not depend on how long they take.
+    static constexpr float STEPS_PER_SECOND = 60.0f;
 
-    for (auto &vertice : res)
+    void step(float steps = 1.0f)
     {
-        const auto ny = cosangle * vertice.y - sinangle * vertice.z;
-        const auto nz = sinangle * vertice.y + cosangle * vertice.z;
+        // anglez += 0.01f * steps;
+        // anglex += 0.002f * steps;
+        angley += 0.002f * steps;
 
-        vertice.y = ny;
-        vertice.z = nz;
+        angley = clampAngle(angley);
+        anglex = clampAngle(anglex);
+        anglez = clampAngle(anglez);
     }
 
-    return res;
-}
+    float anglez = 0.0f;
+    float anglex = 3.14159f * 0.0;
+    float angley = 0.0f;
+    Camera camera;
+};
 
-std::vector<TexturedVertextFloat> getRotatedY(float angle, const std::vector<TexturedVertextFloat> &vertices)
+struct SceneAssets
 {
-    const auto cosangle = cosf(angle);
-    const auto sinangle = sinf(angle);
-
-    std::vector<TexturedVertextFloat> res = vertices;
-
-    for (auto &vertice : res)
+    ObjModel utahTeaPot;
+    CubeModel cube;
+    Texture texture;
+    SimpleQuadModel quad;
+    Scene crowd;
+    // Loaded with --texture, replaces the checker texture
+    std::shared_ptr<const Texture> fileTexture;
+
+    const Texture &getTexture() const
     {
-        const auto nx = cosangle * vertice.x + sinangle * vertice.z;
-        const auto nz = -sinangle * vertice.x + cosangle * vertice.z;
-
-        vertice.x = nx;
-        vertice.z = nz;
+        return fileTexture ? *fileTexture : texture;
     }
+};
 
-    return res;
+// "crowd": CROWD_GRID x CROWD_GRID cubes and teapots around the camera
+static constexpr int32_t CROWD_GRID = 64;
+static constexpr float CROWD_SPACING = 4.0f;
+// One instance in CROWD_TEAPOT_EVERY is a teapot, the rest are cubes
+static constexpr int32_t CROWD_TEAPOT_EVERY = 8;
+// One instance in CROWD_MOVER_EVERY bobs up and down, which refits the hierarchy
+static constexpr int32_t CROWD_MOVER_EVERY = 16;
+
+Matrix4DFloat getCrowdTransform(int32_t instance, float time)
+{
+    const auto column = instance % CROWD_GRID - CROWD_GRID / 2;
+    const auto row = instance / CROWD_GRID - CROWD_GRID / 2;
+    const auto bob = instance % CROWD_MOVER_EVERY == 0 ? std::sin(time * 40.0f + instance) : 0.0f;
+    const auto scale = instance % CROWD_TEAPOT_EVERY == 0 ? 0.35f : 1.0f;
+
+    return Matrix4DFloat::translation({column * CROWD_SPACING, -2.0f + bob, row * CROWD_SPACING}) *
+           Matrix4DFloat::rotationY(float(instance)) *
+           Matrix4DFloat::scale(scale);
 }
 
-struct ObjModel
+void buildCrowd(SceneAssets &assets)
 {
-    static ObjModel fromObjFile(const std::string &filename)
+    const auto teapot = assets.crowd.addMesh(assets.utahTeaPot);
+    const auto cube = assets.crowd.addMesh(ObjModel::fromTriangles(assets.cube.vertices));
+
+    for (auto i = 0; i < CROWD_GRID * CROWD_GRID; i++)
     {
-        return ObjModel{loadObjFile(filename)};
+        assets.crowd.addInstance(i % CROWD_TEAPOT_EVERY == 0 ? teapot : cube, getCrowdTransform(i, 0.0f), assets.getTexture());
     }
-    ObjModel getTranslated(const Vector3DFloat &transl) const
+}
+
+// Per frame changes of the assets themselves, before anything is drawn
+void animateScene(const std::string &scene, const SceneState &state, SceneAssets &assets)
+{
+    if (scene == "crowd")
     {
-        return ObjModel{::getTranslated(transl, vertices)};
+        for (auto i = 0; i < CROWD_GRID * CROWD_GRID; i += CROWD_MOVER_EVERY)
+        {
+            assets.crowd.setTransform(i, getCrowdTransform(i, state.angley));
+        }
     }
+}
+
+// Same draws for the X11 window and the headless backend. The single models go
+// through a DrawList, drawn in drawOrder before the texture is put on top.
+template <typename Target_T>
+SceneStats drawScene(Target_T &target, const std::string &scene, const SceneState &state, SceneAssets &assets, DrawOrder drawOrder)
+{
+    SceneStats sceneStats;
 
-    ObjModel getRotatedZ(float angle) const
+    thread_local DrawList<Target_T> draws;
+
+    const auto view = state.camera.getViewMatrix();
+    const auto modelView = [&](const Vector3DFloat &pos)
     {
-        return ObjModel{::getRotatedZ(angle, vertices)};
-    }
+        return view * getModelMatrix(state.anglez, state.anglex, state.angley, pos);
+    };
 
-    ObjModel getRotatedX(float angle) const
+    if (scene == "cube" || scene == "all")
     {
-        return ObjModel{::getRotatedX(angle, vertices)};
+        draws.add(assets.cube, modelView({1.5f, 0.0f, 3.0f}), assets.getTexture());
     }
 
-    ObjModel getRotatedY(float angle) const
+    if (scene == "teapot" || scene == "all")
     {
-        return ObjModel{::getRotatedY(angle, vertices)};
+        draws.add(assets.utahTeaPot, modelView({-2.0f, -1.5f, 9.0f}), assets.getTexture());
     }
 
-    std::vector<TexturedVertextFloat> vertices = {};
-};
-
-struct SimpleTriangleModel
-{
-    SimpleTriangleModel getTranslated(const Vector3DFloat &transl) const
+    // Same teapot repeated behind itself, drawn front to back
+    if (scene == "teapots")
     {
-        return SimpleTriangleModel{::getTranslated(transl, vertices)};
+        std::array<MeshInstance, 6> instances;
+        for (auto i = 0; i < 6; i++)
+        {
+            instances[i] = {getModelMatrix(state.anglez, state.anglex, state.angley, {-0.3f * i, -1.5f, 9.0f + 2.0f * i}), &assets.getTexture()};
+        }
+
+        drawInstances(target, assets.utahTeaPot, view, std::span<const MeshInstance>{instances});
     }
 
-    SimpleTriangleModel getRotatedZ(float angle) const
+    // Teapot wider than the view and spinning through the near plane, plus a
+    // cube behind the camera that frustum culling drops
+    if (scene == "near")
     {
-        return SimpleTriangleModel{::getRotatedZ(angle, vertices)};
+        draws.add(assets.utahTeaPot, modelView({1.0f, -1.0f, 3.0f}), assets.getTexture());
+        draws.add(assets.cube, modelView({0.0f, 0.0f, -5.0f}), assets.getTexture());
     }
 
-    SimpleTriangleModel getRotatedX(float angle) const
+    // Camera turning in the middle of the crowd, low enough for the nearest
+    // instances to hide the ones behind them
+    if (scene == "crowd")
     {
-        return SimpleTriangleModel{::getRotatedX(angle, vertices)};
+        auto camera = state.camera;
+        camera.position.y = -1.5f;
+        camera.yaw = state.angley * 10.0f;
+
+        sceneStats += assets.crowd.draw(target, camera.getViewMatrix());
     }
 
-    SimpleTriangleModel getRotatedY(float angle) const
+    if (scene == "quad" || scene == "all")
     {
-        return SimpleTriangleModel{::getRotatedY(angle, vertices)};
+        draws.add(assets.quad, modelView({0.2f, 0.0f, 1.2f}), assets.getTexture(), false);
     }
 
-    std::vector<TexturedVertextFloat> vertices = {
-        // {-0.7f, -0.5f, 6.0f, 0.0f, 0.0f},
-        // {0.7f, -0.25f, 6.0f, 1.0f, 0.0f},
-        // {0.0f, 0.5f, 6.0f, 1.0f, 1.0f},
-
-        {-0.7f, -0.5f, 0.0f, 0.0f, 0.0f},
-        {0.7f, -0.25f, 0.0f, 1.0f, 0.0f},
-        {0.0f, 0.5f, 0.0f, 1.0f, 1.0f},
+    draws.submit(target, drawOrder);
 
-        // {-0.5f, -0.5f, 5.0f},
-        // {0.5f, -0.45f, 5.0f},
-        // {0.0f, 0.5f, 5.0f},
+    if (scene == "quad" || scene == "all")
+    {
+        const auto &texture = assets.getTexture();
+        for (auto y = 0ull; y < texture.m_height && y < (uint32_t)target.getHeight(); y++)
+        {
+            for (auto x = 0ull; x < texture.m_width && x < (uint32_t)target.getWidth(); x++)
+            {
+                target.putPixel({(int)x, (int)y}, texture.getTexel(x, y));
+            }
+        }
+    }
 
-    };
-};
+    return sceneStats;
+}
 
-struct SimpleQuadModel
+// More than one thread goes through the tile binner, a single one draws directly
+SceneStats renderScene(ScreenBuffer &screenBuffer, TiledRasterizer &tiledRasterizer, int32_t threads,
+                       const std::string &scene, const SceneState &state, SceneAssets &assets, DrawOrder drawOrder)
 {
-    SimpleQuadModel getTranslated(const Vector3DFloat &transl) const
-    {
-        return SimpleQuadModel{::getTranslated(transl, vertices)};
-    }
+    animateScene(scene, state, assets);
 
-    SimpleQuadModel getRotatedZ(float angle) const
+    if (threads > 1)
     {
-        return SimpleQuadModel{::getRotatedZ(angle, vertices)};
+        const auto stats = drawScene(tiledRasterizer, scene, state, assets, drawOrder);
+
+        const ScopedTimer timer{ProfileStage::Raster};
+        tiledRasterizer.flush();
+
+        return stats;
     }
 
-    SimpleQuadModel getRotatedX(float angle) const
+    return drawScene(screenBuffer, scene, state, assets, drawOrder);
+}
+
+SceneAssets loadSceneAssets(const std::string &scene, TextureManager &textureManager, const std::string &texturePath)
+{
+    const auto needsTeaPot = scene == "teapot" || scene == "teapots" || scene == "near" || scene == "crowd" || scene == "all";
+
+    SceneAssets assets{
+        .utahTeaPot = needsTeaPot ? ObjModel::fromCachedObjFile("assets/teapot.obj") : ObjModel{},
+        .cube = CubeModel{},
+        .texture = makeCheckerTexture(),
+        .quad = SimpleQuadModel{},
+        .crowd = {},
+        .fileTexture = texturePath.empty() ? nullptr : textureManager.load(texturePath)};
+
+    if (!texturePath.empty() && !assets.fileTexture)
     {
-        return SimpleQuadModel{::getRotatedX(angle, vertices)};
+        fprintf(stderr, "Using the checker texture instead of %s\n", texturePath.c_str());
     }
 
-    SimpleQuadModel getRotatedY(float angle) const
+    if (scene == "crowd")
     {
-        return SimpleQuadModel{::getRotatedY(angle, vertices)};
+        buildCrowd(assets);
     }
 
-    std::vector<TexturedVertextFloat> vertices = {
-        {-0.5f, -0.5f, 0.0f, 0.0f, 1.0f},
-        {-0.5f, 0.5f, 0.0f, 0.0f, 0.0f},
-        {0.5f, -0.5f, 0.0f, 1.0f, 1.0f},
+    return assets;
+}
 
-        {0.5f, -0.5f, 0.0f, 1.0f, 1.0f},
-        {0.5f, 0.5f, 0.0f, 1.0f, 0.0f},
-        {-0.5f, 0.5f, 0.0f, 0.0f, 0.0f},
-    };
+struct RenderOptions
+{
+    bool headless = false;
+    bool useShm = true;
+    int32_t width = 720;
+    int32_t height = 720;
+    int32_t frames = 100;
+    RasterMode rasterMode = RasterMode::Scanline;
+    SimdIsa simdIsa = detectSimdIsa();
+    TextureFilter textureFilter = TextureFilter::Nearest;
+    DepthFormat depthFormat = DepthFormat::Float;
+    bool benchRaster = false;
+    bool benchTransform = false;
+    bool benchTexture = false;
+    bool benchDepth = false;
+    bool hierarchicalZ = true;
+    DrawOrder drawOrder = DrawOrder::FrontToBack;
+    // Nearest triangles of large meshes first, see sortTrianglesByDepth
+    bool triangleDepthSort = false;
+    // Colours pixels by how often they were written instead of texturing them
+    bool overdraw = false;
+    // Frame rate of the window, 0 renders as fast as possible
+    double targetFps = 60.0;
+    // Prints the X events the window receives
+    bool logEvents = false;
+    // Geometry and rasterization on threads of their own, see FramePipeline
+    bool pipeline = false;
+    // Stage timings: a summary (headless) or an overlay (window), and JSON lines
+    bool profile = false;
+    std::string profileJson;
+    // Image file for the models instead of the checker texture, and the memory
+    // the texture manager may keep resident
+    std::string texture;
+    size_t textureBudgetMb = 256;
+    int32_t threads = std::max(1, (int32_t)std::thread::hardware_concurrency());
+    // "{}" is replaced by the frame number, otherwise only the last frame is written
+    std::string output;
+    std::string scene = "quad";
 };
 
-struct CubeModel
+void printUsage(const char *program)
 {
-    CubeModel getTranslated(const Vector3DFloat &transl) const
-    {
-        return CubeModel{::getTranslated(transl, vertices)};
-    }
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --headless           render offscreen, no X server needed\n"
+            "  --no-shm             present with plain XPutImage even if MIT-SHM is available\n"
+            "  --width <pixels>     framebuffer width (default 720)\n"
+            "  --height <pixels>    framebuffer height (default 720)\n"
+            "  --frames <count>     frames to render in headless mode (default 100)\n"
+            "  --output <file>      write frames as .ppm or .raw, \"{}\" expands to the frame number\n"
+            "  --scene <name>       quad, cube, teapot, teapots, near, crowd or all (default quad)\n"
+            "  --raster <mode>      scanline or edge (half-space) triangle rasterizer (default scanline)\n"
+            "  --simd <isa>         edge rasterizer kernel: scalar, sse4.1 or avx2 (default: best supported)\n"
+            "  --filter <mode>      texture filtering: nearest, bilinear or trilinear (default nearest)\n"
+            "  --depth <format>     depth buffer: float, reversed (1/z), unorm16 or unorm24 (default float)\n"
+            "  --texture <file>     PPM, TGA or BMP image for the models (default: generated checker)\n"
+            "  --texture-budget <MB> memory kept for loaded textures (default 256)\n"
+            "  --bench-raster       measure edge rasterizer pixels per second for every supported kernel\n"
+            "  --bench-transform    measure vertex transform throughput, AoS against SoA kernels\n"
+            "  --bench-texture      measure texels per second and cache misses sampling a large texture\n"
+            "  --bench-depth        measure depth test throughput and depth buffer traffic for every format\n"
+            "  --profile            time the frame stages, print percentiles (headless) or overlay them (window)\n"
+            "  --profile-json <file> write stage times and counters of every frame as JSON lines\n"
+            "  --no-hiz             disable hierarchical z-buffer rejection\n"
+            "  --draw-order <order> opaque models: front-to-back or source (default front-to-back)\n"
+            "  --sort-triangles     draw the triangles of large meshes in coarse front to back depth buckets\n"
+            "  --overdraw           colour pixels by write count (black 0, blue 1, ... red 6, white 7+) and report it\n"
+            "  --fps <rate>         window frame rate, or \"uncapped\" (default 60); space pauses the animation\n"
+            "  --log-events         print the X events the window receives\n"
+            "  --pipeline           bin, rasterize and present consecutive frames concurrently, up to 3 in flight\n"
+            "  --threads <count>    rasterizer threads, 1 disables tile binning (default: all cores)\n",
+            program);
+}
 
-    CubeModel getRotatedZ(float angle) const
+bool parseOptions(int argc, char **argv, RenderOptions &options)
+{
+    for (auto i = 1; i < argc; i++)
     {
-        return CubeModel{::getRotatedZ(angle, vertices)};
+        const std::string_view arg{argv[i]};
+        const auto hasValue = i + 1 < argc;
+
+        if (arg == "--headless")
+        {
+            options.headless = true;
+        }
+        else if (arg == "--no-shm")
+        {
+            options.useShm = false;
+        }
+        else if (arg == "--width" && hasValue)
+        {
+            options.width = atoi(argv[++i]);
+        }
+        else if (arg == "--height" && hasValue)
+        {
+            options.height = atoi(argv[++i]);
+        }
+        else if (arg == "--frames" && hasValue)
+        {
+            options.frames = atoi(argv[++i]);
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            options.output = argv[++i];
+        }
+        else if (arg == "--raster" && hasValue)
+        {
+            const std::string_view mode{argv[++i]};
+            if (mode == "scanline")
+            {
+                options.rasterMode = RasterMode::Scanline;
+            }
+            else if (mode == "edge")
+            {
+                options.rasterMode = RasterMode::EdgeFunction;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown raster mode: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--simd" && hasValue)
+        {
+            const std::string_view isa{argv[++i]};
+            if (isa == "scalar")
+            {
+                options.simdIsa = SimdIsa::Scalar;
+            }
+            else if (isa == "sse4.1")
+            {
+                options.simdIsa = SimdIsa::Sse41;
+            }
+            else if (isa == "avx2")
+            {
+                options.simdIsa = SimdIsa::Avx2;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown instruction set: %s\n", argv[i]);
+                return false;
+            }
+
+            if (!isSimdIsaSupported(options.simdIsa))
+            {
+                fprintf(stderr, "This CPU does not support %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--filter" && hasValue)
+        {
+            const std::string_view filter{argv[++i]};
+            if (filter == "nearest")
+            {
+                options.textureFilter = TextureFilter::Nearest;
+            }
+            else if (filter == "bilinear")
+            {
+                options.textureFilter = TextureFilter::Bilinear;
+            }
+            else if (filter == "trilinear")
+            {
+                options.textureFilter = TextureFilter::Trilinear;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown texture filter: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--depth" && hasValue)
+        {
+            const std::string_view format{argv[++i]};
+            if (format == "float")
+            {
+                options.depthFormat = DepthFormat::Float;
+            }
+            else if (format == "reversed")
+            {
+                options.depthFormat = DepthFormat::ReversedFloat;
+            }
+            else if (format == "unorm16")
+            {
+                options.depthFormat = DepthFormat::Unorm16;
+            }
+            else if (format == "unorm24")
+            {
+                options.depthFormat = DepthFormat::Unorm24;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown depth format: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--texture" && hasValue)
+        {
+            options.texture = argv[++i];
+        }
+        else if (arg == "--texture-budget" && hasValue)
+        {
+            options.textureBudgetMb = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--profile")
+        {
+            options.profile = true;
+        }
+        else if (arg == "--profile-json" && hasValue)
+        {
+            options.profileJson = argv[++i];
+        }
+        else if (arg == "--no-hiz")
+        {
+            options.hierarchicalZ = false;
+        }
+        else if (arg == "--draw-order" && hasValue)
+        {
+            const std::string_view order{argv[++i]};
+            if (order == "front-to-back")
+            {
+                options.drawOrder = DrawOrder::FrontToBack;
+            }
+            else if (order == "source")
+            {
+                options.drawOrder = DrawOrder::Submission;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown draw order: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--sort-triangles")
+        {
+            options.triangleDepthSort = true;
+        }
+        else if (arg == "--overdraw")
+        {
+            options.overdraw = true;
+        }
+        else if (arg == "--bench-raster")
+        {
+            options.benchRaster = true;
+        }
+        else if (arg == "--bench-transform")
+        {
+            options.benchTransform = true;
+        }
+        else if (arg == "--bench-texture")
+        {
+            options.benchTexture = true;
+        }
+        else if (arg == "--bench-depth")
+        {
+            options.benchDepth = true;
+        }
+        else if (arg == "--fps" && hasValue)
+        {
+            const std::string_view value{argv[++i]};
+            options.targetFps = value == "uncapped" ? 0.0 : atof(argv[i]);
+            if (value != "uncapped" && options.targetFps <= 0.0)
+            {
+                fprintf(stderr, "Invalid frame rate: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--log-events")
+        {
+            options.logEvents = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipeline = true;
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--scene" && hasValue)
+        {
+            options.scene = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Unknown or incomplete option: %s\n", argv[i]);
+            return false;
+        }
     }
 
-    CubeModel getRotatedX(float angle) const
+    if (options.width <= 0 || options.height <= 0 || options.frames <= 0 || options.threads <= 0)
     {
-        return CubeModel{::getRotatedX(angle, vertices)};
+        fprintf(stderr, "Width, height, frames and threads must be positive\n");
+        return false;
     }
 
-    CubeModel getRotatedY(float angle) const
+    if (options.scene != "quad" && options.scene != "cube" && options.scene != "teapot" && options.scene != "teapots" && options.scene != "near" && options.scene != "crowd" && options.scene != "all")
     {
-        return CubeModel{::getRotatedY(angle, vertices)};
+        fprintf(stderr, "Unknown scene: %s\n", options.scene.c_str());
+        return false;
     }
 
-    std::vector<TexturedVertextFloat> vertices = {
-        // bottom-front
-        Vector3DFloat{0.0f, 0.0f, 0.0f},
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
-        Vector3DFloat{1.0f, 0.0f, 0.0f},
+    return true;
+}
 
-        // top-front
-        Vector3DFloat{0.0f, 0.0f, 0.0f},
-        Vector3DFloat{0.0f, 0.0f, 1.0f},
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
+void applyRenderOptions(PixelBuffer &buffer, const RenderOptions &options)
+{
+    buffer.setRasterMode(options.rasterMode);
+    buffer.setSimdIsa(options.simdIsa);
+    buffer.setTextureFilter(options.textureFilter);
+    buffer.setHierarchicalZ(options.hierarchicalZ);
+    buffer.setTriangleDepthSort(options.triangleDepthSort);
+    buffer.setOverdrawCounting(options.overdraw);
+}
+
+// Frames in flight with --pipeline: one binning, one rasterizing, one presented
+static constexpr size_t PIPELINE_TARGETS = 3;
+
+// A frame going through the FramePipeline
+struct PipelineFrame
+{
+    // Index into PipelineTargets
+    size_t target = 0;
+    SceneState state;
+    // When the input the frame shows was taken, for the latency
+    std::chrono::steady_clock::time_point simulatedAt;
+    FragmentStats fragmentsBefore;
+    SceneStats sceneStats;
+    // Stage times and counters of the geometry and raster threads
+    FrameProfile stageProfile;
+};
 
-        // top-front
-        Vector3DFloat{0.0f, 0.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 1.0f},
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
+// The buffers the frames in flight rotate through, each with a TiledRasterizer
+// binning into it. The rasterizers share one pool, the stages take turns with it.
+struct PipelineTargets
+{
+    // Buffers render into pixels[i] where given, into memory of their own otherwise
+    PipelineTargets(const RenderOptions &options, const std::vector<int32_t *> &pixels = {})
+        : threadPool(size_t(options.threads))
+    {
+        for (auto i = size_t{0}; i < PIPELINE_TARGETS; i++)
+        {
+            buffers.push_back(i < pixels.size() ? std::make_unique<ScreenBuffer>(options.width, options.height, pixels[i], options.depthFormat)
+                                                : std::make_unique<ScreenBuffer>(options.width, options.height, options.depthFormat));
+            applyRenderOptions(*buffers.back(), options);
+            rasterizers.push_back(std::make_unique<TiledRasterizer>(*buffers.back(), threadPool));
+        }
+    }
 
-        // top-back
-        Vector3DFloat{0.0f, 1.0f, 1.0f},
-        Vector3DFloat{1.0f, 1.0f, 1.0f},
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
+    FragmentStats getFragmentStats() const
+    {
+        FragmentStats stats;
+        for (const auto &buffer : buffers)
+        {
+            stats += buffer->getFragmentStats();
+        }
+        return stats;
+    }
 
-        // left-front
-        Vector3DFloat{0.0f, 0.0f, 0.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
-        Vector3DFloat{0.0f, 0.0f, 1.0f},
+    OverdrawStats getOverdrawStats() const
+    {
+        OverdrawStats stats;
+        for (const auto &buffer : buffers)
+        {
+            stats += buffer->getOverdrawStats();
+        }
+        return stats;
+    }
 
-        // left-back
-        Vector3DFloat{0.0f, 0.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
+    ThreadPool threadPool;
+    std::vector<std::unique_ptr<ScreenBuffer>> buffers;
+    std::vector<std::unique_ptr<TiledRasterizer>> rasterizers;
+};
 
-        // right-front
-        Vector3DFloat{1.0f, 0.0f, 0.0f},
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
-        Vector3DFloat{1.0f, 1.0f, 0.0f},
+// Runs a stage of a pipelined frame with profiler (if any) current on the
+// stage's thread and adds what it collected to the frame, for Profiler::merge
+template <typename Stage_T>
+void runProfiledStage(Profiler *profiler, PipelineFrame &frame, const Stage_T &stage)
+{
+    if (profiler == nullptr)
+    {
+        stage();
+        return;
+    }
 
-        // right-back
-        Vector3DFloat{1.0f, 0.0f, 1.0f},
-        Vector3DFloat{1.0f, 1.0f, 1.0f},
-        Vector3DFloat{1.0f, 1.0f, 0.0f},
+    Profiler::setCurrent(profiler);
+    profiler->beginFrame();
+    stage();
+    frame.stageProfile += profiler->takeFrame();
+}
 
-        // under-front
-        Vector3DFloat{1.0f, 0.0f, 0.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
-        Vector3DFloat{0.0f, 0.0f, 0.0f},
+// Geometry clears the frame's buffer and bins the scene, which the raster stage
+// then rasterizes. Only the geometry stage touches the assets. With profile,
+// each stage thread profiles into a Profiler of its own.
+std::unique_ptr<FramePipeline<PipelineFrame>> makeFramePipeline(PipelineTargets &targets, const std::string &scene, SceneAssets &assets, DrawOrder drawOrder,
+                                                                bool profile)
+{
+    // Shared, the stages are copied into std::function
+    const auto geometryProfiler = profile ? std::make_shared<Profiler>() : nullptr;
+    const auto rasterProfiler = profile ? std::make_shared<Profiler>() : nullptr;
 
-        // under-back
-        Vector3DFloat{1.0f, 0.0f, 0.0f},
-        Vector3DFloat{1.0f, 1.0f, 0.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
+    return std::make_unique<FramePipeline<PipelineFrame>>(
+        [&targets, &assets, scene, drawOrder, geometryProfiler](PipelineFrame &frame)
+        {
+            runProfiledStage(geometryProfiler.get(), frame, [&]()
+                             {
+                                 auto &buffer = *targets.buffers[frame.target];
+                                 frame.fragmentsBefore = buffer.getFragmentStats();
 
-        // back-top
-        Vector3DFloat{1.0f, 1.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
+                                 {
+                                     const ScopedTimer timer{ProfileStage::Clear};
+                                     buffer.cleanScreen(0xFFFFFFFF);
+                                     buffer.clearZBuffer();
+                                 }
+
+                                 animateScene(scene, frame.state, assets);
+                                 frame.sceneStats = drawScene(*targets.rasterizers[frame.target], scene, frame.state, assets, drawOrder); });
+        },
+        [&targets, rasterProfiler](PipelineFrame &frame)
+        {
+            runProfiledStage(rasterProfiler.get(), frame, [&]()
+                             {
+                                 {
+                                     const ScopedTimer timer{ProfileStage::Raster};
+                                     targets.rasterizers[frame.target]->flush();
+                                 }
+
+                                 const ScopedTimer timer{ProfileStage::Clear};
+                                 targets.buffers[frame.target]->finishClears();
+                                 targets.buffers[frame.target]->resolveOverdraw(); });
+        });
+}
 
-        // back-bottom
-        Vector3DFloat{1.0f, 1.0f, 0.0f},
-        Vector3DFloat{1.0f, 1.0f, 1.0f},
-        Vector3DFloat{0.0f, 1.0f, 0.0f},
-    };
-};
+double getMsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-struct Texture
+bool writeFrame(PixelBuffer &buffer, const std::string &pattern, int32_t frame)
 {
-    uint32_t m_width{0U};
-    uint32_t m_height{0U};
-    std::vector<int32_t> m_pixels;
+    auto filename = pattern;
 
-    Texture(const std::string &)
+    const auto placeholder = filename.find("{}");
+    if (placeholder != std::string::npos)
     {
-        // TODO: load image
-        // m_pixels
-        // m_pixels = PixelBuffer{width, height};
+        char number[16];
+        snprintf(number, sizeof(number), "%05d", frame);
+        filename.replace(placeholder, 2, number);
     }
 
-    template <typename T>
-    Texture(int32_t width, int32_t height, const T &colorProvider)
-        : m_width(width),
-          m_height(height)
-    {
-        m_pixels.resize(m_width * m_height);
+    const auto isRaw = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".raw") == 0;
 
-        for (auto x = 0u; x < m_width; x++)
-        {
-            for (auto y = 0u; y < m_height; y++)
-            {
-                putPixel(x, y, colorProvider(x, y));
-            }
-        }
+    const auto ok = isRaw ? buffer.writeRaw(filename) : buffer.writePpm(filename);
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
     }
 
-    void putPixel(uint32_t x, uint32_t y, int32_t argb)
-    {
-        assert(x < m_width);
-        assert(y < m_height);
+    return ok;
+}
 
-        m_pixels[x + (y * m_width)] = argb;
+// Makes profiler current if the options ask for profiling
+bool startProfiler(Profiler &profiler, const RenderOptions &options)
+{
+    if (!options.profile && options.profileJson.empty())
+    {
+        return true;
     }
 
-    int32_t getPixel(float u, float v) const
+    if (!options.profileJson.empty() && !profiler.openJsonLines(options.profileJson))
     {
-        const auto u_clamped = std::max(std::min(1.0f, u), 0.0f);
-        const auto v_clamped = std::max(std::min(1.0f, v), 0.0f);
-
-        const auto x = static_cast<uint32_t>(u_clamped * (m_width - 1));
-        const auto y = static_cast<uint32_t>(v_clamped * (m_height - 1));
+        return false;
+    }
 
-        assert(x < m_width);
-        assert(y < m_height);
+    Profiler::setCurrent(&profiler);
+    return true;
+}
 
-        return m_pixels[x + (y * m_width)];
+// The target's fragment totals only grow, the frame's share is the difference
+void endFrameProfile(const PixelBuffer &target, const FragmentStats &before)
+{
+    if (auto *profiler = Profiler::getCurrent())
+    {
+        const auto &after = target.getFragmentStats();
+        profiler->add(ProfileCounter::FragmentsTested, (after.shaded + after.rejected) - (before.shaded + before.rejected));
+        profiler->add(ProfileCounter::FragmentsShaded, after.shaded - before.shaded);
+        profiler->endFrame(uint64_t(target.getWidth()) * target.getHeight());
     }
-};
+}
 
-struct PixelBuffer
+void printProfileSummary(const Profiler &profiler)
 {
-    static constexpr auto MAX_FLOAT = std::numeric_limits<float>::max();
+    printf("Frame profile over the last %llu frames (ms):\n", (unsigned long long)std::min<uint64_t>(profiler.getFrameCount(), Profiler::DEFAULT_WINDOW));
 
-    PixelBuffer(int32_t width, int32_t height)
-        : m_data(),
-          m_zbuffer(),
-          m_width(width),
-          m_height(height)
+    for (auto stage = size_t{0}; stage <= PROFILE_STAGE_COUNT; stage++)
     {
-        m_data.resize(width * height);
-        m_zbuffer.resize(width * height);
+        const auto percentiles = profiler.getPercentiles(ProfileStage(stage));
+        printf("  %-10s p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f\n",
+               stage < PROFILE_STAGE_COUNT ? profileStageName(ProfileStage(stage)) : "frame", percentiles.p50, percentiles.p95, percentiles.p99, percentiles.max);
     }
 
-    PixelBuffer()
-        : m_width(0),
-          m_height(0)
+    const auto latency = profiler.getLatencyPercentiles();
+    if (latency.max > 0.0)
     {
+        printf("  %-10s p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f\n", "latency", latency.p50, latency.p95, latency.p99, latency.max);
     }
+}
 
-    virtual ~PixelBuffer() = default;
+void printRenderSummary(const RenderOptions &options, double totalMs, const FragmentStats &fragments, const OverdrawStats &overdraw,
+                        const SceneStats &sceneStats, const Profiler &profiler)
+{
+    printf("Rendered %d frames (%dx%d, scene %s, %d threads%s) in %.3f ms: %.3f ms/frame, %.1f fps\n",
+           options.frames, options.width, options.height, options.scene.c_str(), options.threads, options.pipeline ? ", pipelined" : "",
+           totalMs, totalMs / options.frames, options.frames * 1000.0 / totalMs);
 
-    void fillOutBuffer(void *outbuffer) const
-    {
-        memcpy(outbuffer, m_data.data(), m_width * m_height * sizeof(int32_t));
-    }
+    printf("Fragments per frame: %.0f shaded, %.0f rejected by the depth test\n",
+           double(fragments.shaded) / options.frames, double(fragments.rejected) / options.frames);
+    printf("Hierarchical z per frame: %.0f triangles, %.0f block rows rejected\n",
+           double(fragments.hizTriangles) / options.frames, double(fragments.hizBlocks) / options.frames);
 
-    void cleanScreen(int32_t color = 0xFF000000)
+    if (overdraw.coveredPixels > 0)
     {
-        for (auto &p : m_data)
-        {
-            p = color;
-        }
+        printf("Overdraw: %.3f writes per covered pixel, %.3f per pixel, %.0f pixels covered per frame, at most %u writes\n",
+               double(overdraw.writes) / overdraw.coveredPixels, double(overdraw.writes) / (double(options.width) * options.height * options.frames),
+               double(overdraw.coveredPixels) / options.frames, overdraw.maxWrites);
     }
 
-    void drawLine(const PointInt32 &point1, const PointInt32 &point2, const Texture &texture)
+    if (sceneStats.visitedNodes > 0)
     {
-        drawLine(point1.x, point1.y, point2.x, point2.y, texture);
+        printf("Scene per frame: %.0f instances drawn, %.0f frustum culled, %.0f occlusion culled, %.0f nodes visited\n",
+               double(sceneStats.drawnInstances) / options.frames, double(sceneStats.frustumCulled) / options.frames,
+               double(sceneStats.occlusionCulled) / options.frames, double(sceneStats.visitedNodes) / options.frames);
     }
 
-    void drawLine(const Vector3DFloat &point1, const Vector3DFloat &point2, const Texture &texture, const PointFloat &uv1, const PointFloat &uv2)
+    if (options.profile)
     {
-        drawLine(point1.x, point1.y, point2.x, point2.y, texture, point1.z, point2.z, uv1.x, uv2.x, uv1.y, uv2.y);
+        printProfileSummary(profiler);
     }
+}
+
+// Frames go through the FramePipeline, the writing of the output is its
+// presentation stage. Renders the same images as runHeadless.
+int runHeadlessPipelined(const RenderOptions &options)
+{
+    PipelineTargets targets{options};
 
-    void drawTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3)
+    TextureManager textureManager{options.textureBudgetMb << 20};
+    auto assets = loadSceneAssets(options.scene, textureManager, options.texture);
+    const auto everyFrame = options.output.find("{}") != std::string::npos;
+
+    Profiler profiler;
+    if (!startProfiler(profiler, options))
     {
-        if (p1.y < p2.y)
-        {
-            std::swap(p1, p2);
-            std::swap(uv1, uv2);
-        }
+        return EXIT_FAILURE;
+    }
 
-        if (p2.y < p3.y)
-        {
-            std::swap(p2, p3);
-            std::swap(uv2, uv3);
-        }
+    auto pipeline = makeFramePipeline(targets, options.scene, assets, options.drawOrder, Profiler::getCurrent() != nullptr);
 
-        if (p1.y < p2.y)
-        {
-            std::swap(p1, p2);
-            std::swap(uv1, uv2);
-        }
+    std::vector<size_t> freeTargets{2, 1, 0};
+    SceneState state;
+    SceneStats sceneStats;
+    auto submitted = 0;
+    auto outputMs = 0.0;
 
-        // Reciprocal to correct texture (https://en.wikipedia.org/wiki/Texture_mapping)
-        p1.z = 1 / p1.z;
-        p2.z = 1 / p2.z;
-        p3.z = 1 / p3.z;
+    const auto start = std::chrono::steady_clock::now();
+    profiler.beginFrame();
 
-        if (p1.y == p2.y)
+    for (auto frame = 0; frame < options.frames; frame++)
+    {
+        while (submitted < options.frames && !freeTargets.empty())
         {
-            drawFlatTriangle(p1, p2, p3, texture, uv1, uv2, uv3);
-            return;
+            state.step();
+            pipeline->submit({.target = freeTargets.back(), .state = state, .simulatedAt = std::chrono::steady_clock::now(), .fragmentsBefore = {}, .sceneStats = {}, .stageProfile = {}});
+            freeTargets.pop_back();
+            submitted++;
         }
 
-        const auto ay = (p1.x - p3.x) / (p1.y - p3.y);
-        const auto b = p3.x - ay * p3.y;
-
-        const auto x = p2.y * ay + b;
+        const auto finished = pipeline->waitFinished();
+        auto &buffer = *targets.buffers[finished.target];
+        sceneStats += finished.sceneStats;
 
-        const auto az = (p1.z - p3.z) / (p1.y - p3.y);
-        const auto bz = p3.z - az * p3.y;
-
-        const auto z = p2.y * az + bz;
+        if (!options.output.empty() && (everyFrame || frame == options.frames - 1))
+        {
+            const auto writeStart = std::chrono::steady_clock::now();
+            const ScopedTimer timer{ProfileStage::FillOut};
 
-        const auto midPoint = Vector3DFloat{x, p2.y, z};
+            if (!writeFrame(buffer, options.output, frame))
+            {
+                return EXIT_FAILURE;
+            }
 
-        const auto au1 = float(uv1.x - uv3.x) / (p1.y - p3.y);
-        const auto bu1 = uv3.x - au1 * p3.y;
+            outputMs += getMsSince(writeStart);
+        }
 
-        const auto av1 = float(uv1.y - uv3.y) / (p1.y - p3.y);
-        const auto bv1 = uv3.y - av1 * p3.y;
+        profiler.setLatency(getMsSince(finished.simulatedAt));
+        profiler.merge(finished.stageProfile);
+        endFrameProfile(buffer, finished.fragmentsBefore);
+        profiler.beginFrame();
 
-        const auto u1 = au1 * p2.y + bu1;
-        const auto v1 = av1 * p2.y + bv1;
+        freeTargets.push_back(finished.target);
+    }
 
-        const auto midPointUv = PointFloat{u1, v1};
+    // Writing the output is left out, as in the sequential run
+    printRenderSummary(options, getMsSince(start) - outputMs, targets.getFragmentStats(), targets.getOverdrawStats(), sceneStats, profiler);
 
-        drawFlatTriangle(p2, midPoint, p1, texture, uv2, midPointUv, uv1);
-        drawFlatTriangle(p2, midPoint, p3, texture, uv2, midPointUv, uv3);
-    }
+    return EXIT_SUCCESS;
+}
 
-    void drawFlatTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, const PointFloat &uv1, const PointFloat &uv2, const PointFloat &uv3)
+int runHeadless(const RenderOptions &options)
+{
+    if (options.pipeline)
     {
-        assert(p1.y == p2.y);
+        return runHeadlessPipelined(options);
+    }
 
-        const auto ay1 = float(p1.x - p3.x) / (p1.y - p3.y);
-        const auto b1 = p3.x - ay1 * p3.y;
+    ScreenBuffer screenBuffer{options.width, options.height, options.depthFormat};
+    applyRenderOptions(screenBuffer, options);
+    ThreadPool threadPool{size_t(options.threads)};
+    TiledRasterizer tiledRasterizer{screenBuffer, threadPool};
 
-        const auto ay2 = float(p2.x - p3.x) / (p2.y - p3.y);
-        const auto b2 = p3.x - ay2 * p3.y;
+    TextureManager textureManager{options.textureBudgetMb << 20};
+    auto assets = loadSceneAssets(options.scene, textureManager, options.texture);
+    const auto everyFrame = options.output.find("{}") != std::string::npos;
 
-        const auto az1 = float(p1.z - p3.z) / (p1.y - p3.y);
-        const auto bb1 = p3.z - az1 * p3.y;
+    Profiler profiler;
+    if (!startProfiler(profiler, options))
+    {
+        return EXIT_FAILURE;
+    }
 
-        const auto az2 = float(p2.z - p3.z) / (p2.y - p3.y);
-        const auto bb2 = p3.z - az2 * p3.y;
+    SceneState state;
+    SceneStats sceneStats;
+    std::chrono::nanoseconds renderTime{0};
 
-        const auto au1 = float(uv1.x - uv3.x) / (p1.y - p3.y);
-        const auto bu1 = uv3.x - au1 * p3.y;
+    for (auto frame = 0; frame < options.frames; frame++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto fragmentsBefore = screenBuffer.getFragmentStats();
+        profiler.beginFrame();
 
-        const auto au2 = float(uv2.x - uv3.x) / (p2.y - p3.y);
-        const auto bu2 = uv3.x - au2 * p3.y;
+        {
+            const ScopedTimer timer{ProfileStage::Clear};
+            screenBuffer.cleanScreen(0xFFFFFFFF);
+            screenBuffer.clearZBuffer();
+        }
 
-        const auto av1 = float(uv1.y - uv3.y) / (p1.y - p3.y);
-        const auto bv1 = uv3.y - av1 * p3.y;
+        state.step();
+        sceneStats += renderScene(screenBuffer, tiledRasterizer, options.threads, options.scene, state, assets, options.drawOrder);
+        screenBuffer.resolveOverdraw();
 
-        const auto av2 = float(uv2.y - uv3.y) / (p2.y - p3.y);
-        const auto bv2 = uv3.y - av2 * p3.y;
+        renderTime += std::chrono::steady_clock::now() - start;
 
-        if (p1.y < p3.y)
+        if (!options.output.empty() && (everyFrame || frame == options.frames - 1))
         {
-            for (auto y = p1.y; y < p3.y; y++)
-            {
-                const auto x1 = (ay1 * y + b1);
-                const auto x2 = (ay2 * y + b2);
-                const auto z1 = (az1 * y + bb1);
-                const auto z2 = (az2 * y + bb2);
-
-                const auto u1 = (au1 * y + bu1);
-                const auto u2 = (au2 * y + bu2);
+            const ScopedTimer timer{ProfileStage::FillOut};
 
-                const auto v1 = (av1 * y + bv1);
-                const auto v2 = (av2 * y + bv2);
-
-                drawLine({x1, y, z1}, {x2, y, z2}, texture, {u1, v1}, {u2, v2});
+            if (!writeFrame(screenBuffer, options.output, frame))
+            {
+                return EXIT_FAILURE;
             }
         }
-        else
-        {
-            for (auto y = p3.y; y < p1.y; y++)
-            {
-                const auto x1 = (ay1 * y + b1);
-                const auto x2 = (ay2 * y + b2);
-                const auto z1 = (az1 * y + bb1);
-                const auto z2 = (az2 * y + bb2);
 
-                const auto u1 = (au1 * y + bu1);
-                const auto u2 = (au2 * y + bu2);
+        endFrameProfile(screenBuffer, fragmentsBefore);
+    }
 
-                const auto v1 = (av1 * y + bv1);
-                const auto v2 = (av2 * y + bv2);
+    printRenderSummary(options, std::chrono::duration<double, std::milli>(renderTime).count(), screenBuffer.getFragmentStats(), screenBuffer.getOverdrawStats(),
+                       sceneStats, profiler);
 
-                drawLine({x1, y, z1}, {x2, y, z2}, texture, {u1, v1}, {u2, v2});
-            }
-        }
-    }
+    return EXIT_SUCCESS;
+}
 
-    void drawLine(float x1, float y1, float x2, float y2, const Texture &texture, float z1 = 0, float z2 = 0, float u1 = 0.0f, float u2 = 0.0f, float v1 = 0.0f, float v2 = 0.0f)
-    {
-        const auto getZ = [z1, z2, x1, x2, y1, y2](float x, float y)
-        {
-            if (z1 == z2)
-            {
-                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
-                return 1/z1;
-            }
+// Covers the whole buffer with a grid of textured quads (two triangles each, so
+// every pixel is written exactly once per pass) and reports pixels per second of
+// the edge-function rasterizer for each span kernel the CPU supports.
+int runRasterBenchmark(const RenderOptions &options)
+{
+    ScreenBuffer screenBuffer{options.width, options.height};
+    screenBuffer.setRasterMode(RasterMode::EdgeFunction);
 
-            if (x1 != x2)
-            {
-                const auto dzdx = (z2 - z1) / static_cast<float>(x2 - x1);
-                const auto b = z1 - (dzdx * x1);
-                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
-                return 1/((dzdx * x) + b);
-            }
+    const auto texture = makeCheckerTexture();
+    const auto pixelsPerPass = double(options.width) * options.height;
 
-            if (y1 != y2)
-            {
-                const auto dzdy = (z2 - z1) / static_cast<float>(y2 - y1);
-                const auto b = z1 - (dzdy * y1);
-                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
-                return 1/((dzdy * y) + b);
-            }
-            // assert(z1 == z2 && "DOT?");
+    std::vector<int32_t> reference(options.width * options.height);
+    std::vector<int32_t> result(options.width * options.height);
 
-            // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
-            return 1/z1;
+    for (const auto cellSize : {4, 16, 64, 256})
+    {
+        struct Quad
+        {
+            float x0, y0, x1, y1;
         };
 
-        const auto getU = [z1, z2, x1, x2, y1, y2, u1, u2](float x, float y, float z)
+        std::vector<Quad> quads;
+        for (auto y = 0; y < options.height; y += cellSize)
         {
-            if (u1 == u2)
-            {
-                return u1*z;
-            }
-
-            if (x1 != x2)
+            for (auto x = 0; x < options.width; x += cellSize)
             {
-                const auto dudx = (u2 - u1) / static_cast<float>(x2 - x1);
-                const auto b = u1 - (dudx * x1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudx * x) + b) *z;
+                quads.push_back({float(x), float(y), float(std::min(x + cellSize, options.width)), float(std::min(y + cellSize, options.height))});
             }
+        }
 
-            if (y1 != y2)
-            {
-                const auto dudy = (u2 - u1) / static_cast<float>(y2 - y1);
-                const auto b = u1 - (dudy * y1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudy * y) + b) *z;
-            }
+        const auto drawPass = [&]()
+        {
+            screenBuffer.clearZBuffer();
 
-            if (z1 != z2)
+            for (const auto &q : quads)
             {
-                const auto dudz = (u2 - u1) / static_cast<float>(z2 - z1);
-                const auto b = u1 - (dudz * z1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudz * z) + b) *z;
+                // Slanted depth so the perspective divide does real work
+                const auto z0 = 2.0f + q.x0 / options.width;
+                const auto z1 = 2.0f + q.x1 / options.width;
+
+                screenBuffer.drawTriangle({q.x0, q.y0, z0}, {q.x1, q.y0, z1}, {q.x0, q.y1, z0}, texture,
+                                          {0.0f, 0.0f}, {1.0f / z1, 0.0f}, {0.0f, 1.0f / z0});
+                screenBuffer.drawTriangle({q.x1, q.y0, z1}, {q.x1, q.y1, z1}, {q.x0, q.y1, z0}, texture,
+                                          {1.0f / z1, 0.0f}, {1.0f / z1, 1.0f / z1}, {0.0f, 1.0f / z0});
             }
-
-            return u1*z;
         };
 
-        const auto getV = [z1, z2, x1, x2, y1, y2, v1, v2](float x, float y, float z)
+        for (const auto isa : {SimdIsa::Scalar, SimdIsa::Sse41, SimdIsa::Avx2})
         {
-            if (v1 == v2)
+            if (!isSimdIsaSupported(isa))
             {
-                return v1*z;
+                continue;
             }
 
+            screenBuffer.setSimdIsa(isa);
+            screenBuffer.cleanScreen(0xFFFFFFFF);
+            drawPass();
 
-            if (x1 != x2)
+            const auto start = std::chrono::steady_clock::now();
+            for (auto pass = 0; pass < options.frames; pass++)
             {
-                const auto dudx = (v2 - v1) / static_cast<float>(x2 - x1);
-                const auto b = v1 - (dudx * x1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudx * x) + b)*z;
+                drawPass();
             }
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-            if (y1 != y2)
-            {
-                const auto dudy = (v2 - v1) / static_cast<float>(y2 - y1);
-                const auto b = v1 - (dudy * y1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudy * y) + b)*z;
-            }
+            auto &pixels = isa == SimdIsa::Scalar ? reference : result;
+            screenBuffer.fillOutBuffer(pixels.data());
 
-            if (z1 != z2)
-            {
-                const auto dudz = (v2 - v1) / static_cast<float>(z2 - z1);
-                const auto b = v1 - (dudz * z1);
-                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
-                return ((dudz * z) + b) *z;
-            }
+            printf("cell %3dpx  %-7s %10.1f Mpixels/s  %6zu triangles%s\n",
+                   cellSize, simdIsaName(isa), pixelsPerPass * options.frames / seconds / 1e6, quads.size() * 2,
+                   isa == SimdIsa::Scalar || pixels == reference ? "" : "  MISMATCH against scalar");
+        }
+    }
 
-            return v1*z;
-        };
+    return EXIT_SUCCESS;
+}
 
-        const auto getColor = [getU, getV, &texture](float x, float y, float z)
+// Model to screen space for every vertex: the per-step AoS chain (getRotated*,
+// getTranslated, applyNonOrthoProj, toScreenSpace), the fused matrix on AoS
+// vertices and the SoA kernels
+int runTransformBenchmark(const RenderOptions &options)
+{
+    const auto anglez = 0.3f;
+    const auto anglex = 0.7f;
+    const auto angley = 1.1f;
+    const auto pos = Vector3DFloat{0.5f, -0.25f, 8.0f};
+    const auto modelViewProjection = Matrix4DFloat::screenProjection(options.width, options.height) *
+                                     getModelMatrix(anglez, anglex, angley, pos);
+
+    for (const auto vertexCount : {10'000, 100'000, 1'000'000})
+    {
+        std::vector<TexturedVertextFloat> aos;
+        aos.reserve(vertexCount);
+        for (auto i = 0; i < vertexCount; i++)
         {
-            const auto u = getU(x, y, z);
-            const auto v = getV(x, y, z);
+            // Deterministic points spread over a unit cube
+            aos.emplace_back(float(i % 97) / 97.0f - 0.5f, float(i % 89) / 89.0f - 0.5f, float(i % 83) / 83.0f - 0.5f,
+                             float(i % 7) / 7.0f, float(i % 5) / 5.0f);
+        }
 
-            return texture.getPixel(u, v);
-        };
+        const auto soa = VertexStreams::fromVertices(aos);
 
-        if (x1 == x2)
-        {
-            if (y1 > y2)
-            {
-                std::swap(x1, x2);
-                std::swap(u1, u2);
-                std::swap(y1, y2);
-                std::swap(v1, v2);
-            }
-            for (auto y = y1; y < y2; y++)
-            {
-                const auto z = getZ(x1, y);
-                putPixel(x1, y, z, getColor(x1, y, z));
-            }
-            return;
-        }
+        // Every variant transforms about frames * 100k vertices
+        const auto passes = std::max(1, int(int64_t(options.frames) * 100'000 / vertexCount));
 
-        if (y1 == y2)
+        const auto measure = [&](const char *name, const auto &pass, const char *note = "")
         {
-            if (x1 > x2)
-            {
-                std::swap(x1, x2);
-                std::swap(u1, u2);
-                std::swap(y1, y2);
-                std::swap(v1, v2);
-            }
-            for (auto x = x1; x < x2; x++)
+            pass();
+
+            const auto start = std::chrono::steady_clock::now();
+            for (auto i = 0; i < passes; i++)
             {
-                const auto z = getZ(x, y1);
-                putPixel(x, y1, z, getColor(x, y1, z));
+                pass();
             }
-            return;
-        }
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-        const auto ax = (y1 - y2) / (x1 - x2);
-        const auto ay = (x1 - x2) / (y1 - y2);
+            printf("%7d vertices  %-12s %10.1f Mvertices/s%s\n",
+                   vertexCount, name, double(vertexCount) * passes / seconds / 1e6, note);
+        };
 
-        if (fabs(ax) < fabs(ay))
-        {
-            if (x1 > x2)
-            {
-                std::swap(x1, x2);
-                std::swap(u1, u2);
-                std::swap(y1, y2);
-                std::swap(v1, v2);
-            }
-            const auto b = y2 - ax * x2;
-            
-            for (auto x = x1; x <= x2; x++)
-            {
-                const auto y = static_cast<int32_t>(ax * x + b);
-                const auto z = getZ(x, y);
-                putPixel(x, y, z, getColor(x, y, z));
-            }
-        }
-        else
+        std::vector<Vector3DFloat> chainResult(vertexCount);
+        measure("aos chain", [&]()
+                {
+                    const auto transformed = getTranslated(pos, getRotatedY(angley, getRotatedX(anglex, getRotatedZ(anglez, aos))));
+                    for (auto i = 0; i < vertexCount; i++)
+                    {
+                        chainResult[i] = toScreenSpace(applyNonOrthoProj(transformed[i].getPointVector()), options.width, options.height);
+                    }
+                });
+
+        PositionStreams reference;
+        measure("aos matrix", [&]()
+                { projectVertices(modelViewProjection, aos, reference); });
+
+        for (const auto isa : {SimdIsa::Scalar, SimdIsa::Sse41, SimdIsa::Avx2})
         {
-            if (y1 > y2)
+            if (!isSimdIsaSupported(isa))
             {
-                std::swap(x1, x2);
-                std::swap(u1, u2);
-                std::swap(y1, y2);
-                std::swap(v1, v2);
+                continue;
             }
-            const auto b = x2 - ay * y2;
 
-            for (auto y = y1; y <= y2; y++)
-            {
-                const auto x = static_cast<int32_t>(ay * y + b);
-                const auto z = getZ(x, y);
-                putPixel(x, y, z, getColor(x, y, z));
-            }
+            PositionStreams result;
+            const auto pass = [&]()
+            { projectVertices(modelViewProjection, soa, result, isa); };
+            pass();
+
+            const auto matches = result.x == reference.x && result.y == reference.y && result.z == reference.z;
+            const auto name = std::string{"soa "} + simdIsaName(isa);
+            measure(name.c_str(), pass, matches ? "" : "  MISMATCH against aos matrix");
         }
     }
 
-    void putPixel(const PointInt32 &point, int32_t color)
+    return EXIT_SUCCESS;
+}
+
+// Minified sampling of a texture far larger than the caches: a quad with the
+// whole texture shrunk to a few hundred pixels or less, as on distant geometry.
+// Reports texel reads per second and last level cache misses per fragment for
+// every filter; only the filtered modes read the smaller mip levels.
+int runTextureBenchmark(const RenderOptions &options)
+{
+    constexpr auto TEXTURE_SIZE = 4096;
+
+    // Hashed texels, so neighbouring texels share nothing a filter could skip
+    const auto texture = Texture{TEXTURE_SIZE, TEXTURE_SIZE, [](int32_t x, int32_t y)
+                                 {
+                                     auto hash = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u;
+                                     hash ^= hash >> 13;
+                                     hash *= 0x5bd1e995u;
+                                     return int32_t(hash | 0xFF000000u);
+                                 }};
+
+    ScreenBuffer screenBuffer{options.width, options.height};
+    screenBuffer.setRasterMode(RasterMode::EdgeFunction);
+    screenBuffer.setSimdIsa(options.simdIsa);
+    screenBuffer.setHierarchicalZ(false);
+
+    PerfCounter cacheMisses{PERF_COUNT_HW_CACHE_MISSES};
+    if (!cacheMisses.isAvailable())
     {
-        putPixel(point.x, point.y, color);
+        printf("Cache miss counter not available, only timing is reported\n");
     }
 
-    void putPixel(int32_t x, int32_t y, int32_t argb)
+    const auto maxSide = std::min(options.width, options.height);
+
+    for (const auto side : {maxSide, maxSide / 4, maxSide / 16})
     {
-        assert(x >= 0);
-        assert(x < m_width);
-        assert(y >= 0);
-        assert(y < m_height);
+        const auto x0 = float(options.width - side) / 2, x1 = x0 + side;
+        const auto y0 = float(options.height - side) / 2, y1 = y0 + side;
 
-        m_data[x + (y * m_width)] = argb;
-    }
+        // Every pass a little nearer than the last, so all fragments pass the depth
+        // test without clearing the whole z-buffer for a small quad. The depth is
+        // constant over the quad and leaves the level of detail alone.
+        const auto passes = options.frames * (maxSide / side) * (maxSide / side);
+        auto z = 1.0f + passes;
 
-    void putPixel(int32_t x, int32_t y, float z, int32_t color)
-    {
-        const auto index = x + (y * m_width);
-        if (z < m_zbuffer[index])
+        const auto drawPass = [&]()
         {
-            putPixel(x, y, color);
-            m_zbuffer[index] = z;
-        }
-    }
+            z -= 1.0f;
+            const auto iz = 1.0f / z;
+            screenBuffer.drawTriangle({x0, y0, z}, {x1, y0, z}, {x0, y1, z}, texture, {0.0f, 0.0f}, {iz, 0.0f}, {0.0f, iz});
+            screenBuffer.drawTriangle({x1, y0, z}, {x1, y1, z}, {x0, y1, z}, texture, {iz, 0.0f}, {iz, iz}, {0.0f, iz});
+        };
 
-    void clearZBuffer()
-    {
-        for (auto &zvalue : m_zbuffer)
+        for (const auto filter : {TextureFilter::Nearest, TextureFilter::Bilinear, TextureFilter::Trilinear})
         {
-            zvalue = MAX_FLOAT;
-        }
-    }
+            const auto texelsPerFragment = filter == TextureFilter::Nearest ? 1 : filter == TextureFilter::Bilinear ? 4 : 8;
+            const auto *name = filter == TextureFilter::Nearest ? "nearest" : filter == TextureFilter::Bilinear ? "bilinear" : "trilinear";
 
-    int32_t getPixel(const PointInt32 &point) const
-    {
-        return getPixel(point.x, point.y);
-    }
+            screenBuffer.setTextureFilter(filter);
+            screenBuffer.clearZBuffer();
+            z = 2.0f + passes;
+            drawPass();
 
-    int32_t getPixel(int32_t x, int32_t y) const
-    {
-        assert(x >= 0);
-        assert(x <= m_width);
-        assert(y >= 0);
-        assert(y <= m_height);
-        return m_data[x + (y * m_height)];
-    }
+            const auto fragmentsBefore = screenBuffer.getFragmentStats().shaded;
+            const auto start = std::chrono::steady_clock::now();
+            cacheMisses.start();
 
-    int32_t getWidth() const
-    {
-        return m_width;
-    }
+            for (auto pass = 0; pass < passes; pass++)
+            {
+                drawPass();
+            }
 
-    int32_t getHeight() const
-    {
-        return m_height;
-    }
+            const auto misses = cacheMisses.stop();
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            const auto fragments = double(screenBuffer.getFragmentStats().shaded - fragmentsBefore);
 
-    void drawBuffer(const PixelBuffer &buffer, int32_t posX, int32_t posY)
-    {
-        for (auto i = 0; i < buffer.getWidth(); i++)
-        {
-            for (auto j = 0; j < buffer.getHeight(); j++)
+            printf("%4dpx (%5.1f texels/pixel)  %-9s %10.1f Mtexels/s  %8.1f Mfragments/s",
+                   side, float(TEXTURE_SIZE) / side, name, fragments * texelsPerFragment / seconds / 1e6, fragments / seconds / 1e6);
+
+            if (cacheMisses.isAvailable())
             {
-                putPixel(i + posX, j + posY, buffer.getPixel(i, j));
+                printf("  %6.3f cache misses/fragment", double(misses) / fragments);
             }
+
+            printf("\n");
         }
     }
 
-protected:
-    std::vector<int32_t> m_data;
-    std::vector<float> m_zbuffer;
-    int32_t m_width;
-    int32_t m_height;
-};
+    return EXIT_SUCCESS;
+}
 
-struct ScreenBuffer : public PixelBuffer
+// Layers of full screen quads with a tiny texture, so the depth buffer and the
+// color writes are the only memory traffic. Front to back every layer after the
+// first only reads depth; back to front every fragment passes and writes it too.
+// Reports fragments per second and the depth bytes touched per frame (clear
+// included) for every format, run it at a high resolution (--width 3840
+// --height 2160) so the buffers do not fit in the caches.
+int runDepthBenchmark(const RenderOptions &options)
 {
-    ScreenBuffer(int32_t width, int32_t height)
-        : PixelBuffer(width, height)
+    constexpr auto LAYERS = 8;
+
+    const auto texture = Texture{4, 4, [](int32_t x, int32_t y)
+                                 { return (x + y) % 2 == 0 ? int32_t(0xFFFFFFFF) : int32_t(0xFF808080); }};
+    const auto width = float(options.width);
+    const auto height = float(options.height);
+    const auto pixels = double(options.width) * options.height;
+
+    for (const auto format : {DepthFormat::Float, DepthFormat::ReversedFloat, DepthFormat::Unorm16, DepthFormat::Unorm24})
     {
-    }
+        ScreenBuffer screenBuffer{options.width, options.height, format};
+        screenBuffer.setRasterMode(RasterMode::EdgeFunction);
+        screenBuffer.setSimdIsa(options.simdIsa);
+        screenBuffer.setHierarchicalZ(false);
 
-    using PixelBuffer::drawLine;
-    using PixelBuffer::drawTriangle;
-    using PixelBuffer::putPixel;
-};
+        const auto bytes = double(screenBuffer.getDepthBytes());
 
-ScreenBuffer g_screenBuffer{720, 720};
+        for (const auto frontToBack : {true, false})
+        {
+            const auto drawFrame = [&]()
+            {
+                screenBuffer.clearZBuffer();
 
-void on_delete(Display *display, Window window)
-{
-    XDestroyWindow(display, window);
-    quited = true;
-}
+                for (auto layer = 0; layer < LAYERS; layer++)
+                {
+                    // Slanted, so the layers cover the same depth range each
+                    const auto z = 2.0f + float(frontToBack ? layer : LAYERS - 1 - layer);
+                    const auto z1 = z + 0.5f;
+
+                    screenBuffer.drawTriangle({0.0f, 0.0f, z}, {width, 0.0f, z1}, {0.0f, height, z}, texture,
+                                              {0.0f, 0.0f}, {1.0f / z1, 0.0f}, {0.0f, 1.0f / z});
+                    screenBuffer.drawTriangle({width, 0.0f, z1}, {width, height, z1}, {0.0f, height, z}, texture,
+                                              {1.0f / z1, 0.0f}, {1.0f / z1, 1.0f / z1}, {0.0f, 1.0f / z});
+                }
+            };
 
-template <typename T>
-Vector3D<T> crossProduct(const Vector3D<T> &v1, const Vector3D<T> &v2)
-{
-    return Vector3D<T>{
-        .x = (v1.y * v2.z) - (v1.z * v2.y),
-        .y = (v1.z * v2.x) - (v1.x * v2.z),
-        .z = (v1.x * v2.y) - (v1.y * v2.x)};
-}
+            drawFrame();
 
-template <typename T>
-T dotProduct(const Vector3D<T> &v1, const Vector3D<T> &v2)
-{
-    return (v1.x * v2.x) + (v1.y * v2.y) + (v1.z * v2.z);
-}
+            const auto statsBefore = screenBuffer.getFragmentStats();
+            const auto start = std::chrono::steady_clock::now();
 
-template <typename T>
-Vector3D<T> calculateTriangleNormal(const Vector3D<T> &v1, const Vector3D<T> &v2, const Vector3D<T> &v3)
-{
-    const auto vv1 = Vector3D<T>{v2.x - v1.x, v2.y - v1.y, v2.z - v1.z};
-    const auto vv2 = Vector3D<T>{v3.x - v1.x, v3.y - v1.y, v3.z - v1.z};
+            for (auto frame = 0; frame < options.frames; frame++)
+            {
+                drawFrame();
+            }
 
-    return crossProduct(vv1, vv2);
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            const auto &stats = screenBuffer.getFragmentStats();
+            const auto shaded = double(stats.shaded - statsBefore.shaded) / options.frames;
+            const auto rejected = double(stats.rejected - statsBefore.rejected) / options.frames;
+
+            // Clear, a read per fragment and a write per passing one
+            const auto depthBytes = bytes * (pixels + shaded + rejected + shaded);
+
+            printf("%-8s %-13s %8.1f Mfragments/s  %7.1f ms/frame  %7.1f MB depth traffic/frame\n",
+                   depthFormatName(format), frontToBack ? "front-to-back" : "back-to-front",
+                   (shaded + rejected) * options.frames / seconds / 1e6, seconds * 1e3 / options.frames, depthBytes / 1e6);
+        }
+    }
+
+    return EXIT_SUCCESS;
 }
 
-template <typename Model_T>
-void drawModel(Model_T model, float anglez, float anglex, float angley, Vector3DFloat pos, const Texture &texture, bool wireframe = false, bool backfaceCulling = true)
+// Input and presentation stay on this thread, Xlib is not used from any other.
+// A frame is submitted when the scheduler says it is due and one of the
+// presenter's images is free: not binned or rasterized into, and not still read
+// by the server from an earlier put.
+int runWindowPipelined(Display *display, Atom wmDeleteWindow, X11Presenter &presenter, const RenderOptions &options)
 {
-    model = model.getRotatedZ(anglez);
-    model = model.getRotatedX(anglex);
-    model = model.getRotatedY(angley);
+    std::vector<int32_t *> pixels;
+    for (auto i = size_t{0}; i < presenter.getImageCount(); i++)
+    {
+        pixels.push_back(presenter.pixels(i));
+    }
+
+    // Rasterized directly into the image memory, nothing is copied before presenting
+    PipelineTargets targets{options, pixels};
 
-    model = model.getTranslated(pos);
+    TextureManager textureManager{options.textureBudgetMb << 20};
+    auto assets = loadSceneAssets(options.scene, textureManager, options.texture);
 
-    assert((model.vertices.size() % 3) == 0);
+    Profiler profiler;
+    if (!startProfiler(profiler, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Stopped before the targets and the assets it uses go away
+    auto pipeline = makeFramePipeline(targets, options.scene, assets, options.drawOrder, Profiler::getCurrent() != nullptr);
 
-    int32_t i = 0;
+    SceneState state;
+    FrameScheduler scheduler{options.targetFps};
+    EventLog eventLog{options.logEvents};
+    WindowInput input;
+    std::vector<size_t> freeTargets{2, 1, 0};
+    // Put with MIT-SHM and not completed yet
+    std::vector<size_t> presentingTargets;
 
-    for (auto itr = model.vertices.begin();
-         itr != model.vertices.end(); std::advance(itr, 3))
+    profiler.beginFrame();
+
+    while (!quited)
     {
-        const auto &v1 = *itr;
-        const auto &v2 = *(itr + 1);
-        const auto &v3 = *(itr + 2);
+        // Sleeps until the next frame is due, a frame finished or the server sent
+        // something, see the sequential loop in main()
+        const auto frameWanted = (!input.paused || input.needsRedraw) && !freeTargets.empty();
+        if (XPending(display) == 0)
+        {
+            scheduler.wait(ConnectionNumber(display), frameWanted, pipeline->getFinishedFd());
+        }
 
-        const Vector3D vv1 = {v1.x, v1.y, v1.z};
-        const Vector3D vv2 = {v2.x, v2.y, v2.z};
-        const Vector3D vv3 = {v3.x, v3.y, v3.z};
+        {
+            const ScopedTimer timer{ProfileStage::Events};
+            handleWindowEvents(display, wmDeleteWindow, presenter, eventLog, input);
+        }
 
-        if (backfaceCulling)
+        if (quited)
         {
-            const auto cameraToTriangle = Vector3D{v1.x - 0, v1.y - 0, v1.z - 0};
-            const auto triangleNormal = calculateTriangleNormal(vv1, vv2, vv3);
-            const auto dotProd = dotProduct(cameraToTriangle, triangleNormal);
+            break;
+        }
 
-            if (dotProd > 0)
+        std::erase_if(presentingTargets, [&](size_t target)
+                      {
+                          const auto done = !presenter.isPresenting(target);
+                          if (done)
+                          {
+                              freeTargets.push_back(target);
+                          }
+                          return done; });
+
+        if ((!input.paused || input.needsRedraw) && !freeTargets.empty() && scheduler.isFrameDue())
+        {
+            const auto seconds = scheduler.beginFrame();
+            if (!input.paused)
             {
-                i++;
-                continue;
+                state.step(seconds * SceneState::STEPS_PER_SECOND);
             }
-        }
+            input.needsRedraw = false;
 
-        const auto p1 = toScreenSpace(applyNonOrthoProj(vv1),
-                                      g_screenBuffer.getWidth(), g_screenBuffer.getHeight());
+            pipeline->submit({.target = freeTargets.back(), .state = state, .simulatedAt = std::chrono::steady_clock::now(), .fragmentsBefore = {}, .sceneStats = {}, .stageProfile = {}});
+            freeTargets.pop_back();
+        }
 
-        const auto p2 = toScreenSpace(applyNonOrthoProj(vv2),
-                                      g_screenBuffer.getWidth(), g_screenBuffer.getHeight());
+        while (const auto finished = pipeline->takeFinished())
+        {
+            {
+                const ScopedTimer timer{ProfileStage::Present};
+                presenter.present(options.profile ? profiler.formatOverlay() : std::vector<std::string>{}, finished->target);
+            }
 
-        const auto p3 = toScreenSpace(applyNonOrthoProj(vv3),
-                                      g_screenBuffer.getWidth(), g_screenBuffer.getHeight());
+            (presenter.usesShm() ? presentingTargets : freeTargets).push_back(finished->target);
 
-        if (!wireframe)
-        {
-            // Divide u and v by z (to correct for perspective - https://en.wikipedia.org/wiki/Texture_mapping)
-            g_screenBuffer.drawTriangle(p1, p2, p3, texture, {v1.u/p1.z, v1.v/p1.z}, {v2.u/p2.z, v2.v/p2.z}, {v3.u/p3.z, v3.v/p3.z});
+            // A profiled frame spans from one presentation to the next
+            profiler.setLatency(getMsSince(finished->simulatedAt));
+            profiler.merge(finished->stageProfile);
+            endFrameProfile(*targets.buffers[finished->target], finished->fragmentsBefore);
+            profiler.beginFrame();
         }
-        // else
-        // {
-        //     g_screenBuffer.drawLine(p1, p2, colorIndices[i % colorIndices.size()]);
-        //     g_screenBuffer.drawLine(p2, p3, colorIndices[i % colorIndices.size()]);
-        //     g_screenBuffer.drawLine(p3, p1, colorIndices[i % colorIndices.size()]);
-        // }
-        i++;
     }
-}
 
-void drawCube(float anglez, float anglex, float angley, Vector3DFloat pos, const Texture &texture)
-{
-    auto model = CubeModel{};
-    // model = model.getTranslated({-0.5f, -0.5f, -0.5f});
-    drawModel(model, anglez, anglex, angley, pos, texture);
+    return EXIT_SUCCESS;
 }
 
-float clampAngle(float angle)
+int main(int argc, char **argv)
 {
-    if (angle > M_PI)
+    RenderOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.benchRaster)
     {
-        angle = -M_PI;
+        return runRasterBenchmark(options);
     }
-    else if (angle < -M_PI)
+
+    if (options.benchTransform)
     {
-        angle = M_PI;
+        return runTransformBenchmark(options);
     }
 
-    return angle;
-}
+    if (options.benchTexture)
+    {
+        return runTextureBenchmark(options);
+    }
+
+    if (options.benchDepth)
+    {
+        return runDepthBenchmark(options);
+    }
+
+    if (options.headless)
+    {
+        return runHeadless(options);
+    }
 
-int main(int, char **)
-{
     Display *display = XOpenDisplay(NULL);
     if (NULL == display)
     {
-        fprintf(stderr, "Failed to initialize display");
+        fprintf(stderr, "Failed to initialize display (use --headless to render without X)\n");
         return EXIT_FAILURE;
     }
 
@@ -1084,7 +1764,7 @@ int main(int, char **)
         return EXIT_FAILURE;
     }
 
-    Window window = XCreateSimpleWindow(display, root, 0, 0, 800, 600, 0, 0, 0xffffffff);
+    Window window = XCreateSimpleWindow(display, root, 0, 0, options.width, options.height, 0, 0, 0xffffffff);
     if (None == window)
     {
         fprintf(stderr, "Failed to create window");
@@ -1099,7 +1779,7 @@ int main(int, char **)
     Atom wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
     XSetWMProtocols(display, window, &wm_delete_window, 1);
 
-    const auto inputTypes = StructureNotifyMask | KeyPressMask | KeyRelease | ButtonPressMask | ButtonReleaseMask;
+    const auto inputTypes = StructureNotifyMask | ExposureMask | KeyPressMask | KeyRelease | ButtonPressMask | ButtonReleaseMask;
     XSelectInput(display, window, inputTypes);
 
     XEvent event;
@@ -1111,18 +1791,27 @@ int main(int, char **)
     }
     XFlush(display);
 
-    const auto imgWidth = g_screenBuffer.getWidth();
-    const auto imgHeight = g_screenBuffer.getHeight();
+    // Detaches from the server on destruction, so it must go before the display is closed
+    auto presenter = std::make_unique<X11Presenter>(display, window, gc, options.width, options.height, options.useShm,
+                                                    options.pipeline ? PIPELINE_TARGETS : 1);
+    printf("Presenting with %s\n", presenter->usesShm() ? "MIT-SHM" : "XPutImage");
 
-    auto pixelData = new int32_t[imgHeight * imgWidth];
-
-    for (auto i = 0; i < imgWidth * imgHeight; i++)
+    if (options.pipeline)
     {
-        pixelData[i] = 0x00000000;
+        const auto result = runWindowPipelined(display, wm_delete_window, *presenter, options);
+        presenter.reset();
+        XCloseDisplay(display);
+        return result;
     }
 
-    XImage *pImg = XCreateImage(display, CopyFromParent, DefaultDepth(display, DefaultScreen(display)), ZPixmap, 0,
-                                (char *)pixelData, imgWidth, imgHeight, 32, imgWidth * sizeof(int32_t));
+    // Rasterized directly into the image memory, nothing is copied before presenting
+    ScreenBuffer screenBuffer{options.width, options.height, presenter->pixels(), options.depthFormat};
+    applyRenderOptions(screenBuffer, options);
+    ThreadPool threadPool{size_t(options.threads)};
+    TiledRasterizer tiledRasterizer{screenBuffer, threadPool};
+
+    const auto imgWidth = screenBuffer.getWidth();
+    const auto imgHeight = screenBuffer.getHeight();
 
     int frames = 0;
     const int32_t greenColor = 0xFF00FF00;
@@ -1131,76 +1820,65 @@ int main(int, char **)
 
     int currColor = 0;
 
-    const auto utahTeaPot = ObjModel::fromObjFile("assets/teapot.obj");
+    TextureManager textureManager{options.textureBudgetMb << 20};
+    auto assets = loadSceneAssets(options.scene, textureManager, options.texture);
 
-    const auto texture_width = 26.0;
-    const auto texture_height = 26.0;
-    const auto texture = Texture{int32_t(texture_width), int32_t(texture_height), [texture_width, texture_height](int32_t x, int32_t y)
-                                 {
-                                    (void)x;
-                                    (void)y;
-                                      const auto max_color = uint8_t{255};
-                                    //   const auto r = static_cast<uint8_t>((x / texture_width) * max_color);
-                                    //   const auto g = static_cast<uint8_t>((y / texture_height) * max_color);
+    Profiler profiler;
+    if (!startProfiler(profiler, options))
+    {
+        presenter.reset();
+        XCloseDisplay(display);
+        return EXIT_FAILURE;
+    }
 
-                                    //   const auto max_mod = sqrt((texture_width * texture_width) + (texture_height * texture_height));
+    SceneState state;
+    FrameScheduler scheduler{options.targetFps};
+    EventLog eventLog{options.logEvents};
+    WindowInput input;
 
-                                    //   const auto b = static_cast<uint8_t>(((x * x + y * y) / max_mod) * max_color);
 
-                                    // const auto dist_x = x -(texture_width/2);
-                                    // const auto dist_y = y -(texture_width / 2);
+    while (!quited)
+    {
+        // Sleeps until the next frame is due, or until the server sends something
+        // while nothing needs drawing. Xlib may already hold events it read from
+        // the socket, poll() only reports new ones.
+        const auto frameWanted = !input.paused || input.needsRedraw;
+        if (XPending(display) == 0)
+        {
+            scheduler.wait(ConnectionNumber(display), frameWanted);
+        }
 
-                                    // const auto dist = sqrtf((dist_x*dist_x) + (dist_y*dist_y));
-                                    // const auto radius = 0.25f*texture_width;
-                                    // const uint8_t r = dist < radius ? 255 : 0;
-                                    const uint8_t r = (x + y) % 2 == 0 ? 255 : 0;//(y > 0.45*texture_width && y < 0.55*texture_width) || (x >= 0.45*texture_width && x < 0.55*texture_width) || (y < 0.05*texture_height) ? 255 : 0;
-                                    const uint8_t g = 0;
-                                    const uint8_t b = 0;
+        if (!frameWanted || !scheduler.isFrameDue())
+        {
+            handleWindowEvents(display, wm_delete_window, *presenter, eventLog, input);
+            continue;
+        }
 
-                                      const auto a = max_color;
+        profiler.beginFrame();
+        const auto fragmentsBefore = screenBuffer.getFragmentStats();
 
-                                      const int32_t argb = (a << 24) | (r << 16) | (g << 8) | (b << 0);
+        {
+            const ScopedTimer timer{ProfileStage::Events};
+            handleWindowEvents(display, wm_delete_window, *presenter, eventLog, input);
+        }
 
-                                     return argb;
-                                 }};
+        if (quited)
+        {
+            break;
+        }
 
-    const auto triangleModel = SimpleQuadModel{};
+        const auto seconds = scheduler.beginFrame();
+        input.needsRedraw = false;
 
-    while (!quited)
-    {
-        while (XPending(display) > 0)
         {
-            XNextEvent(display, &event);
+            const ScopedTimer timer{ProfileStage::Present};
+            presenter->waitForPresent();
+        }
 
-            switch (event.type)
-            {
-            case ClientMessage:
-            {
-                if (event.xclient.data.l[0] == (long)wm_delete_window)
-                {
-                    on_delete(event.xclient.display, event.xclient.window);
-                }
-            }
-            break;
-            case ButtonPress:
-            case ButtonRelease:
-            case EnterNotify:
-            case MotionNotify:
-            case LeaveNotify:
-                // if(_mouseHandler)
-                //     _mouseHandler->HandleInput(lDisplay, &xEvent);
-                break;
-            case KeyPress:
-            case KeyRelease:
-                // if(_keyboardHandler)
-                //     _keyboardHandler->HandleInput(lDisplay, &xEvent);
-                break;
-            default:
-                // if(_keyboardHandler)
-                //     _keyboardHandler->HandleInput(lDisplay, &xEvent);
-                break;
-            }
-            std::cout << "Got event: " << event.type << std::endl;
+        {
+            const ScopedTimer timer{ProfileStage::Clear};
+            screenBuffer.cleanScreen(0xFFFFFFFF);
+            screenBuffer.clearZBuffer();
         }
 
         const auto x = imgWidth / 2;
@@ -1208,42 +1886,25 @@ int main(int, char **)
 
         if (currColor == 0)
         {
-            g_screenBuffer.putPixel(x, y, greenColor);
+            screenBuffer.putPixel(x, y, greenColor);
         }
         else if (currColor == 1)
         {
-            g_screenBuffer.putPixel(x, y, redColor);
+            screenBuffer.putPixel(x, y, redColor);
         }
         else if (currColor == 2)
         {
-            g_screenBuffer.putPixel(x, y, blueColor);
+            screenBuffer.putPixel(x, y, blueColor);
         }
 
-        static float anglez = 0.0f;
-        // anglez += 0.01f;
-        static float anglex = 3.14159f *0.0;
-        // anglex += 0.002f;
-        static float angley = 0.0f;
-        angley += 0.002f;
-
-        angley = clampAngle(angley);
-        anglex = clampAngle(anglex);
-        anglez = clampAngle(anglez);
-
-        // drawCube(anglez, anglex, angley, {1.5f, 0.0f, 3.0f}, blueColor);
-        // drawCube(anglez, anglex, angley, {0.0f, 0.0f, 3.0f}, texture);
-        // drawModel(utahTeaPot, anglez, anglex, angley, {-2.0f, -1.5f, 9.0f}, texture);
-        drawModel(triangleModel, anglez, anglex, angley, {0.2f, 0.0f, 1.2f}, texture, false, false);
-
-        for(auto y = 0ull; y < texture.m_height; y++)
+        if (!input.paused)
         {
-            for(auto x = 0ull; x < texture.m_width; x++)
-            {
-                g_screenBuffer.putPixel({(int)x, (int)y}, texture.m_pixels[x + (y*texture.m_width)]);
-            }
+            state.step(seconds * SceneState::STEPS_PER_SECOND);
         }
 
-        // g_screenBuffer.drawBuffer(texture.getBuffer(), 0, 0);
+        renderScene(screenBuffer, tiledRasterizer, options.threads, options.scene, state, assets, options.drawOrder);
+
+        // screenBuffer.drawBuffer(texture.getBuffer(), 0, 0);
 
         if (frames > 500)
         {
@@ -1257,18 +1918,29 @@ int main(int, char **)
         }
         frames++;
 
-        g_screenBuffer.fillOutBuffer(pixelData);
+        if (200 < imgWidth && 50 < imgHeight)
+        {
+            screenBuffer.putPixel(200, 50, redColor);
+        }
+
+        {
+            const ScopedTimer timer{ProfileStage::Clear};
+            screenBuffer.finishClears();
+        }
+
+        screenBuffer.resolveOverdraw();
 
-        g_screenBuffer.cleanScreen(0xFFFFFFFF);
-        g_screenBuffer.clearZBuffer();
+        {
+            const ScopedTimer timer{ProfileStage::Present};
+            presenter->present(options.profile ? profiler.formatOverlay() : std::vector<std::string>{});
+        }
 
-        pixelData[200 + (50 * g_screenBuffer.getWidth())] = redColor;
-        std::ignore = XPutImage(display, window, gc, pImg, 0, 0, 0, 0, imgWidth * 4, imgHeight * 4);
+        endFrameProfile(screenBuffer, fragmentsBefore);
     }
 
-    XDestroyImage(pImg);
+    presenter.reset();
 
     XCloseDisplay(display);
 
     return 0;
-}
\ No newline at end of file
+}
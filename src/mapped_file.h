@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+
+// Read-only mapping of a whole file, unmapped on destruction
+struct MappedFile
+{
+    explicit MappedFile(const std::string &filename)
+    {
+        const auto fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0)
+        {
+            m_isOpen = true;
+
+            if (fileStat.st_size > 0)
+            {
+                auto *addr = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (addr != MAP_FAILED)
+                {
+                    madvise(addr, fileStat.st_size, MADV_SEQUENTIAL);
+                    m_data = static_cast<const char *>(addr);
+                    m_size = fileStat.st_size;
+                }
+                else
+                {
+                    m_isOpen = false;
+                }
+            }
+        }
+
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (m_data)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+    bool isOpen() const
+    {
+        return m_isOpen;
+    }
+
+    std::string_view contents() const
+    {
+        return {m_data, m_size};
+    }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_isOpen = false;
+};
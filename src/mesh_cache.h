@@ -0,0 +1,275 @@
+#pragma once
+
+#include "geometry.h"
+#include "mapped_file.h"
+#include "obj_loader.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary mesh cache, native endianness:
+//   MeshCacheHeader
+//   x, y, z, u and v streams, vertexCount floats each
+//   index buffer, indexCount uint32_t (three per triangle)
+// Every section starts on a MESH_CACHE_ALIGNMENT boundary so the mapped streams
+// can be used by the aligned vector kernels as they are.
+inline constexpr char MESH_CACHE_MAGIC[8] = {'X', '3', 'D', 'M', 'E', 'S', 'H', '\0'};
+// Bump on any layout change, older caches are then regenerated
+inline constexpr uint32_t MESH_CACHE_VERSION = 1;
+inline constexpr uint64_t MESH_CACHE_ALIGNMENT = 32;
+inline constexpr size_t MESH_CACHE_STREAM_COUNT = 5;
+
+struct MeshCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t fileSize;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    // x, y, z, u, v
+    uint64_t streamOffsets[MESH_CACHE_STREAM_COUNT];
+    uint64_t indexOffset;
+    Vector3DFloat boundsMin;
+    Vector3DFloat boundsMax;
+};
+
+inline uint64_t alignMeshCacheOffset(uint64_t offset)
+{
+    return (offset + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+}
+
+inline MeshCacheHeader makeMeshCacheHeader(uint64_t vertexCount, uint64_t indexCount, const BoundingBox &bounds)
+{
+    MeshCacheHeader header{};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.headerSize = sizeof(MeshCacheHeader);
+    header.vertexCount = vertexCount;
+    header.indexCount = indexCount;
+
+    auto offset = alignMeshCacheOffset(sizeof(MeshCacheHeader));
+    for (auto &streamOffset : header.streamOffsets)
+    {
+        streamOffset = offset;
+        offset = alignMeshCacheOffset(offset + vertexCount * sizeof(float));
+    }
+
+    header.indexOffset = offset;
+    header.fileSize = offset + indexCount * sizeof(uint32_t);
+    header.boundsMin = bounds.min;
+    header.boundsMax = bounds.max;
+
+    return header;
+}
+
+// Written to a uniquely named file next to the destination and renamed over it,
+// so a reader never maps a half written cache, even while several processes
+// regenerate the same one
+inline bool writeMeshCache(const std::string &filename, const IndexedMesh &mesh)
+{
+    BoundingBox bounds;
+    for (const auto &vertice : mesh.vertices)
+    {
+        bounds.extend(vertice.getPointVector());
+    }
+
+    const auto header = makeMeshCacheHeader(mesh.vertices.size(), mesh.indices.size(), bounds);
+
+    auto tmpFilename = filename + ".XXXXXX";
+    const auto fd = mkstemp(tmpFilename.data());
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // mkstemp creates it private, caches are readable like the assets next to them
+    fchmod(fd, 0644);
+    close(fd);
+
+    {
+        std::ofstream file{tmpFilename, std::ios::binary | std::ios::trunc};
+        if (!file.is_open())
+        {
+            std::remove(tmpFilename.c_str());
+            return false;
+        }
+
+        const auto pad = [&](uint64_t offset)
+        {
+            static constexpr char zeros[MESH_CACHE_ALIGNMENT] = {};
+            file.write(zeros, offset - file.tellp());
+        };
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        std::vector<float> stream(mesh.vertices.size());
+        float TexturedVertextFloat::*const members[MESH_CACHE_STREAM_COUNT] = {
+            &TexturedVertextFloat::x,
+            &TexturedVertextFloat::y,
+            &TexturedVertextFloat::z,
+            &TexturedVertextFloat::u,
+            &TexturedVertextFloat::v,
+        };
+
+        for (auto s = size_t{0}; s < MESH_CACHE_STREAM_COUNT; s++)
+        {
+            for (auto i = size_t{0}; i < mesh.vertices.size(); i++)
+            {
+                stream[i] = mesh.vertices[i].*members[s];
+            }
+
+            pad(header.streamOffsets[s]);
+            file.write(reinterpret_cast<const char *>(stream.data()), stream.size() * sizeof(float));
+        }
+
+        pad(header.indexOffset);
+        file.write(reinterpret_cast<const char *>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+
+        if (!file.good())
+        {
+            file.close();
+            std::remove(tmpFilename.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tmpFilename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// assets/teapot.obj -> assets/teapot.mesh
+inline std::string getMeshCacheFilename(const std::string &objFilename)
+{
+    const auto dot = objFilename.find_last_of('.');
+    const auto slash = objFilename.find_last_of('/');
+    const auto hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+
+    return (hasExtension ? objFilename.substr(0, dot) : objFilename) + ".mesh";
+}
+
+// Missing, or older than the file it was made from
+inline bool isMeshCacheStale(const std::string &cacheFilename, const std::string &sourceFilename)
+{
+    struct stat cacheStat;
+    struct stat sourceStat;
+
+    if (stat(cacheFilename.c_str(), &cacheStat) != 0)
+    {
+        return true;
+    }
+
+    if (stat(sourceFilename.c_str(), &sourceStat) != 0)
+    {
+        // Nothing to regenerate it from
+        return false;
+    }
+
+    if (cacheStat.st_mtim.tv_sec != sourceStat.st_mtim.tv_sec)
+    {
+        return cacheStat.st_mtim.tv_sec < sourceStat.st_mtim.tv_sec;
+    }
+
+    return cacheStat.st_mtim.tv_nsec < sourceStat.st_mtim.tv_nsec;
+}
+
+// Mapped cache file. The buffers point into the mapping and live as long as the
+// object, nothing is parsed or copied.
+struct MeshCache
+{
+    explicit MeshCache(const std::string &filename)
+        : m_file(filename)
+    {
+        const auto contents = m_file.contents();
+        if (contents.size() < sizeof(MeshCacheHeader))
+        {
+            return;
+        }
+
+        const auto &header = getHeader();
+        if (std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != MESH_CACHE_VERSION ||
+            header.headerSize != sizeof(MeshCacheHeader) ||
+            header.fileSize != contents.size() ||
+            header.vertexCount > std::numeric_limits<uint32_t>::max() ||
+            header.indexCount > std::numeric_limits<uint32_t>::max() ||
+            header.indexCount % 3 != 0)
+        {
+            return;
+        }
+
+        // Same layout as the writer, anything else is a corrupt file
+        const auto expected = makeMeshCacheHeader(header.vertexCount, header.indexCount, {header.boundsMin, header.boundsMax});
+        if (std::memcmp(expected.streamOffsets, header.streamOffsets, sizeof(header.streamOffsets)) != 0 ||
+            expected.indexOffset != header.indexOffset ||
+            expected.fileSize != header.fileSize)
+        {
+            return;
+        }
+
+        // The renderer indexes the streams without checks and reads the indices
+        // as whole triangles, checked above, one sequential pass here keeps a
+        // corrupt file from reading outside them
+        const auto *indices = getIndices();
+        if (std::any_of(indices, indices + header.indexCount, [&header](uint32_t index)
+                        { return index >= header.vertexCount; }))
+        {
+            return;
+        }
+
+        m_isValid = true;
+    }
+
+    bool isValid() const
+    {
+        return m_isValid;
+    }
+
+    const MeshCacheHeader &getHeader() const
+    {
+        return *reinterpret_cast<const MeshCacheHeader *>(m_file.contents().data());
+    }
+
+    size_t getVertexCount() const
+    {
+        return getHeader().vertexCount;
+    }
+
+    size_t getIndexCount() const
+    {
+        return getHeader().indexCount;
+    }
+
+    // 0 to 4 for x, y, z, u, v
+    const float *getStream(size_t stream) const
+    {
+        return reinterpret_cast<const float *>(m_file.contents().data() + getHeader().streamOffsets[stream]);
+    }
+
+    const uint32_t *getIndices() const
+    {
+        return reinterpret_cast<const uint32_t *>(m_file.contents().data() + getHeader().indexOffset);
+    }
+
+    BoundingBox getBounds() const
+    {
+        return {getHeader().boundsMin, getHeader().boundsMax};
+    }
+
+private:
+    MappedFile m_file;
+    bool m_isValid = false;
+};
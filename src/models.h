@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "mesh_cache.h"
+#include "obj_loader.h"
+#include "transform.h"
+
+// Indexed: vertices shared by several faces are stored, and transformed, once.
+// Vertices are kept as streams for the SIMD transform kernels. The buffers are
+// either owned or those of a mapped mesh cache, copies of the model share them.
+struct ObjModel
+{
+    static ObjModel fromMesh(const IndexedMesh &mesh)
+    {
+        auto storage = std::make_shared<OwnedStorage>(VertexStreams::fromVertices(mesh.vertices), mesh.indices, nullptr);
+
+        BoundingBox bounds;
+        for (const auto &vertice : mesh.vertices)
+        {
+            bounds.extend(vertice.getPointVector());
+        }
+
+        return ObjModel{storage->vertices, storage->indices, bounds, BoundingSphere::fromVertices(mesh.vertices), storage};
+    }
+
+    // Three vertices per triangle, as the simple models store them
+    static ObjModel fromTriangles(std::span<const TexturedVertextFloat> vertices)
+    {
+        IndexedMesh mesh{{vertices.begin(), vertices.end()}, std::vector<uint32_t>(vertices.size())};
+        std::iota(mesh.indices.begin(), mesh.indices.end(), 0);
+
+        return fromMesh(mesh);
+    }
+
+    static ObjModel fromObjFile(const std::string &filename)
+    {
+        return fromMesh(loadIndexedObjFile(filename));
+    }
+
+    static ObjModel fromMeshCache(std::shared_ptr<const MeshCache> cache)
+    {
+        return ObjModel{
+            VertexStreamsView{cache->getStream(0), cache->getStream(1), cache->getStream(2), cache->getStream(3), cache->getStream(4), cache->getVertexCount()},
+            {cache->getIndices(), cache->getIndexCount()},
+            cache->getBounds(),
+            BoundingSphere::fromBox(cache->getBounds()),
+            cache};
+    }
+
+    // Maps the mesh cache next to the OBJ file, (re)generating it first when it is
+    // missing, outdated or from another format version
+    static ObjModel fromCachedObjFile(const std::string &objFilename)
+    {
+        const auto cacheFilename = getMeshCacheFilename(objFilename);
+
+        if (!isMeshCacheStale(cacheFilename, objFilename))
+        {
+            auto cache = std::make_shared<const MeshCache>(cacheFilename);
+            if (cache->isValid())
+            {
+                return fromMeshCache(std::move(cache));
+            }
+        }
+
+        const auto mesh = loadIndexedObjFile(objFilename);
+
+        // Missing or broken file: a cache written now would be newer than the
+        // OBJ and keep the empty mesh even after the OBJ is fixed
+        if (mesh.indices.empty())
+        {
+            return fromMesh(mesh);
+        }
+
+        if (writeMeshCache(cacheFilename, mesh))
+        {
+            auto cache = std::make_shared<const MeshCache>(cacheFilename);
+            if (cache->isValid())
+            {
+                return fromMeshCache(std::move(cache));
+            }
+        }
+
+        // Read-only asset directory: run from the parsed mesh
+        return fromMesh(mesh);
+    }
+
+    ObjModel getTransformed(const Matrix4DFloat &m) const
+    {
+        // Only the positions change, the indices stay those of this model
+        auto transformed = std::make_shared<OwnedStorage>(::getTransformed(m, vertices), std::vector<uint32_t>{}, storage);
+        const auto transformedBounds = ::getTransformed(m, bounds);
+        return ObjModel{transformed->vertices, indices, transformedBounds, BoundingSphere::fromBox(transformedBounds), transformed};
+    }
+
+    ObjModel getTranslated(const Vector3DFloat &transl) const
+    {
+        return getTransformed(Matrix4DFloat::translation(transl));
+    }
+
+    ObjModel getRotatedZ(float angle) const
+    {
+        return getTransformed(Matrix4DFloat::rotationZ(angle));
+    }
+
+    ObjModel getRotatedX(float angle) const
+    {
+        return getTransformed(Matrix4DFloat::rotationX(angle));
+    }
+
+    ObjModel getRotatedY(float angle) const
+    {
+        return getTransformed(Matrix4DFloat::rotationY(angle));
+    }
+
+    // Buffers of a model that is not backed by a mesh cache
+    struct OwnedStorage
+    {
+        VertexStreams vertices;
+        std::vector<uint32_t> indices;
+        // Whatever the indices point into when they are borrowed
+        std::shared_ptr<const void> indexOwner;
+    };
+
+    VertexStreamsView vertices = {};
+    std::span<const uint32_t> indices = {};
+    BoundingBox bounds = {};
+    BoundingSphere boundingSphere = {};
+    // Keeps the buffers above alive: OwnedStorage or a MeshCache
+    std::shared_ptr<const void> storage = {};
+};
+
+struct SimpleTriangleModel
+{
+    SimpleTriangleModel getTranslated(const Vector3DFloat &transl) const
+    {
+        return SimpleTriangleModel{::getTranslated(transl, vertices)};
+    }
+
+    SimpleTriangleModel getRotatedZ(float angle) const
+    {
+        return SimpleTriangleModel{::getRotatedZ(angle, vertices)};
+    }
+
+    SimpleTriangleModel getRotatedX(float angle) const
+    {
+        return SimpleTriangleModel{::getRotatedX(angle, vertices)};
+    }
+
+    SimpleTriangleModel getRotatedY(float angle) const
+    {
+        return SimpleTriangleModel{::getRotatedY(angle, vertices)};
+    }
+
+    std::vector<TexturedVertextFloat> vertices = {
+        // {-0.7f, -0.5f, 6.0f, 0.0f, 0.0f},
+        // {0.7f, -0.25f, 6.0f, 1.0f, 0.0f},
+        // {0.0f, 0.5f, 6.0f, 1.0f, 1.0f},
+
+        {-0.7f, -0.5f, 0.0f, 0.0f, 0.0f},
+        {0.7f, -0.25f, 0.0f, 1.0f, 0.0f},
+        {0.0f, 0.5f, 0.0f, 1.0f, 1.0f},
+
+        // {-0.5f, -0.5f, 5.0f},
+        // {0.5f, -0.45f, 5.0f},
+        // {0.0f, 0.5f, 5.0f},
+
+    };
+    BoundingSphere boundingSphere = BoundingSphere::fromVertices(vertices);
+};
+
+struct SimpleQuadModel
+{
+    SimpleQuadModel getTranslated(const Vector3DFloat &transl) const
+    {
+        return SimpleQuadModel{::getTranslated(transl, vertices)};
+    }
+
+    SimpleQuadModel getRotatedZ(float angle) const
+    {
+        return SimpleQuadModel{::getRotatedZ(angle, vertices)};
+    }
+
+    SimpleQuadModel getRotatedX(float angle) const
+    {
+        return SimpleQuadModel{::getRotatedX(angle, vertices)};
+    }
+
+    SimpleQuadModel getRotatedY(float angle) const
+    {
+        return SimpleQuadModel{::getRotatedY(angle, vertices)};
+    }
+
+    std::vector<TexturedVertextFloat> vertices = {
+        {-0.5f, -0.5f, 0.0f, 0.0f, 1.0f},
+        {-0.5f, 0.5f, 0.0f, 0.0f, 0.0f},
+        {0.5f, -0.5f, 0.0f, 1.0f, 1.0f},
+
+        {0.5f, -0.5f, 0.0f, 1.0f, 1.0f},
+        {0.5f, 0.5f, 0.0f, 1.0f, 0.0f},
+        {-0.5f, 0.5f, 0.0f, 0.0f, 0.0f},
+    };
+    BoundingSphere boundingSphere = BoundingSphere::fromVertices(vertices);
+};
+
+struct CubeModel
+{
+    CubeModel getTranslated(const Vector3DFloat &transl) const
+    {
+        return CubeModel{::getTranslated(transl, vertices)};
+    }
+
+    CubeModel getRotatedZ(float angle) const
+    {
+        return CubeModel{::getRotatedZ(angle, vertices)};
+    }
+
+    CubeModel getRotatedX(float angle) const
+    {
+        return CubeModel{::getRotatedX(angle, vertices)};
+    }
+
+    CubeModel getRotatedY(float angle) const
+    {
+        return CubeModel{::getRotatedY(angle, vertices)};
+    }
+
+    std::vector<TexturedVertextFloat> vertices = {
+        // bottom-front
+        Vector3DFloat{0.0f, 0.0f, 0.0f},
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+        Vector3DFloat{1.0f, 0.0f, 0.0f},
+
+        // top-front
+        Vector3DFloat{0.0f, 0.0f, 0.0f},
+        Vector3DFloat{0.0f, 0.0f, 1.0f},
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+
+        // top-front
+        Vector3DFloat{0.0f, 0.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 1.0f},
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+
+        // top-back
+        Vector3DFloat{0.0f, 1.0f, 1.0f},
+        Vector3DFloat{1.0f, 1.0f, 1.0f},
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+
+        // left-front
+        Vector3DFloat{0.0f, 0.0f, 0.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+        Vector3DFloat{0.0f, 0.0f, 1.0f},
+
+        // left-back
+        Vector3DFloat{0.0f, 0.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+
+        // right-front
+        Vector3DFloat{1.0f, 0.0f, 0.0f},
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+        Vector3DFloat{1.0f, 1.0f, 0.0f},
+
+        // right-back
+        Vector3DFloat{1.0f, 0.0f, 1.0f},
+        Vector3DFloat{1.0f, 1.0f, 1.0f},
+        Vector3DFloat{1.0f, 1.0f, 0.0f},
+
+        // under-front
+        Vector3DFloat{1.0f, 0.0f, 0.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+        Vector3DFloat{0.0f, 0.0f, 0.0f},
+
+        // under-back
+        Vector3DFloat{1.0f, 0.0f, 0.0f},
+        Vector3DFloat{1.0f, 1.0f, 0.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+
+        // back-top
+        Vector3DFloat{1.0f, 1.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+
+        // back-bottom
+        Vector3DFloat{1.0f, 1.0f, 0.0f},
+        Vector3DFloat{1.0f, 1.0f, 1.0f},
+        Vector3DFloat{0.0f, 1.0f, 0.0f},
+    };
+    BoundingSphere boundingSphere = BoundingSphere::fromVertices(vertices);
+};
@@ -0,0 +1,414 @@
+#pragma once
+
+#include "geometry.h"
+#include "mapped_file.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <limits>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+
+// Unique vertices plus three indices per triangle
+struct IndexedMesh
+{
+    std::vector<TexturedVertextFloat> vertices;
+    std::vector<uint32_t> indices;
+};
+
+// One triangle corner as read from an "f" statement. Positive file indices are
+// global and stored 0-based; negative (relative) ones are only known relative to
+// the chunk start, they are stored counted from it and marked relative until the
+// chunks are merged. They may reach back into earlier chunks, below 0.
+struct ObjCorner
+{
+    static constexpr int64_t NO_INDEX = std::numeric_limits<int64_t>::min();
+
+    int64_t position;
+    int64_t texcoord;
+    bool positionRelative;
+    bool texcoordRelative;
+};
+
+// What one line-aligned slice of the file contributes
+struct ObjChunk
+{
+    std::vector<Vector3DFloat> positions;
+    std::vector<PointFloat> texcoords;
+    std::vector<ObjCorner> corners;
+    // First line that could not be parsed, empty if none
+    std::string_view badLine;
+};
+
+inline const char *skipObjBlanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+
+    return p;
+}
+
+template <typename T>
+bool parseObjNumber(const char *&p, const char *end, T &val)
+{
+    p = skipObjBlanks(p, end);
+
+    // from_chars does not take an explicit plus sign
+    if (p < end && *p == '+')
+    {
+        p++;
+    }
+
+    const auto [ptr, ec] = std::from_chars(p, end, val);
+    if (ec != std::errc{})
+    {
+        return false;
+    }
+
+    p = ptr;
+    return true;
+}
+
+// 1-based, or negative to count back from the last element read so far. Whether
+// a relative one points before the file start is only known once the chunks
+// are merged, see parseIndexedObj.
+inline bool resolveObjIndex(int64_t fileIndex, size_t chunkCount, int64_t &res, bool &relative)
+{
+    relative = fileIndex < 0;
+
+    if (fileIndex > 0)
+    {
+        res = fileIndex - 1;
+        return true;
+    }
+
+    if (fileIndex == 0)
+    {
+        return false;
+    }
+
+    res = int64_t(chunkCount) + fileIndex;
+    return true;
+}
+
+// v/vt/vn, v//vn, v/vt or v. Normals are accepted but not kept, the renderer
+// has no use for them.
+inline bool parseObjCorner(const char *&p, const char *end, const ObjChunk &chunk, ObjCorner &corner)
+{
+    int64_t position;
+    if (!parseObjNumber(p, end, position) || !resolveObjIndex(position, chunk.positions.size(), corner.position, corner.positionRelative))
+    {
+        return false;
+    }
+
+    corner.texcoord = ObjCorner::NO_INDEX;
+    corner.texcoordRelative = false;
+
+    if (p < end && *p == '/')
+    {
+        p++;
+
+        if (p < end && *p != '/')
+        {
+            int64_t texcoord;
+            if (!parseObjNumber(p, end, texcoord) || !resolveObjIndex(texcoord, chunk.texcoords.size(), corner.texcoord, corner.texcoordRelative))
+            {
+                return false;
+            }
+        }
+
+        if (p < end && *p == '/')
+        {
+            p++;
+
+            int64_t normal;
+            if (!parseObjNumber(p, end, normal))
+            {
+                return false;
+            }
+        }
+    }
+
+    return p == end || *p == ' ' || *p == '\t';
+}
+
+inline bool parseObjLine(std::string_view line, ObjChunk &chunk, std::vector<ObjCorner> &polygon)
+{
+    const auto *p = skipObjBlanks(line.data(), line.data() + line.size());
+    const auto *end = line.data() + line.size();
+
+    const auto *keywordEnd = p;
+    while (keywordEnd < end && *keywordEnd != ' ' && *keywordEnd != '\t')
+    {
+        keywordEnd++;
+    }
+
+    const std::string_view keyword{p, size_t(keywordEnd - p)};
+    p = keywordEnd;
+
+    if (keyword == "v")
+    {
+        Vector3DFloat position;
+        if (!parseObjNumber(p, end, position.x) || !parseObjNumber(p, end, position.y) || !parseObjNumber(p, end, position.z))
+        {
+            return false;
+        }
+
+        // An optional w component follows, ignored like the color some exporters add
+        chunk.positions.push_back(position);
+        return true;
+    }
+
+    if (keyword == "vt")
+    {
+        PointFloat texcoord{0.0f, 0.0f};
+        if (!parseObjNumber(p, end, texcoord.x))
+        {
+            return false;
+        }
+
+        // v is optional, so is the w component
+        parseObjNumber(p, end, texcoord.y);
+        chunk.texcoords.push_back(texcoord);
+        return true;
+    }
+
+    if (keyword == "f")
+    {
+        polygon.clear();
+
+        for (p = skipObjBlanks(p, end); p < end; p = skipObjBlanks(p, end))
+        {
+            ObjCorner corner;
+            if (!parseObjCorner(p, end, chunk, corner))
+            {
+                return false;
+            }
+
+            polygon.push_back(corner);
+        }
+
+        if (polygon.size() < 3)
+        {
+            return false;
+        }
+
+        // Polygons are triangulated as a fan, which is exact for the convex
+        // faces exporters write
+        for (auto i = size_t{2}; i < polygon.size(); i++)
+        {
+            chunk.corners.push_back(polygon[0]);
+            chunk.corners.push_back(polygon[i - 1]);
+            chunk.corners.push_back(polygon[i]);
+        }
+
+        return true;
+    }
+
+    // vn, groups, objects, smoothing groups, materials, lines... nothing the
+    // renderer uses
+    return true;
+}
+
+inline ObjChunk parseObjChunk(std::string_view text)
+{
+    ObjChunk chunk;
+    // Reused between faces so polygons do not allocate per line
+    std::vector<ObjCorner> polygon;
+
+    while (!text.empty())
+    {
+        const auto lineEnd = text.find('\n');
+        auto line = text.substr(0, lineEnd);
+        text.remove_prefix(lineEnd == std::string_view::npos ? text.size() : lineEnd + 1);
+
+        line = line.substr(0, line.find('#'));
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        if (!parseObjLine(line, chunk, polygon) && chunk.badLine.empty())
+        {
+            chunk.badLine = line;
+        }
+    }
+
+    return chunk;
+}
+
+// Files below this are parsed on the calling thread, starting threads costs more
+inline constexpr size_t OBJ_PARALLEL_MIN_BYTES = 1 << 20;
+
+// Parses up to threadCount line-aligned chunks of text in parallel and merges
+// them, the mesh is the same for any count. Vertices keep the file order unless
+// faces reference texture coordinates, then every distinct position/texcoord
+// pair becomes a vertex. filename only appears in the error messages.
+inline IndexedMesh parseIndexedObj(std::string_view text, size_t threadCount, const std::string &filename)
+{
+    threadCount = std::max(threadCount, size_t{1});
+
+    // Chunks end right after a newline so no line is split
+    std::vector<std::string_view> slices;
+    for (auto start = size_t{0}; start < text.size();)
+    {
+        auto end = std::max(start + 1, text.size() * (slices.size() + 1) / threadCount);
+        end = end >= text.size() ? text.size() : std::min(text.size(), text.find('\n', end - 1) + 1);
+
+        if (end == 0)
+        {
+            end = text.size();
+        }
+
+        slices.push_back(text.substr(start, end - start));
+        start = end;
+    }
+
+    std::vector<ObjChunk> chunks(slices.size());
+    {
+        std::vector<std::jthread> workers;
+        for (auto i = size_t{1}; i < slices.size(); i++)
+        {
+            workers.emplace_back([&, i]()
+                                 { chunks[i] = parseObjChunk(slices[i]); });
+        }
+
+        if (!slices.empty())
+        {
+            chunks[0] = parseObjChunk(slices[0]);
+        }
+    }
+
+    size_t positionCount = 0;
+    size_t texcoordCount = 0;
+    size_t cornerCount = 0;
+    auto hasTexcoords = false;
+
+    for (const auto &chunk : chunks)
+    {
+        if (!chunk.badLine.empty())
+        {
+            std::cout << "Could not parse \"" << chunk.badLine << "\" in " << filename << std::endl;
+            return {};
+        }
+
+        positionCount += chunk.positions.size();
+        texcoordCount += chunk.texcoords.size();
+        cornerCount += chunk.corners.size();
+        hasTexcoords |= std::ranges::any_of(chunk.corners, [](const auto &corner)
+                                            { return corner.texcoord != ObjCorner::NO_INDEX; });
+    }
+
+    std::vector<Vector3DFloat> positions;
+    std::vector<PointFloat> texcoords;
+    positions.reserve(positionCount);
+    texcoords.reserve(texcoordCount);
+
+    IndexedMesh res;
+    res.indices.reserve(cornerCount);
+
+    // Position/texcoord pair to vertex index, only used with texture coordinates
+    std::unordered_map<uint64_t, uint32_t> vertexIds;
+
+    for (const auto &chunk : chunks)
+    {
+        const auto positionBase = int64_t(positions.size());
+        const auto texcoordBase = int64_t(texcoords.size());
+
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+
+        for (const auto &corner : chunk.corners)
+        {
+            const auto position = corner.positionRelative ? positionBase + corner.position : corner.position;
+            if (position < 0 || position >= int64_t(positionCount))
+            {
+                std::cout << "Face references missing vertex " << position + 1 << " in " << filename << std::endl;
+                return {};
+            }
+
+            if (!hasTexcoords)
+            {
+                res.indices.push_back(uint32_t(position));
+                continue;
+            }
+
+            auto texcoord = int64_t{-1};
+            if (corner.texcoord != ObjCorner::NO_INDEX)
+            {
+                texcoord = corner.texcoordRelative ? texcoordBase + corner.texcoord : corner.texcoord;
+                if (texcoord < 0 || texcoord >= int64_t(texcoordCount))
+                {
+                    std::cout << "Face references missing texture coordinate " << texcoord + 1 << " in " << filename << std::endl;
+                    return {};
+                }
+            }
+
+            // Forward references are allowed, the vertex is filled in once all
+            // positions are known
+            const auto key = (uint64_t(position) << 32) | uint64_t(texcoord + 1);
+            const auto [it, inserted] = vertexIds.try_emplace(key, uint32_t(vertexIds.size()));
+            res.indices.push_back(it->second);
+        }
+    }
+
+    if (!hasTexcoords)
+    {
+        res.vertices.assign(positions.begin(), positions.end());
+        return res;
+    }
+
+    res.vertices.resize(vertexIds.size(), TexturedVertextFloat{0.0f, 0.0f, 0.0f, 0.0f, 0.0f});
+    for (const auto &[key, id] : vertexIds)
+    {
+        const auto &position = positions[key >> 32];
+        const auto texcoordPlusOne = key & 0xFFFFFFFFu;
+        const auto texcoord = texcoordPlusOne ? texcoords[texcoordPlusOne - 1] : PointFloat{0.0f, 0.0f};
+
+        res.vertices[id] = {position.x, position.y, position.z, texcoord.x, texcoord.y};
+    }
+
+    return res;
+}
+
+// Memory maps the file and parses it on a thread per core, see parseIndexedObj
+inline IndexedMesh loadIndexedObjFile(const std::string &filename)
+{
+    const MappedFile file{filename};
+
+    if (!file.isOpen())
+    {
+        std::cout << "Could not open file " << filename << std::endl;
+        return {};
+    }
+
+    const auto text = file.contents();
+
+    const auto threadCount = text.size() < OBJ_PARALLEL_MIN_BYTES
+                                 ? size_t{1}
+                                 : std::max(size_t{1}, size_t(std::thread::hardware_concurrency()));
+
+    return parseIndexedObj(text, threadCount, filename);
+}
+
+// Triangle soup: three vertices per triangle, shared vertices repeated
+inline std::vector<TexturedVertextFloat> loadObjFile(const std::string &filename)
+{
+    const auto mesh = loadIndexedObjFile(filename);
+
+    std::vector<TexturedVertextFloat> res;
+    res.reserve(mesh.indices.size());
+
+    for (const auto index : mesh.indices)
+    {
+        res.push_back(mesh.vertices[index]);
+    }
+
+    return res;
+}
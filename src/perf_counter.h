@@ -0,0 +1,75 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+
+// Hardware event count of the calling thread, in user space only. Kernels built
+// without perf events, containers and paranoid settings refuse to open the
+// counter, isAvailable() tells.
+struct PerfCounter
+{
+    explicit PerfCounter(uint64_t config, uint32_t type = PERF_TYPE_HARDWARE)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter &operator=(const PerfCounter &) = delete;
+
+    ~PerfCounter()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    bool isAvailable() const
+    {
+        return m_fd >= 0;
+    }
+
+    void start()
+    {
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // Events since start(), 0 when the counter is not available
+    uint64_t stop()
+    {
+        uint64_t count = 0;
+
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+            {
+                count = 0;
+            }
+        }
+
+        return count;
+    }
+
+private:
+    int m_fd = -1;
+};
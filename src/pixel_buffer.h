@@ -0,0 +1,2128 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <span>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "depth_format.h"
+#include "geometry.h"
+#include "texture.h"
+#include "transform.h"
+
+// Half open pixel rectangle [x0, x1) x [y0, y1)
+struct ClipRect
+{
+    bool contains(int32_t x, int32_t y) const
+    {
+        return x >= x0 && x < x1 && y >= y0 && y < y1;
+    }
+
+    int32_t x0;
+    int32_t y0;
+    int32_t x1;
+    int32_t y1;
+};
+
+// Fragments that reached the depth test: shaded ones passed it and were textured,
+// rejected ones were occluded and never sampled the texture
+struct FragmentStats
+{
+    FragmentStats &operator+=(const FragmentStats &other)
+    {
+        shaded += other.shaded;
+        rejected += other.rejected;
+        hizTriangles += other.hizTriangles;
+        hizBlocks += other.hizBlocks;
+        return *this;
+    }
+
+    uint64_t shaded = 0;
+    uint64_t rejected = 0;
+    // Coarse rejections by the hierarchical z-buffer, before any fragment exists
+    uint64_t hizTriangles = 0;
+    uint64_t hizBlocks = 0;
+};
+
+// Colour writes counted while visualising overdraw, see PixelBuffer::setOverdrawCounting
+struct OverdrawStats
+{
+    OverdrawStats &operator+=(const OverdrawStats &other)
+    {
+        coveredPixels += other.coveredPixels;
+        writes += other.writes;
+        maxWrites = std::max(maxWrites, other.maxWrites);
+        return *this;
+    }
+
+    // Pixels written at least once
+    uint64_t coveredPixels = 0;
+    uint64_t writes = 0;
+    uint32_t maxWrites = 0;
+};
+
+// Heat map for a pixel written writes times: black for none, then blue, cyan,
+// green, yellow, orange and red, white from OVERDRAW_COLORS.size() - 1 writes on
+inline constexpr std::array<int32_t, 8> OVERDRAW_COLORS = {
+    int32_t(0xFF000000), int32_t(0xFF0000C0), int32_t(0xFF00A0C0), int32_t(0xFF00C000),
+    int32_t(0xFFE0E000), int32_t(0xFFFF8000), int32_t(0xFFFF0000), int32_t(0xFFFFFFFF)};
+
+inline int32_t getOverdrawColor(uint32_t writes)
+{
+    return OVERDRAW_COLORS[std::min<size_t>(writes, OVERDRAW_COLORS.size() - 1)];
+}
+
+// One row of a triangle for the edge-function rasterizer, pixels [x0, x1]
+struct EdgeSpan
+{
+    int64_t x0;
+    int64_t x1;
+
+    // Edge function values at x0 and their increment per pixel
+    int64_t w1;
+    int64_t w2;
+    int64_t w3;
+    int64_t step1;
+    int64_t step2;
+    int64_t step3;
+
+    // 1/z, u/z and v/z at pixel x are row + dx * x
+    float izRow;
+    float uzRow;
+    float vzRow;
+    float izDx;
+    float uzDx;
+    float vzDx;
+
+    // Increments per row, for the texture level of detail
+    float izDy;
+    float uzDy;
+    float vzDy;
+
+    // Row pointers, indexed by x. depth holds DepthTraits<Format>::Value of the
+    // format the kernel was instantiated for.
+    void *depth;
+    int32_t *color;
+    const Texture *texture;
+    TextureFilter filter;
+};
+
+// Level of detail for Texture::sample: the longer of the two screen axes of the
+// pixel footprint, from the derivatives of u = uz / iz and v = vz / iz
+inline int32_t getSpanLod(const EdgeSpan &span, float z, float u, float v)
+{
+    const auto width = float(span.texture->m_width);
+    const auto height = float(span.texture->m_height);
+
+    const auto dudx = (span.uzDx - u * span.izDx) * z * width;
+    const auto dvdx = (span.vzDx - v * span.izDx) * z * height;
+    const auto dudy = (span.uzDy - u * span.izDy) * z * width;
+    const auto dvdy = (span.vzDy - v * span.izDy) * z * height;
+
+    const auto lengthX = dudx * dudx + dvdx * dvdx;
+    const auto lengthY = dudy * dudy + dvdy * dvdy;
+
+    return Texture::getLod(lengthX > lengthY ? lengthX : lengthY);
+}
+
+using EdgeSpanKernel = FragmentStats (*)(const EdgeSpan &);
+
+template <DepthFormat Format>
+FragmentStats rasterizeEdgeSpanScalar(const EdgeSpan &span)
+{
+    using Depth = DepthTraits<Format>;
+
+    FragmentStats stats;
+    auto *depth = static_cast<typename Depth::Value *>(span.depth);
+
+    auto w1 = span.w1;
+    auto w2 = span.w2;
+    auto w3 = span.w3;
+
+    for (auto x = span.x0; x <= span.x1; x++)
+    {
+        if ((w1 | w2 | w3) >= 0)
+        {
+            const auto iz = span.izRow + span.izDx * float(x);
+            const auto z = 1 / iz;
+            const auto key = Depth::encode(z, iz);
+            if (Depth::isNearer(key, depth[x]))
+            {
+                depth[x] = key;
+
+                const auto u = (span.uzRow + span.uzDx * float(x)) * z;
+                const auto v = (span.vzRow + span.vzDx * float(x)) * z;
+
+                span.color[x] = span.filter == TextureFilter::Nearest
+                                    ? span.texture->getPixel(u, v)
+                                    : span.texture->sample(u, v, getSpanLod(span, z, u, v), span.filter);
+                stats.shaded++;
+            }
+            else
+            {
+                stats.rejected++;
+            }
+        }
+
+        w1 += span.step1;
+        w2 += span.step2;
+        w3 += span.step3;
+    }
+
+    return stats;
+}
+
+// Same depth test as rasterizeEdgeSpanScalar, but a passing fragment adds one to
+// the colour instead of sampling the texture
+template <DepthFormat Format>
+FragmentStats rasterizeEdgeSpanOverdraw(const EdgeSpan &span)
+{
+    using Depth = DepthTraits<Format>;
+
+    FragmentStats stats;
+    auto *depth = static_cast<typename Depth::Value *>(span.depth);
+
+    auto w1 = span.w1;
+    auto w2 = span.w2;
+    auto w3 = span.w3;
+
+    for (auto x = span.x0; x <= span.x1; x++)
+    {
+        if ((w1 | w2 | w3) >= 0)
+        {
+            const auto iz = span.izRow + span.izDx * float(x);
+            const auto key = Depth::encode(1 / iz, iz);
+            if (Depth::isNearer(key, depth[x]))
+            {
+                depth[x] = key;
+                span.color[x]++;
+                stats.shaded++;
+            }
+            else
+            {
+                stats.rejected++;
+            }
+        }
+
+        w1 += span.step1;
+        w2 += span.step2;
+        w3 += span.step3;
+    }
+
+    return stats;
+}
+
+// Hands the pixels a vector kernel did not get to over to the scalar one
+template <DepthFormat Format>
+FragmentStats rasterizeEdgeSpanTail(const EdgeSpan &span, int64_t x)
+{
+    if (x > span.x1)
+    {
+        return {};
+    }
+
+    auto tail = span;
+    tail.x0 = x;
+    tail.w1 += span.step1 * (x - span.x0);
+    tail.w2 += span.step2 * (x - span.x0);
+    tail.w3 += span.step3 * (x - span.x0);
+
+    return rasterizeEdgeSpanScalar<Format>(tail);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector kernels repeat the scalar arithmetic operation for operation (no
+// fused multiply-add, IEEE division) and produce the same pixels. Edge values
+// must fit in 32 bits, which drawTriangleEdgeFunction checks before using them.
+
+// UnormDepthTraits::encode on four lanes
+template <typename Depth>
+__attribute__((target("sse4.1"))) inline __m128i encodeUnormDepthSse41(__m128 z)
+{
+    const auto code = _mm_srai_epi32(_mm_sub_epi32(_mm_castps_si128(z), _mm_set1_epi32(Depth::getNearBits())), Depth::SHIFT);
+    return _mm_min_epi32(_mm_max_epi32(code, _mm_setzero_si128()), _mm_set1_epi32(Depth::MAX_CODE));
+}
+
+// Depth test of the four pixels at depth + x, lanes outside covered fail. The
+// passing lanes are written and their bits returned in passMask.
+template <DepthFormat Format>
+__attribute__((target("sse4.1"))) inline __m128 depthTestSse41(void *depth, int64_t x, __m128 z, __m128 iz, __m128 covered, int &passMask)
+{
+    using Depth = DepthTraits<Format>;
+
+    // No 32 bit masked store before AVX, the block lies inside the span so writing
+    // back the old values of rejected lanes is safe
+    if constexpr (std::is_same_v<typename Depth::Value, float>)
+    {
+        auto *row = static_cast<float *>(depth) + x;
+        const auto key = Format == DepthFormat::Float ? z : iz;
+        const auto stored = _mm_loadu_ps(row);
+        const auto pass = _mm_and_ps(covered, Format == DepthFormat::Float ? _mm_cmplt_ps(key, stored) : _mm_cmpgt_ps(key, stored));
+
+        passMask = _mm_movemask_ps(pass);
+        if (passMask != 0)
+        {
+            _mm_storeu_ps(row, _mm_blendv_ps(stored, key, pass));
+        }
+
+        return pass;
+    }
+    else
+    {
+        auto *row = static_cast<typename Depth::Value *>(depth) + x;
+        const auto key = encodeUnormDepthSse41<Depth>(z);
+        const auto stored = sizeof(*row) == 2 ? _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row)))
+                                              : _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+        const auto pass = _mm_and_ps(covered, _mm_castsi128_ps(_mm_cmpgt_epi32(stored, key)));
+
+        passMask = _mm_movemask_ps(pass);
+        if (passMask != 0)
+        {
+            const auto written = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(stored), _mm_castsi128_ps(key), pass));
+            if constexpr (sizeof(*row) == 2)
+            {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(row), _mm_packus_epi32(written, written));
+            }
+            else
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(row), written);
+            }
+        }
+
+        return pass;
+    }
+}
+
+template <typename Depth>
+__attribute__((target("avx2"))) inline __m256i encodeUnormDepthAvx2(__m256 z)
+{
+    const auto code = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_castps_si256(z), _mm256_set1_epi32(Depth::getNearBits())), Depth::SHIFT);
+    return _mm256_min_epi32(_mm256_max_epi32(code, _mm256_setzero_si256()), _mm256_set1_epi32(Depth::MAX_CODE));
+}
+
+// depthTestSse41 on eight pixels
+template <DepthFormat Format>
+__attribute__((target("avx2"))) inline __m256i depthTestAvx2(void *depth, int64_t x, __m256 z, __m256 iz, __m256i covered, int &passMask)
+{
+    using Depth = DepthTraits<Format>;
+
+    if constexpr (std::is_same_v<typename Depth::Value, float>)
+    {
+        auto *row = static_cast<float *>(depth) + x;
+        const auto key = Format == DepthFormat::Float ? z : iz;
+        const auto stored = _mm256_loadu_ps(row);
+        const auto pass = _mm256_castps_si256(_mm256_and_ps(_mm256_castsi256_ps(covered),
+                                                            _mm256_cmp_ps(key, stored, Format == DepthFormat::Float ? _CMP_LT_OQ : _CMP_GT_OQ)));
+
+        passMask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+        if (passMask != 0)
+        {
+            _mm256_maskstore_ps(row, pass, key);
+        }
+
+        return pass;
+    }
+    else if constexpr (sizeof(typename Depth::Value) == 2)
+    {
+        auto *row = reinterpret_cast<__m128i *>(static_cast<typename Depth::Value *>(depth) + x);
+        const auto key = encodeUnormDepthAvx2<Depth>(z);
+        const auto stored = _mm256_cvtepu16_epi32(_mm_loadu_si128(row));
+        const auto pass = _mm256_and_si256(covered, _mm256_cmpgt_epi32(stored, key));
+
+        // No 16 bit masked store, the old values of rejected lanes are written back
+        passMask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+        if (passMask != 0)
+        {
+            const auto written = _mm256_blendv_epi8(stored, key, pass);
+            _mm_storeu_si128(row, _mm_packus_epi32(_mm256_castsi256_si128(written), _mm256_extracti128_si256(written, 1)));
+        }
+
+        return pass;
+    }
+    else
+    {
+        auto *row = reinterpret_cast<int *>(static_cast<typename Depth::Value *>(depth) + x);
+        const auto key = encodeUnormDepthAvx2<Depth>(z);
+        const auto stored = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row));
+        const auto pass = _mm256_and_si256(covered, _mm256_cmpgt_epi32(stored, key));
+
+        passMask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+        if (passMask != 0)
+        {
+            _mm256_maskstore_epi32(row, pass, key);
+        }
+
+        return pass;
+    }
+}
+
+template <DepthFormat Format>
+__attribute__((target("sse4.1"))) FragmentStats rasterizeEdgeSpanSse41(const EdgeSpan &span)
+{
+    FragmentStats stats;
+
+    const auto lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const auto laneOffsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const auto minusOne = _mm_set1_epi32(-1);
+    const auto one = _mm_set1_ps(1.0f);
+    const auto zero = _mm_setzero_ps();
+
+    auto w1 = _mm_add_epi32(_mm_set1_epi32(int32_t(span.w1)), _mm_mullo_epi32(lanes, _mm_set1_epi32(int32_t(span.step1))));
+    auto w2 = _mm_add_epi32(_mm_set1_epi32(int32_t(span.w2)), _mm_mullo_epi32(lanes, _mm_set1_epi32(int32_t(span.step2))));
+    auto w3 = _mm_add_epi32(_mm_set1_epi32(int32_t(span.w3)), _mm_mullo_epi32(lanes, _mm_set1_epi32(int32_t(span.step3))));
+    const auto blockStep1 = _mm_set1_epi32(int32_t(span.step1 * 4));
+    const auto blockStep2 = _mm_set1_epi32(int32_t(span.step2 * 4));
+    const auto blockStep3 = _mm_set1_epi32(int32_t(span.step3 * 4));
+
+    const auto izRow = _mm_set1_ps(span.izRow), izDx = _mm_set1_ps(span.izDx);
+    const auto uzRow = _mm_set1_ps(span.uzRow), uzDx = _mm_set1_ps(span.uzDx);
+    const auto vzRow = _mm_set1_ps(span.vzRow), vzDx = _mm_set1_ps(span.vzDx);
+
+    const auto &texture = *span.texture;
+    const auto texMaxU = _mm_set1_ps(float(texture.m_width - 1));
+    const auto texMaxV = _mm_set1_ps(float(texture.m_height - 1));
+    const auto tilesX = _mm_set1_epi32(texture.m_levels[0].tilesX);
+    const auto tileMask = _mm_set1_epi32(Texture::TILE_MASK);
+
+    auto x = span.x0;
+    for (; x + 3 <= span.x1; x += 4)
+    {
+        const auto covered = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w1, w2), w3), minusOne);
+
+        const auto coveredMask = _mm_movemask_ps(_mm_castsi128_ps(covered));
+
+        if (coveredMask != 0)
+        {
+            const auto xf = _mm_add_ps(_mm_set1_ps(float(x)), laneOffsets);
+            const auto iz = _mm_add_ps(izRow, _mm_mul_ps(izDx, xf));
+            const auto z = _mm_div_ps(one, iz);
+
+            int passMask;
+            const auto pass = depthTestSse41<Format>(span.depth, x, z, iz, _mm_castsi128_ps(covered), passMask);
+
+            stats.shaded += __builtin_popcount(passMask);
+            stats.rejected += __builtin_popcount(coveredMask & ~passMask);
+
+            if (passMask != 0)
+            {
+                const auto u = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_add_ps(uzRow, _mm_mul_ps(uzDx, xf)), z), one), zero);
+                const auto v = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_add_ps(vzRow, _mm_mul_ps(vzDx, xf)), z), one), zero);
+
+                // Texture::getTexelIndex on level 0
+                const auto texelX = _mm_cvttps_epi32(_mm_mul_ps(u, texMaxU));
+                const auto texelY = _mm_cvttps_epi32(_mm_mul_ps(v, texMaxV));
+                const auto tile = _mm_add_epi32(_mm_mullo_epi32(_mm_srai_epi32(texelY, Texture::TILE_BITS), tilesX), _mm_srai_epi32(texelX, Texture::TILE_BITS));
+                const auto texelIndex = _mm_add_epi32(_mm_slli_epi32(tile, 2 * Texture::TILE_BITS),
+                                                      _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(texelY, tileMask), Texture::TILE_BITS), _mm_and_si128(texelX, tileMask)));
+
+                // No gather before AVX2
+                alignas(16) int32_t indices[4];
+                _mm_store_si128(reinterpret_cast<__m128i *>(indices), texelIndex);
+                const auto texels = _mm_setr_epi32(texture.m_texels[indices[0]], texture.m_texels[indices[1]],
+                                                   texture.m_texels[indices[2]], texture.m_texels[indices[3]]);
+
+                // Blended like the depth, see depthTestSse41
+                const auto storedColor = _mm_loadu_si128(reinterpret_cast<const __m128i *>(span.color + x));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(span.color + x),
+                                 _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(storedColor), _mm_castsi128_ps(texels), pass)));
+            }
+        }
+
+        w1 = _mm_add_epi32(w1, blockStep1);
+        w2 = _mm_add_epi32(w2, blockStep2);
+        w3 = _mm_add_epi32(w3, blockStep3);
+    }
+
+    stats += rasterizeEdgeSpanTail<Format>(span, x);
+
+    return stats;
+}
+
+template <DepthFormat Format>
+__attribute__((target("avx2"))) FragmentStats rasterizeEdgeSpanAvx2(const EdgeSpan &span)
+{
+    FragmentStats stats;
+
+    const auto lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const auto laneOffsets = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const auto minusOne = _mm256_set1_epi32(-1);
+    const auto one = _mm256_set1_ps(1.0f);
+    const auto zero = _mm256_setzero_ps();
+
+    auto w1 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w1)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step1))));
+    auto w2 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w2)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step2))));
+    auto w3 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w3)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step3))));
+    const auto blockStep1 = _mm256_set1_epi32(int32_t(span.step1 * 8));
+    const auto blockStep2 = _mm256_set1_epi32(int32_t(span.step2 * 8));
+    const auto blockStep3 = _mm256_set1_epi32(int32_t(span.step3 * 8));
+
+    const auto izRow = _mm256_set1_ps(span.izRow), izDx = _mm256_set1_ps(span.izDx);
+    const auto uzRow = _mm256_set1_ps(span.uzRow), uzDx = _mm256_set1_ps(span.uzDx);
+    const auto vzRow = _mm256_set1_ps(span.vzRow), vzDx = _mm256_set1_ps(span.vzDx);
+
+    const auto &texture = *span.texture;
+    const auto texMaxU = _mm256_set1_ps(float(texture.m_width - 1));
+    const auto texMaxV = _mm256_set1_ps(float(texture.m_height - 1));
+    const auto tilesX = _mm256_set1_epi32(texture.m_levels[0].tilesX);
+    const auto tileMask = _mm256_set1_epi32(Texture::TILE_MASK);
+
+    auto x = span.x0;
+    for (; x + 7 <= span.x1; x += 8)
+    {
+        const auto covered = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w1, w2), w3), minusOne);
+
+        const auto coveredMask = _mm256_movemask_ps(_mm256_castsi256_ps(covered));
+
+        if (coveredMask != 0)
+        {
+            const auto xf = _mm256_add_ps(_mm256_set1_ps(float(x)), laneOffsets);
+            const auto iz = _mm256_add_ps(izRow, _mm256_mul_ps(izDx, xf));
+            const auto z = _mm256_div_ps(one, iz);
+
+            int passMask;
+            const auto pass = depthTestAvx2<Format>(span.depth, x, z, iz, covered, passMask);
+
+            stats.shaded += __builtin_popcount(passMask);
+            stats.rejected += __builtin_popcount(coveredMask & ~passMask);
+
+            if (passMask != 0)
+            {
+                const auto u = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_add_ps(uzRow, _mm256_mul_ps(uzDx, xf)), z), one), zero);
+                const auto v = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_add_ps(vzRow, _mm256_mul_ps(vzDx, xf)), z), one), zero);
+
+                // Texture::getTexelIndex on level 0
+                const auto texelX = _mm256_cvttps_epi32(_mm256_mul_ps(u, texMaxU));
+                const auto texelY = _mm256_cvttps_epi32(_mm256_mul_ps(v, texMaxV));
+                const auto tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(texelY, Texture::TILE_BITS), tilesX), _mm256_srai_epi32(texelX, Texture::TILE_BITS));
+                const auto texelIndex = _mm256_add_epi32(_mm256_slli_epi32(tile, 2 * Texture::TILE_BITS),
+                                                         _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(texelY, tileMask), Texture::TILE_BITS), _mm256_and_si256(texelX, tileMask)));
+
+                const auto texels = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), texture.m_texels.data(), texelIndex, pass, 4);
+
+                _mm256_maskstore_epi32(span.color + x, pass, texels);
+            }
+        }
+
+        w1 = _mm256_add_epi32(w1, blockStep1);
+        w2 = _mm256_add_epi32(w2, blockStep2);
+        w3 = _mm256_add_epi32(w3, blockStep3);
+    }
+
+    stats += rasterizeEdgeSpanTail<Format>(span, x);
+
+    return stats;
+}
+
+static_assert(sizeof(TextureLevel) == 4 * sizeof(int32_t));
+
+// Texture::weightedSum on 8 texels at once: red and blue (alpha and green) are
+// weighted in 16 bit lanes, the weights are repeated in both halves of a word
+__attribute__((target("avx2"))) inline __m256i weightedSumAvx2(const __m256i *texels, const __m256i *weights, int32_t count)
+{
+    const auto lowBytes = _mm256_set1_epi32(0x00FF00FF);
+
+    auto redBlue = _mm256_setzero_si256();
+    auto alphaGreen = _mm256_setzero_si256();
+
+    for (auto i = 0; i < count; i++)
+    {
+        const auto weight = _mm256_or_si256(weights[i], _mm256_slli_epi32(weights[i], 16));
+
+        redBlue = _mm256_add_epi16(redBlue, _mm256_mullo_epi16(_mm256_and_si256(texels[i], lowBytes), weight));
+        alphaGreen = _mm256_add_epi16(alphaGreen, _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(texels[i], 8), lowBytes), weight));
+    }
+
+    return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(redBlue, Texture::LOD_FRACTION_BITS), lowBytes),
+                           _mm256_andnot_si256(lowBytes, alphaGreen));
+}
+
+// Texture::sampleBilinear with a mip level per lane, only lanes in mask read texels
+__attribute__((target("avx2"))) inline __m256i sampleBilinearAvx2(const Texture &texture, __m256i level, __m256 u, __m256 v, __m256i mask)
+{
+    const auto one = _mm256_set1_ps(1.0f);
+    const auto zero = _mm256_setzero_ps();
+    const auto half = _mm256_set1_ps(0.5f);
+    const auto fractionScale = _mm256_set1_ps(float(Texture::LOD_ONE));
+    const auto lodOne = _mm256_set1_epi32(Texture::LOD_ONE);
+    const auto intOne = _mm256_set1_epi32(1);
+    const auto tileMask = _mm256_set1_epi32(Texture::TILE_MASK);
+
+    // TextureLevel fields of every lane's level
+    const auto *levels = reinterpret_cast<const int *>(texture.m_levels.data());
+    const auto field = _mm256_slli_epi32(level, 2);
+    const auto width = _mm256_i32gather_epi32(levels, field, 4);
+    const auto height = _mm256_i32gather_epi32(levels, _mm256_add_epi32(field, _mm256_set1_epi32(1)), 4);
+    const auto tilesX = _mm256_i32gather_epi32(levels, _mm256_add_epi32(field, _mm256_set1_epi32(2)), 4);
+    const auto offset = _mm256_i32gather_epi32(levels, _mm256_add_epi32(field, _mm256_set1_epi32(3)), 4);
+
+    const auto tx = _mm256_sub_ps(_mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(u, one), zero), _mm256_cvtepi32_ps(width)), half);
+    const auto ty = _mm256_sub_ps(_mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(v, one), zero), _mm256_cvtepi32_ps(height)), half);
+    const auto floorX = _mm256_floor_ps(tx);
+    const auto floorY = _mm256_floor_ps(ty);
+
+    const auto fx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(tx, floorX), fractionScale));
+    const auto fy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(ty, floorY), fractionScale));
+
+    const auto ix = _mm256_cvttps_epi32(floorX);
+    const auto iy = _mm256_cvttps_epi32(floorY);
+    const auto x0 = _mm256_max_epi32(ix, _mm256_setzero_si256());
+    const auto y0 = _mm256_max_epi32(iy, _mm256_setzero_si256());
+    const auto x1 = _mm256_min_epi32(_mm256_add_epi32(ix, intOne), _mm256_sub_epi32(width, intOne));
+    const auto y1 = _mm256_min_epi32(_mm256_add_epi32(iy, intOne), _mm256_sub_epi32(height, intOne));
+
+    const __m256i columns[] = {x0, x1, x0, x1};
+    const __m256i rows[] = {y0, y0, y1, y1};
+
+    __m256i texels[4];
+    for (auto i = 0; i < 4; i++)
+    {
+        // Texture::getTexelIndex
+        const auto tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(rows[i], Texture::TILE_BITS), tilesX), _mm256_srai_epi32(columns[i], Texture::TILE_BITS));
+        const auto index = _mm256_add_epi32(_mm256_add_epi32(offset, _mm256_slli_epi32(tile, 2 * Texture::TILE_BITS)),
+                                            _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(rows[i], tileMask), Texture::TILE_BITS), _mm256_and_si256(columns[i], tileMask)));
+
+        texels[i] = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), texture.m_texels.data(), index, mask, 4);
+    }
+
+    const auto ifx = _mm256_sub_epi32(lodOne, fx);
+    const auto ify = _mm256_sub_epi32(lodOne, fy);
+
+    __m256i weights[4];
+    weights[0] = _mm256_srai_epi32(_mm256_mullo_epi32(ifx, ify), Texture::LOD_FRACTION_BITS);
+    weights[1] = _mm256_srai_epi32(_mm256_mullo_epi32(fx, ify), Texture::LOD_FRACTION_BITS);
+    weights[2] = _mm256_srai_epi32(_mm256_mullo_epi32(ifx, fy), Texture::LOD_FRACTION_BITS);
+    weights[3] = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_sub_epi32(lodOne, weights[0]), weights[1]), weights[2]);
+
+    return weightedSumAvx2(texels, weights, 4);
+}
+
+// Bilinear and trilinear counterpart of rasterizeEdgeSpanAvx2, same pixels as the
+// scalar kernel: the level of detail follows getSpanLod and the texels
+// Texture::sample
+template <DepthFormat Format>
+__attribute__((target("avx2"))) FragmentStats rasterizeEdgeSpanFilteredAvx2(const EdgeSpan &span)
+{
+    FragmentStats stats;
+
+    const auto lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const auto laneOffsets = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const auto minusOne = _mm256_set1_epi32(-1);
+    const auto one = _mm256_set1_ps(1.0f);
+
+    auto w1 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w1)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step1))));
+    auto w2 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w2)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step2))));
+    auto w3 = _mm256_add_epi32(_mm256_set1_epi32(int32_t(span.w3)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(int32_t(span.step3))));
+    const auto blockStep1 = _mm256_set1_epi32(int32_t(span.step1 * 8));
+    const auto blockStep2 = _mm256_set1_epi32(int32_t(span.step2 * 8));
+    const auto blockStep3 = _mm256_set1_epi32(int32_t(span.step3 * 8));
+
+    const auto izRow = _mm256_set1_ps(span.izRow), izDx = _mm256_set1_ps(span.izDx), izDy = _mm256_set1_ps(span.izDy);
+    const auto uzRow = _mm256_set1_ps(span.uzRow), uzDx = _mm256_set1_ps(span.uzDx), uzDy = _mm256_set1_ps(span.uzDy);
+    const auto vzRow = _mm256_set1_ps(span.vzRow), vzDx = _mm256_set1_ps(span.vzDx), vzDy = _mm256_set1_ps(span.vzDy);
+
+    const auto &texture = *span.texture;
+    const auto texWidth = _mm256_set1_ps(float(texture.m_width));
+    const auto texHeight = _mm256_set1_ps(float(texture.m_height));
+    const auto floatOneBits = _mm256_set1_epi32(127 << 23);
+    const auto topLevel = _mm256_set1_epi32(texture.m_levelCount - 1);
+    const auto lodHalf = _mm256_set1_epi32(Texture::LOD_ONE / 2);
+    const auto lodFraction = _mm256_set1_epi32(Texture::LOD_ONE - 1);
+    const auto trilinear = span.filter == TextureFilter::Trilinear;
+
+    auto x = span.x0;
+    for (; x + 7 <= span.x1; x += 8)
+    {
+        const auto covered = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w1, w2), w3), minusOne);
+
+        const auto coveredMask = _mm256_movemask_ps(_mm256_castsi256_ps(covered));
+
+        if (coveredMask != 0)
+        {
+            const auto xf = _mm256_add_ps(_mm256_set1_ps(float(x)), laneOffsets);
+            const auto iz = _mm256_add_ps(izRow, _mm256_mul_ps(izDx, xf));
+            const auto z = _mm256_div_ps(one, iz);
+
+            int passMask;
+            const auto pass = depthTestAvx2<Format>(span.depth, x, z, iz, covered, passMask);
+
+            stats.shaded += __builtin_popcount(passMask);
+            stats.rejected += __builtin_popcount(coveredMask & ~passMask);
+
+            if (passMask != 0)
+            {
+                const auto u = _mm256_mul_ps(_mm256_add_ps(uzRow, _mm256_mul_ps(uzDx, xf)), z);
+                const auto v = _mm256_mul_ps(_mm256_add_ps(vzRow, _mm256_mul_ps(vzDx, xf)), z);
+
+                // getSpanLod
+                const auto dudx = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(uzDx, _mm256_mul_ps(u, izDx)), z), texWidth);
+                const auto dvdx = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(vzDx, _mm256_mul_ps(v, izDx)), z), texHeight);
+                const auto dudy = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(uzDy, _mm256_mul_ps(u, izDy)), z), texWidth);
+                const auto dvdy = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(vzDy, _mm256_mul_ps(v, izDy)), z), texHeight);
+                const auto lengthX = _mm256_add_ps(_mm256_mul_ps(dudx, dudx), _mm256_mul_ps(dvdx, dvdx));
+                const auto lengthY = _mm256_add_ps(_mm256_mul_ps(dudy, dudy), _mm256_mul_ps(dvdy, dvdy));
+                const auto lod = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_castps_si256(_mm256_max_ps(lengthX, lengthY)), floatOneBits),
+                                                   23 - Texture::LOD_FRACTION_BITS + 1);
+
+                __m256i texels;
+                if (trilinear)
+                {
+                    // Past either end of the chain the blend weight is 0 and the
+                    // result is the bilinear sample of the end level
+                    const auto positiveLod = _mm256_max_epi32(lod, _mm256_setzero_si256());
+                    const auto unclamped = _mm256_srai_epi32(positiveLod, Texture::LOD_FRACTION_BITS);
+                    const auto isTop = _mm256_cmpgt_epi32(unclamped, _mm256_sub_epi32(topLevel, _mm256_set1_epi32(1)));
+                    const auto level = _mm256_min_epi32(unclamped, topLevel);
+                    const auto nextLevel = _mm256_min_epi32(_mm256_add_epi32(level, _mm256_set1_epi32(1)), topLevel);
+
+                    const __m256i samples[] = {sampleBilinearAvx2(texture, level, u, v, pass), sampleBilinearAvx2(texture, nextLevel, u, v, pass)};
+                    const auto weight = _mm256_andnot_si256(isTop, _mm256_and_si256(positiveLod, lodFraction));
+                    const __m256i weights[] = {_mm256_sub_epi32(_mm256_set1_epi32(Texture::LOD_ONE), weight), weight};
+
+                    texels = weightedSumAvx2(samples, weights, 2);
+                }
+                else
+                {
+                    const auto level = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(_mm256_add_epi32(lod, lodHalf), Texture::LOD_FRACTION_BITS),
+                                                                         _mm256_setzero_si256()),
+                                                        topLevel);
+                    texels = sampleBilinearAvx2(texture, level, u, v, pass);
+                }
+
+                _mm256_maskstore_epi32(span.color + x, pass, texels);
+            }
+        }
+
+        w1 = _mm256_add_epi32(w1, blockStep1);
+        w2 = _mm256_add_epi32(w2, blockStep2);
+        w3 = _mm256_add_epi32(w3, blockStep3);
+    }
+
+    stats += rasterizeEdgeSpanTail<Format>(span, x);
+
+    return stats;
+}
+
+#endif
+
+// Filtered sampling has no SSE4.1 kernel, without gathers the four (or eight)
+// texel loads per pixel leave nothing to gain over the scalar one
+template <DepthFormat Format>
+EdgeSpanKernel getEdgeSpanKernel(SimdIsa isa, TextureFilter filter)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    switch (isa)
+    {
+    case SimdIsa::Avx2:
+        return filter == TextureFilter::Nearest ? &rasterizeEdgeSpanAvx2<Format> : &rasterizeEdgeSpanFilteredAvx2<Format>;
+    case SimdIsa::Sse41:
+        return filter == TextureFilter::Nearest ? &rasterizeEdgeSpanSse41<Format> : &rasterizeEdgeSpanScalar<Format>;
+    case SimdIsa::Scalar:
+        break;
+    }
+#endif
+    (void)isa;
+    (void)filter;
+
+    return &rasterizeEdgeSpanScalar<Format>;
+}
+
+inline EdgeSpanKernel getEdgeSpanKernel(SimdIsa isa, TextureFilter filter = TextureFilter::Nearest, DepthFormat depthFormat = DepthFormat::Float)
+{
+    return visitDepthFormat(depthFormat, [&](auto format)
+                            { return getEdgeSpanKernel<decltype(format)::value>(isa, filter); });
+}
+
+// Fills count values. Streaming (non-temporal) stores bypass the caches, for
+// memory nothing reads again soon; callers fence before others read it.
+template <typename T>
+void fillPixels(T *first, size_t count, T value, bool streaming)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (streaming)
+    {
+        while (count > 0 && (reinterpret_cast<uintptr_t>(first) & 15) != 0)
+        {
+            *first++ = value;
+            count--;
+        }
+
+        constexpr auto PER_VECTOR = 16 / sizeof(T);
+        std::array<T, PER_VECTOR> values;
+        values.fill(value);
+        const auto pattern = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values.data()));
+
+        for (; count >= PER_VECTOR; count -= PER_VECTOR, first += PER_VECTOR)
+        {
+            _mm_stream_si128(reinterpret_cast<__m128i *>(first), pattern);
+        }
+    }
+#endif
+    (void)streaming;
+
+    std::fill(first, first + count, value);
+}
+
+enum class RasterMode
+{
+    // Splits triangles in flat top/bottom halves and walks them line by line
+    Scanline,
+    // Walks the bounding box testing edge functions, see drawTriangleEdgeFunction
+    EdgeFunction,
+};
+
+struct PixelBuffer
+{
+    static constexpr auto MAX_FLOAT = std::numeric_limits<float>::max();
+    static constexpr auto SUBPIXEL_BITS = 4;
+    static constexpr int32_t HIZ_BLOCK_SIZE = 8;
+    // Granularity of the deferred clears, a divisor of TiledRasterizer::TILE_SIZE
+    static constexpr int32_t CLEAR_TILE_SIZE = 64;
+    static constexpr uint8_t CLEAR_COLOR = 1;
+    static constexpr uint8_t CLEAR_DEPTH = 2;
+    // Interpolated depths can land a few ulps below the nearest vertex
+    static constexpr auto HIZ_EPSILON = 1e-4f;
+
+    PixelBuffer(int32_t width, int32_t height, DepthFormat depthFormat = DepthFormat::Float)
+        : m_ownedData(width * height),
+          m_data(m_ownedData),
+          m_depthBuffer(),
+          m_depthFormat(depthFormat),
+          m_width(width),
+          m_height(height)
+    {
+        m_depthBuffer.resize(size_t(width) * height * getDepthBytes());
+        initHierarchicalZ();
+        initClearTiles();
+
+        clearZBuffer();
+    }
+
+    // Rasterizes straight into memory owned by someone else (e.g. a shared XImage),
+    // which must hold width * height pixels and outlive the buffer
+    PixelBuffer(int32_t width, int32_t height, int32_t *externalData, DepthFormat depthFormat = DepthFormat::Float)
+        : m_ownedData(),
+          m_data(externalData, width * height),
+          m_depthBuffer(),
+          m_depthFormat(depthFormat),
+          m_width(width),
+          m_height(height)
+    {
+        m_depthBuffer.resize(size_t(width) * height * getDepthBytes());
+        initHierarchicalZ();
+        initClearTiles();
+
+        clearZBuffer();
+    }
+
+    PixelBuffer()
+        : m_width(0),
+          m_height(0)
+    {
+    }
+
+    // m_data may point into m_ownedData, so copies would alias the source pixels
+    PixelBuffer(const PixelBuffer &) = delete;
+    PixelBuffer &operator=(const PixelBuffer &) = delete;
+    PixelBuffer(PixelBuffer &&) = default;
+    PixelBuffer &operator=(PixelBuffer &&) = default;
+
+    virtual ~PixelBuffer() = default;
+
+    void fillOutBuffer(void *outbuffer)
+    {
+        finishClears();
+
+        memcpy(outbuffer, m_data.data(), m_width * m_height * sizeof(int32_t));
+    }
+
+    // Binary PPM (P6), alpha is dropped
+    bool writePpm(const std::string &filename)
+    {
+        finishClears();
+
+        std::ofstream file{filename, std::ios::binary};
+
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        file << "P6\n"
+             << m_width << " " << m_height << "\n255\n";
+
+        std::vector<uint8_t> row(m_width * 3);
+
+        for (auto y = 0; y < m_height; y++)
+        {
+            for (auto x = 0; x < m_width; x++)
+            {
+                const auto argb = static_cast<uint32_t>(m_data[x + (y * m_width)]);
+
+                row[(x * 3) + 0] = static_cast<uint8_t>(argb >> 16);
+                row[(x * 3) + 1] = static_cast<uint8_t>(argb >> 8);
+                row[(x * 3) + 2] = static_cast<uint8_t>(argb >> 0);
+            }
+
+            file.write(reinterpret_cast<const char *>(row.data()), row.size());
+        }
+
+        return file.good();
+    }
+
+    // Same layout handed to XPutImage (32 bits per pixel, native endianness)
+    bool writeRaw(const std::string &filename)
+    {
+        finishClears();
+
+        std::ofstream file{filename, std::ios::binary};
+
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char *>(m_data.data()), m_data.size() * sizeof(int32_t));
+
+        return file.good();
+    }
+
+    // Deferred like clearZBuffer(): every tile is filled when something is first
+    // drawn into it, see resolveClears()
+    void cleanScreen(int32_t color = 0xFF000000)
+    {
+        // Counting overdraw, every pixel starts at no writes
+        m_clearColor = m_countOverdraw ? 0 : color;
+        m_clearsPending = true;
+
+        for (auto &flags : m_pendingClears)
+        {
+            flags |= CLEAR_COLOR;
+        }
+    }
+
+    // Fills the tiles nothing was drawn into since cleanScreen(), needed before the
+    // pixels are read. Their pending depth clears stay deferred, nothing reads that
+    // depth before the next clearZBuffer() makes them pending again anyway.
+    void finishClears()
+    {
+        if (!m_clearsPending)
+        {
+            return;
+        }
+
+        auto depthPending = false;
+        for (auto tile = size_t{0}; tile < m_pendingClears.size(); tile++)
+        {
+            auto &flags = m_pendingClears[tile];
+            if (flags & CLEAR_COLOR)
+            {
+                clearTile(tile, CLEAR_COLOR, true);
+                flags &= ~CLEAR_COLOR;
+            }
+
+            depthPending = depthPending || flags != 0;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_sfence();
+#endif
+        m_clearsPending = depthPending;
+    }
+
+    void drawLine(const PointInt32 &point1, const PointInt32 &point2, const Texture &texture)
+    {
+        drawLine(point1.x, point1.y, point2.x, point2.y, texture);
+    }
+
+    FragmentStats drawLine(const Vector3DFloat &point1, const Vector3DFloat &point2, const Texture &texture, const PointFloat &uv1, const PointFloat &uv2, const ClipRect &clip, int32_t lod = 0)
+    {
+        return drawLine(point1.x, point1.y, point2.x, point2.y, texture, point1.z, point2.z, uv1.x, uv2.x, uv1.y, uv2.y, clip, lod);
+    }
+
+    ClipRect getBounds() const
+    {
+        return {0, 0, m_width, m_height};
+    }
+
+    void drawTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3)
+    {
+        m_fragmentStats += drawTriangle(p1, p2, p3, texture, uv1, uv2, uv3, getBounds());
+    }
+
+    // Only pixels inside clip are written, the rest of the triangle is walked the
+    // same way so every pixel ends up identical whatever the clip rectangle is.
+    // The fragment counts are returned rather than added to getFragmentStats()
+    // so several threads can draw into disjoint clip rectangles.
+    FragmentStats drawTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3, const ClipRect &clip)
+    {
+        const auto area = getCoveredArea(p1, p2, p3, clip);
+        if (area.x0 >= area.x1 || area.y0 >= area.y1)
+        {
+            return {};
+        }
+
+        const auto minZ = std::min({p1.z, p2.z, p3.z});
+
+        if (m_hierarchicalZ && isOccludedByHiZ(area, minZ))
+        {
+            return {.hizTriangles = 1};
+        }
+
+        // Under the TiledRasterizer clip is a tile, which fuses its clear into
+        // the rasterization of the tile
+        resolveClears(area);
+
+        const auto stats = m_rasterMode == RasterMode::EdgeFunction
+                               ? drawTriangleEdgeFunction(p1, p2, p3, texture, uv1, uv2, uv3, clip)
+                               : drawTriangleScanline(p1, p2, p3, texture, uv1, uv2, uv3, clip);
+
+        markDepthWritten(area, minZ * (1.0f - HIZ_EPSILON));
+
+        return stats;
+    }
+
+    FragmentStats drawTriangleScanline(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3, const ClipRect &clip)
+    {
+        const auto lod = m_textureFilter == TextureFilter::Nearest ? 0 : getTriangleLod(p1, p2, p3, texture, uv1, uv2, uv3);
+
+        if (p1.y < p2.y)
+        {
+            std::swap(p1, p2);
+            std::swap(uv1, uv2);
+        }
+
+        if (p2.y < p3.y)
+        {
+            std::swap(p2, p3);
+            std::swap(uv2, uv3);
+        }
+
+        if (p1.y < p2.y)
+        {
+            std::swap(p1, p2);
+            std::swap(uv1, uv2);
+        }
+
+        // Reciprocal to correct texture (https://en.wikipedia.org/wiki/Texture_mapping)
+        p1.z = 1 / p1.z;
+        p2.z = 1 / p2.z;
+        p3.z = 1 / p3.z;
+
+        if (p1.y == p2.y)
+        {
+            return drawFlatTriangle(p1, p2, p3, texture, uv1, uv2, uv3, clip, lod);
+        }
+
+        const auto ay = (p1.x - p3.x) / (p1.y - p3.y);
+        const auto b = p3.x - ay * p3.y;
+
+        const auto x = p2.y * ay + b;
+
+        const auto az = (p1.z - p3.z) / (p1.y - p3.y);
+        const auto bz = p3.z - az * p3.y;
+
+        const auto z = p2.y * az + bz;
+
+        const auto midPoint = Vector3DFloat{x, p2.y, z};
+
+        const auto au1 = float(uv1.x - uv3.x) / (p1.y - p3.y);
+        const auto bu1 = uv3.x - au1 * p3.y;
+
+        const auto av1 = float(uv1.y - uv3.y) / (p1.y - p3.y);
+        const auto bv1 = uv3.y - av1 * p3.y;
+
+        const auto u1 = au1 * p2.y + bu1;
+        const auto v1 = av1 * p2.y + bv1;
+
+        const auto midPointUv = PointFloat{u1, v1};
+
+        auto stats = drawFlatTriangle(p2, midPoint, p1, texture, uv2, midPointUv, uv1, clip, lod);
+        stats += drawFlatTriangle(p2, midPoint, p3, texture, uv2, midPointUv, uv3, clip, lod);
+
+        return stats;
+    }
+
+    // Level of detail of a whole triangle for the scanline rasterizer: its area in
+    // full resolution texels over its area in pixels. uv are divided by z.
+    static int32_t getTriangleLod(const Vector3DFloat &p1, const Vector3DFloat &p2, const Vector3DFloat &p3, const Texture &texture,
+                                  const PointFloat &uv1, const PointFloat &uv2, const PointFloat &uv3)
+    {
+        const auto screenArea = std::fabs((p2.x - p1.x) * (p3.y - p1.y) - (p3.x - p1.x) * (p2.y - p1.y));
+
+        const auto u1 = uv1.x * p1.z, v1 = uv1.y * p1.z;
+        const auto u2 = uv2.x * p2.z, v2 = uv2.y * p2.z;
+        const auto u3 = uv3.x * p3.z, v3 = uv3.y * p3.z;
+        const auto texelArea = std::fabs((u2 - u1) * (v3 - v1) - (u3 - u1) * (v2 - v1)) * float(texture.m_width) * float(texture.m_height);
+
+        return screenArea > 0.0f ? Texture::getLod(texelArea / screenArea) : 0;
+    }
+
+    // Half-space rasterizer: vertices are snapped to SUBPIXEL_BITS of fixed point,
+    // coverage comes from three integer edge functions stepped per pixel, and 1/z,
+    // u/z and v/z are planes set up once per triangle. Pixels are sampled at their
+    // centers and shared edges follow the top-left rule, so adjacent triangles
+    // neither leave cracks nor draw a pixel twice. Rows go to an EdgeSpanKernel.
+    FragmentStats drawTriangleEdgeFunction(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3, const ClipRect &clip)
+    {
+        constexpr auto SUBPIXEL_STEPS = 1 << SUBPIXEL_BITS;
+        constexpr auto MAX_COORDINATE = float(1 << 20);
+
+        const auto inRange = [MAX_COORDINATE](const Vector3DFloat &p)
+        {
+            return std::fabs(p.x) < MAX_COORDINATE && std::fabs(p.y) < MAX_COORDINATE;
+        };
+
+        // Also catches NaNs, the fixed point setup cannot represent those
+        if (!inRange(p1) || !inRange(p2) || !inRange(p3))
+        {
+            return {};
+        }
+
+        const auto snap = [](float value)
+        {
+            return static_cast<int64_t>(std::lround(value * SUBPIXEL_STEPS));
+        };
+
+        int64_t x1 = snap(p1.x), y1 = snap(p1.y);
+        int64_t x2 = snap(p2.x), y2 = snap(p2.y);
+        int64_t x3 = snap(p3.x), y3 = snap(p3.y);
+
+        auto area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+        if (area == 0)
+        {
+            return {};
+        }
+
+        // Keep a single winding so "inside" is always the positive side of every edge
+        if (area < 0)
+        {
+            std::swap(x2, x3);
+            std::swap(y2, y3);
+            std::swap(p2, p3);
+            std::swap(uv2, uv3);
+            area = -area;
+        }
+
+        const auto minX = std::max<int64_t>(clip.x0, std::min({x1, x2, x3}) >> SUBPIXEL_BITS);
+        const auto maxX = std::min<int64_t>(clip.x1 - 1, std::max({x1, x2, x3}) >> SUBPIXEL_BITS);
+        const auto minY = std::max<int64_t>(clip.y0, std::min({y1, y2, y3}) >> SUBPIXEL_BITS);
+        const auto maxY = std::min<int64_t>(clip.y1 - 1, std::max({y1, y2, y3}) >> SUBPIXEL_BITS);
+
+        if (minX > maxX || minY > maxY)
+        {
+            return {};
+        }
+
+        // Edge from a to b, positive on the inside. Pixels exactly on an edge only
+        // belong to it if it is a top or a left edge, the bias turns ">= 0" into "> 0".
+        struct Edge
+        {
+            Edge(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t px, int64_t py)
+                : stepX(-(by - ay) * SUBPIXEL_STEPS),
+                  stepY((bx - ax) * SUBPIXEL_STEPS),
+                  rowStart((bx - ax) * (py - ay) - (by - ay) * (px - ax))
+            {
+                const auto isTopLeft = (by < ay) || (by == ay && bx > ax);
+                rowStart += isTopLeft ? 0 : -1;
+            }
+
+            int64_t stepX;
+            int64_t stepY;
+            int64_t rowStart;
+        };
+
+        // Sample point of the first pixel of the bounding box
+        const auto sampleX = (minX << SUBPIXEL_BITS) + SUBPIXEL_STEPS / 2;
+        const auto sampleY = (minY << SUBPIXEL_BITS) + SUBPIXEL_STEPS / 2;
+
+        Edge e1{x2, y2, x3, y3, sampleX, sampleY};
+        Edge e2{x3, y3, x1, y1, sampleX, sampleY};
+        Edge e3{x1, y1, x2, y2, sampleX, sampleY};
+
+        // Plane coefficients for values known at the three (snapped) vertices
+        const auto fx1 = float(x1) / SUBPIXEL_STEPS, fy1 = float(y1) / SUBPIXEL_STEPS;
+        const auto dx2 = float(x2 - x1) / SUBPIXEL_STEPS, dy2 = float(y2 - y1) / SUBPIXEL_STEPS;
+        const auto dx3 = float(x3 - x1) / SUBPIXEL_STEPS, dy3 = float(y3 - y1) / SUBPIXEL_STEPS;
+        const auto invDet = 1.0f / (dx2 * dy3 - dx3 * dy2);
+
+        // Evaluated as origin + dy * y + dx * x from the pixel coordinates rather than
+        // accumulated from the first pixel, so the value at a pixel does not depend on
+        // where the clip rectangle starts the walk
+        struct Plane
+        {
+            float row(int64_t y) const
+            {
+                return origin + dy * float(y);
+            }
+
+            float dx;
+            float dy;
+            float origin;
+        };
+
+        const auto makePlane = [&](float a1, float a2, float a3)
+        {
+            const auto dadx = ((a2 - a1) * dy3 - (a3 - a1) * dy2) * invDet;
+            const auto dady = ((a3 - a1) * dx2 - (a2 - a1) * dx3) * invDet;
+
+            return Plane{dadx, dady, a1 + dadx * (0.5f - fx1) + dady * (0.5f - fy1)};
+        };
+
+        // Reciprocal to correct texture (https://en.wikipedia.org/wiki/Texture_mapping)
+        const auto invZ = makePlane(1 / p1.z, 1 / p2.z, 1 / p3.z);
+        const auto uOverZ = makePlane(uv1.x, uv2.x, uv3.x);
+        const auto vOverZ = makePlane(uv1.y, uv2.y, uv3.y);
+
+        // Vector kernels keep edge values in 32 bits, which holds while the
+        // bounding box spans less than 2^15 subpixel steps in both directions
+        constexpr auto MAX_VECTOR_EXTENT = int64_t{1} << 15;
+        const auto fitsVectorKernel = std::max({x1, x2, x3}) - std::min({x1, x2, x3}) < MAX_VECTOR_EXTENT &&
+                                      std::max({y1, y2, y3}) - std::min({y1, y2, y3}) < MAX_VECTOR_EXTENT;
+        const auto kernel = m_countOverdraw     ? getOverdrawKernel()
+                            : fitsVectorKernel ? getEdgeSpanKernel(m_simdIsa, m_textureFilter, m_depthFormat)
+                                               : getEdgeSpanKernel(SimdIsa::Scalar, m_textureFilter, m_depthFormat);
+
+        EdgeSpan span{
+            .x0 = minX,
+            .x1 = maxX,
+            .w1 = 0,
+            .w2 = 0,
+            .w3 = 0,
+            .step1 = e1.stepX,
+            .step2 = e2.stepX,
+            .step3 = e3.stepX,
+            .izRow = 0.0f,
+            .uzRow = 0.0f,
+            .vzRow = 0.0f,
+            .izDx = invZ.dx,
+            .uzDx = uOverZ.dx,
+            .vzDx = vOverZ.dx,
+            .izDy = invZ.dy,
+            .uzDy = uOverZ.dy,
+            .vzDy = vOverZ.dy,
+            .depth = nullptr,
+            .color = nullptr,
+            .texture = &texture,
+            .filter = m_textureFilter};
+
+        FragmentStats stats;
+
+        // Blocks of the hierarchical z-buffer the triangle is entirely behind are
+        // skipped, visibleBlocks holds the verdict for the current row of blocks
+        thread_local std::vector<uint8_t> visibleBlocks;
+        const auto depthLimit = std::min({p1.z, p2.z, p3.z}) * (1.0f - HIZ_EPSILON);
+        const auto firstBlock = minX / HIZ_BLOCK_SIZE;
+        const auto lastBlock = maxX / HIZ_BLOCK_SIZE;
+        auto allBlocksVisible = true;
+
+        visibleBlocks.resize(lastBlock - firstBlock + 1);
+
+        for (auto y = minY; y <= maxY; y++)
+        {
+            if (m_hierarchicalZ && (y == minY || y % HIZ_BLOCK_SIZE == 0))
+            {
+                allBlocksVisible = true;
+                const auto blockRow = (y / HIZ_BLOCK_SIZE) * m_hizBlocksX;
+
+                for (auto block = firstBlock; block <= lastBlock; block++)
+                {
+                    const auto visible = !isBlockOccluded(block + blockRow, depthLimit);
+                    visibleBlocks[block - firstBlock] = visible;
+
+                    if (!visible)
+                    {
+                        allBlocksVisible = false;
+                        stats.hizBlocks++;
+                    }
+                }
+            }
+
+            span.w1 = e1.rowStart;
+            span.w2 = e2.rowStart;
+            span.w3 = e3.rowStart;
+
+            span.izRow = invZ.row(y);
+            span.uzRow = uOverZ.row(y);
+            span.vzRow = vOverZ.row(y);
+
+            span.depth = getDepthRow(y);
+            span.color = m_data.data() + (y * m_width);
+
+            if (allBlocksVisible)
+            {
+                stats += kernel(span);
+            }
+            else
+            {
+                // Kernels give the same pixels wherever a span starts, so runs of
+                // visible blocks are drawn as separate spans
+                auto block = firstBlock;
+                while (block <= lastBlock)
+                {
+                    if (!visibleBlocks[block - firstBlock])
+                    {
+                        block++;
+                        continue;
+                    }
+
+                    const auto runStart = block;
+                    while (block <= lastBlock && visibleBlocks[block - firstBlock])
+                    {
+                        block++;
+                    }
+
+                    auto run = span;
+                    run.x0 = std::max(minX, runStart * HIZ_BLOCK_SIZE);
+                    run.x1 = std::min(maxX, block * HIZ_BLOCK_SIZE - 1);
+                    run.w1 += span.step1 * (run.x0 - minX);
+                    run.w2 += span.step2 * (run.x0 - minX);
+                    run.w3 += span.step3 * (run.x0 - minX);
+
+                    stats += kernel(run);
+                }
+            }
+
+            e1.rowStart += e1.stepY;
+            e2.rowStart += e2.stepY;
+            e3.rowStart += e3.stepY;
+        }
+
+        return stats;
+    }
+
+    FragmentStats drawFlatTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, const PointFloat &uv1, const PointFloat &uv2, const PointFloat &uv3, const ClipRect &clip, int32_t lod)
+    {
+        assert(p1.y == p2.y);
+
+        const auto ay1 = float(p1.x - p3.x) / (p1.y - p3.y);
+        const auto b1 = p3.x - ay1 * p3.y;
+
+        const auto ay2 = float(p2.x - p3.x) / (p2.y - p3.y);
+        const auto b2 = p3.x - ay2 * p3.y;
+
+        const auto az1 = float(p1.z - p3.z) / (p1.y - p3.y);
+        const auto bb1 = p3.z - az1 * p3.y;
+
+        const auto az2 = float(p2.z - p3.z) / (p2.y - p3.y);
+        const auto bb2 = p3.z - az2 * p3.y;
+
+        const auto au1 = float(uv1.x - uv3.x) / (p1.y - p3.y);
+        const auto bu1 = uv3.x - au1 * p3.y;
+
+        const auto au2 = float(uv2.x - uv3.x) / (p2.y - p3.y);
+        const auto bu2 = uv3.x - au2 * p3.y;
+
+        const auto av1 = float(uv1.y - uv3.y) / (p1.y - p3.y);
+        const auto bv1 = uv3.y - av1 * p3.y;
+
+        const auto av2 = float(uv2.y - uv3.y) / (p2.y - p3.y);
+        const auto bv2 = uv3.y - av2 * p3.y;
+
+        FragmentStats stats;
+
+        const auto yStart = std::min(p1.y, p3.y);
+        const auto yEnd = std::max(p1.y, p3.y);
+
+        for (auto step = firstClippedStep(yStart, clip.y0); yStart + step < yEnd; step++)
+        {
+            const auto y = yStart + step;
+            const auto row = static_cast<int32_t>(y);
+
+            if (row < clip.y0)
+            {
+                continue;
+            }
+
+            if (row >= clip.y1)
+            {
+                break;
+            }
+
+            const auto x1 = (ay1 * y + b1);
+            const auto x2 = (ay2 * y + b2);
+            const auto z1 = (az1 * y + bb1);
+            const auto z2 = (az2 * y + bb2);
+
+            const auto u1 = (au1 * y + bu1);
+            const auto u2 = (au2 * y + bu2);
+
+            const auto v1 = (av1 * y + bv1);
+            const auto v2 = (av2 * y + bv2);
+
+            stats += drawLine({x1, y, z1}, {x2, y, z2}, texture, {u1, v1}, {u2, v2}, clip, lod);
+        }
+
+        return stats;
+    }
+
+    void drawLine(float x1, float y1, float x2, float y2, const Texture &texture, float z1 = 0, float z2 = 0, float u1 = 0.0f, float u2 = 0.0f, float v1 = 0.0f, float v2 = 0.0f)
+    {
+        const auto area = getCoveredArea({x1, y1, 0.0f}, {x2, y2, 0.0f}, {x1, y1, 0.0f}, getBounds());
+        resolveClears(area);
+
+        m_fragmentStats += drawLine(x1, y1, x2, y2, texture, z1, z2, u1, u2, v1, v2, getBounds());
+
+        // Depth along a free standing line is not tracked, forget the block minimums
+        markDepthWritten(area, std::numeric_limits<float>::lowest());
+    }
+
+    // lod only matters with a filtered texture, see Texture::sample
+    FragmentStats drawLine(float x1, float y1, float x2, float y2, const Texture &texture, float z1, float z2, float u1, float u2, float v1, float v2, const ClipRect &clip, int32_t lod = 0)
+    {
+        FragmentStats stats;
+
+        const auto getZ = [z1, z2, x1, x2, y1, y2](float x, float y)
+        {
+            if (z1 == z2)
+            {
+                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
+                return 1/z1;
+            }
+
+            if (x1 != x2)
+            {
+                const auto dzdx = (z2 - z1) / static_cast<float>(x2 - x1);
+                const auto b = z1 - (dzdx * x1);
+                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
+                return 1/((dzdx * x) + b);
+            }
+
+            if (y1 != y2)
+            {
+                const auto dzdy = (z2 - z1) / static_cast<float>(y2 - y1);
+                const auto b = z1 - (dzdy * y1);
+                // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
+                return 1/((dzdy * y) + b);
+            }
+            // assert(z1 == z2 && "DOT?");
+
+            // Reciprocal to get the actual z value (https://en.wikipedia.org/wiki/Texture_mapping)
+            return 1/z1;
+        };
+
+        const auto getU = [z1, z2, x1, x2, y1, y2, u1, u2](float x, float y, float z)
+        {
+            if (u1 == u2)
+            {
+                return u1*z;
+            }
+
+            if (x1 != x2)
+            {
+                const auto dudx = (u2 - u1) / static_cast<float>(x2 - x1);
+                const auto b = u1 - (dudx * x1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudx * x) + b) *z;
+            }
+
+            if (y1 != y2)
+            {
+                const auto dudy = (u2 - u1) / static_cast<float>(y2 - y1);
+                const auto b = u1 - (dudy * y1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudy * y) + b) *z;
+            }
+
+            if (z1 != z2)
+            {
+                const auto dudz = (u2 - u1) / static_cast<float>(z2 - z1);
+                const auto b = u1 - (dudz * z1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudz * z) + b) *z;
+            }
+
+            return u1*z;
+        };
+
+        const auto getV = [z1, z2, x1, x2, y1, y2, v1, v2](float x, float y, float z)
+        {
+            if (v1 == v2)
+            {
+                return v1*z;
+            }
+
+
+            if (x1 != x2)
+            {
+                const auto dudx = (v2 - v1) / static_cast<float>(x2 - x1);
+                const auto b = v1 - (dudx * x1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudx * x) + b)*z;
+            }
+
+            if (y1 != y2)
+            {
+                const auto dudy = (v2 - v1) / static_cast<float>(y2 - y1);
+                const auto b = v1 - (dudy * y1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudy * y) + b)*z;
+            }
+
+            if (z1 != z2)
+            {
+                const auto dudz = (v2 - v1) / static_cast<float>(z2 - z1);
+                const auto b = v1 - (dudz * z1);
+                // Multiply by Z to get actual u v coordinates after correction (https://en.wikipedia.org/wiki/Texture_mapping)
+                return ((dudz * z) + b) *z;
+            }
+
+            return v1*z;
+        };
+
+        const auto getColor = [getU, getV, &texture, lod, filter = m_textureFilter](float x, float y, float z)
+        {
+            const auto u = getU(x, y, z);
+            const auto v = getV(x, y, z);
+
+            return texture.sample(u, v, lod, filter);
+        };
+
+        if (x1 == x2)
+        {
+            if (y1 > y2)
+            {
+                std::swap(x1, x2);
+                std::swap(u1, u2);
+                std::swap(y1, y2);
+                std::swap(v1, v2);
+            }
+            for (auto y = y1; y < y2; y++)
+            {
+                if (!clip.contains(x1, y))
+                {
+                    continue;
+                }
+                const auto z = getZ(x1, y);
+                shadePixel(x1, y, z, [&]()
+                           { return getColor(x1, y, z); }, stats);
+            }
+            return stats;
+        }
+
+        if (y1 == y2)
+        {
+            if (x1 > x2)
+            {
+                std::swap(x1, x2);
+                std::swap(u1, u2);
+                std::swap(y1, y2);
+                std::swap(v1, v2);
+            }
+            const auto row = static_cast<int32_t>(y1);
+            if (row < clip.y0 || row >= clip.y1)
+            {
+                return stats;
+            }
+
+            const auto [firstStep, endStep] = clippedStepRange(x1, x2, clip.x0, clip.x1);
+
+            for (auto step = firstStep; step < endStep; step++)
+            {
+                const auto x = x1 + step;
+                const auto column = static_cast<int32_t>(x);
+
+                const auto z = getZ(x, y1);
+                shadePixel(column, row, z, [&]()
+                           { return getColor(x, y1, z); }, stats);
+            }
+            return stats;
+        }
+
+        const auto ax = (y1 - y2) / (x1 - x2);
+        const auto ay = (x1 - x2) / (y1 - y2);
+
+        if (fabs(ax) < fabs(ay))
+        {
+            if (x1 > x2)
+            {
+                std::swap(x1, x2);
+                std::swap(u1, u2);
+                std::swap(y1, y2);
+                std::swap(v1, v2);
+            }
+            const auto b = y2 - ax * x2;
+            
+            for (auto x = x1; x <= x2; x++)
+            {
+                const auto y = static_cast<int32_t>(ax * x + b);
+                if (!clip.contains(x, y))
+                {
+                    continue;
+                }
+                const auto z = getZ(x, y);
+                shadePixel(x, y, z, [&]()
+                           { return getColor(x, y, z); }, stats);
+            }
+        }
+        else
+        {
+            if (y1 > y2)
+            {
+                std::swap(x1, x2);
+                std::swap(u1, u2);
+                std::swap(y1, y2);
+                std::swap(v1, v2);
+            }
+            const auto b = x2 - ay * y2;
+
+            for (auto y = y1; y <= y2; y++)
+            {
+                const auto x = static_cast<int32_t>(ay * y + b);
+                if (!clip.contains(x, y))
+                {
+                    continue;
+                }
+                const auto z = getZ(x, y);
+                shadePixel(x, y, z, [&]()
+                           { return getColor(x, y, z); }, stats);
+            }
+        }
+
+        return stats;
+    }
+
+    void putPixel(const PointInt32 &point, int32_t color)
+    {
+        putPixel(point.x, point.y, color);
+    }
+
+    void putPixel(int32_t x, int32_t y, int32_t argb)
+    {
+        assert(x >= 0);
+        assert(x < m_width);
+        assert(y >= 0);
+        assert(y < m_height);
+
+        resolveClears({x, y, x + 1, y + 1});
+        auto &pixel = m_data[x + (y * m_width)];
+        pixel = m_countOverdraw ? pixel + 1 : argb;
+    }
+
+    void putPixel(int32_t x, int32_t y, float z, int32_t color)
+    {
+        assert(getBounds().contains(x, y));
+
+        resolveClears({x, y, x + 1, y + 1});
+        if (testDepth(x + (y * m_width), z))
+        {
+            putPixel(x, y, color);
+            markDepthWritten({x, y, x + 1, y + 1}, z);
+        }
+    }
+
+    // Depth test first, the shader (texture lookup) only runs for fragments that survive it
+    template <typename Shader_T>
+    void shadePixel(int32_t x, int32_t y, float z, const Shader_T &shader, FragmentStats &stats)
+    {
+        assert(getBounds().contains(x, y));
+
+        const auto index = x + (y * m_width);
+        if (testDepth(index, z))
+        {
+            m_data[index] = m_countOverdraw ? m_data[index] + 1 : shader();
+            stats.shaded++;
+        }
+        else
+        {
+            stats.rejected++;
+        }
+    }
+
+    const FragmentStats &getFragmentStats() const
+    {
+        return m_fragmentStats;
+    }
+
+    void addFragmentStats(const FragmentStats &stats)
+    {
+        m_fragmentStats += stats;
+    }
+
+    void resetFragmentStats()
+    {
+        m_fragmentStats = {};
+    }
+
+    // Deferred, see resolveClears()
+    void clearZBuffer()
+    {
+        m_clearsPending = true;
+
+        for (auto &flags : m_pendingClears)
+        {
+            flags |= CLEAR_DEPTH;
+        }
+
+        std::fill(m_hizMin.begin(), m_hizMin.end(), MAX_FLOAT);
+        std::fill(m_hizMax.begin(), m_hizMax.end(), MAX_FLOAT);
+        std::fill(m_hizDirty.begin(), m_hizDirty.end(), 0);
+    }
+
+    // Chosen at construction, the depth buffer is allocated for it
+    DepthFormat getDepthFormat() const
+    {
+        return m_depthFormat;
+    }
+
+    // Bytes per depth value, what a depth test reads and a passing fragment writes
+    size_t getDepthBytes() const
+    {
+        return visitDepthFormat(m_depthFormat, [](auto format)
+                                { return sizeof(typename DepthTraits<decltype(format)::value>::Value); });
+    }
+
+    // Coarse rejection against per block depth bounds, the output is the same either way
+    void setHierarchicalZ(bool enabled)
+    {
+        m_hierarchicalZ = enabled;
+    }
+
+    // Anything inside area at depth minZ or farther would be hidden by what was
+    // drawn so far. Never true with hierarchical z disabled.
+    bool isAreaOccluded(const ClipRect &area, float minZ)
+    {
+        return m_hierarchicalZ && area.x0 < area.x1 && area.y0 < area.y1 && isOccludedByHiZ(area, minZ);
+    }
+
+    // Passing fragments and putPixel() add one to the colour instead of writing
+    // it, from the next cleanScreen() on, and resolveOverdraw() then turns the
+    // counts into a heat map. Depth is tested and written as usual.
+    void setOverdrawCounting(bool enabled)
+    {
+        m_countOverdraw = enabled;
+    }
+
+    bool isCountingOverdraw() const
+    {
+        return m_countOverdraw;
+    }
+
+    // Replaces the write counts of a finished frame with getOverdrawColor() and
+    // adds them to getOverdrawStats(). Does nothing unless counting.
+    void resolveOverdraw()
+    {
+        if (!m_countOverdraw)
+        {
+            return;
+        }
+
+        finishClears();
+
+        OverdrawStats stats;
+        for (auto &pixel : m_data)
+        {
+            const auto writes = uint32_t(pixel);
+            stats.coveredPixels += writes > 0;
+            stats.writes += writes;
+            stats.maxWrites = std::max(stats.maxWrites, writes);
+
+            pixel = getOverdrawColor(writes);
+        }
+
+        m_overdrawStats += stats;
+    }
+
+    const OverdrawStats &getOverdrawStats() const
+    {
+        return m_overdrawStats;
+    }
+
+    // Draws whose triangles are submitted nearest first, see drawProjectedModel.
+    // Only the order changes, so only fragments at equal depths can differ.
+    void setTriangleDepthSort(bool enabled)
+    {
+        m_triangleDepthSort = enabled;
+    }
+
+    bool getTriangleDepthSort() const
+    {
+        return m_triangleDepthSort;
+    }
+
+    int32_t getPixel(const PointInt32 &point) const
+    {
+        return getPixel(point.x, point.y);
+    }
+
+    int32_t getPixel(int32_t x, int32_t y) const
+    {
+        assert(x >= 0 && x < m_width);
+        assert(y >= 0 && y < m_height);
+
+        if (m_clearsPending && (m_pendingClears[getClearTile(x, y)] & CLEAR_COLOR))
+        {
+            return m_clearColor;
+        }
+
+        return m_data[x + (y * m_width)];
+    }
+
+    // Stored depth as the view z it stands for, see DepthTraits::decode
+    float getDepth(int32_t x, int32_t y) const
+    {
+        assert(x >= 0 && x < m_width);
+        assert(y >= 0 && y < m_height);
+
+        const auto cleared = m_clearsPending && (m_pendingClears[getClearTile(x, y)] & CLEAR_DEPTH);
+
+        return visitDepthFormat(m_depthFormat, [&](auto format)
+                                {
+                                    using Depth = DepthTraits<decltype(format)::value>;
+                                    const auto *depth = reinterpret_cast<const typename Depth::Value *>(m_depthBuffer.data());
+
+                                    return Depth::decode(cleared ? Depth::CLEAR : depth[x + (y * m_width)]); });
+    }
+
+    void setRasterMode(RasterMode mode)
+    {
+        m_rasterMode = mode;
+    }
+
+    RasterMode getRasterMode() const
+    {
+        return m_rasterMode;
+    }
+
+    // Span kernel used by RasterMode::EdgeFunction, every choice writes the same pixels
+    void setSimdIsa(SimdIsa isa)
+    {
+        m_simdIsa = isSimdIsaSupported(isa) ? isa : SimdIsa::Scalar;
+    }
+
+    SimdIsa getSimdIsa() const
+    {
+        return m_simdIsa;
+    }
+
+    // The edge rasterizer picks a level of detail per pixel, the scanline one per triangle
+    void setTextureFilter(TextureFilter filter)
+    {
+        m_textureFilter = filter;
+    }
+
+    TextureFilter getTextureFilter() const
+    {
+        return m_textureFilter;
+    }
+
+    int32_t getWidth() const
+    {
+        return m_width;
+    }
+
+    int32_t getHeight() const
+    {
+        return m_height;
+    }
+
+    void drawBuffer(const PixelBuffer &buffer, int32_t posX, int32_t posY)
+    {
+        for (auto i = 0; i < buffer.getWidth(); i++)
+        {
+            for (auto j = 0; j < buffer.getHeight(); j++)
+            {
+                putPixel(i + posX, j + posY, buffer.getPixel(i, j));
+            }
+        }
+    }
+
+protected:
+    void *getDepthRow(int32_t y)
+    {
+        return m_depthBuffer.data() + (size_t(y) * m_width * getDepthBytes());
+    }
+
+    EdgeSpanKernel getOverdrawKernel() const
+    {
+        return visitDepthFormat(m_depthFormat, [](auto format)
+                                { return EdgeSpanKernel{&rasterizeEdgeSpanOverdraw<decltype(format)::value>}; });
+    }
+
+    // Writes z at index if it is nearer than the stored depth
+    bool testDepth(int32_t index, float z)
+    {
+        return visitDepthFormat(m_depthFormat, [&](auto format)
+                                {
+                                    using Depth = DepthTraits<decltype(format)::value>;
+                                    auto *depth = reinterpret_cast<typename Depth::Value *>(m_depthBuffer.data());
+
+                                    const auto key = Depth::encode(z, 1 / z);
+                                    if (!Depth::isNearer(key, depth[index]))
+                                    {
+                                        return false;
+                                    }
+
+                                    depth[index] = key;
+                                    return true; });
+    }
+
+    void initClearTiles()
+    {
+        m_clearTilesX = (m_width + CLEAR_TILE_SIZE - 1) / CLEAR_TILE_SIZE;
+        m_pendingClears.assign(size_t(m_clearTilesX) * ((m_height + CLEAR_TILE_SIZE - 1) / CLEAR_TILE_SIZE), 0);
+    }
+
+    size_t getClearTile(int32_t x, int32_t y) const
+    {
+        return size_t(x / CLEAR_TILE_SIZE) + (size_t(y / CLEAR_TILE_SIZE) * m_clearTilesX);
+    }
+
+    // Carries out the clears still pending in the tiles overlapping area, before
+    // anything is drawn there. Threads drawing into disjoint tiles may call it
+    // concurrently.
+    void resolveClears(const ClipRect &area)
+    {
+        if (!m_clearsPending || area.x0 >= area.x1 || area.y0 >= area.y1)
+        {
+            return;
+        }
+
+        for (auto ty = area.y0 / CLEAR_TILE_SIZE; ty <= (area.y1 - 1) / CLEAR_TILE_SIZE; ty++)
+        {
+            for (auto tx = area.x0 / CLEAR_TILE_SIZE; tx <= (area.x1 - 1) / CLEAR_TILE_SIZE; tx++)
+            {
+                auto &flags = m_pendingClears[tx + (size_t(ty) * m_clearTilesX)];
+                if (flags != 0)
+                {
+                    clearTile(tx + (size_t(ty) * m_clearTilesX), flags, false);
+                    flags = 0;
+                }
+            }
+        }
+    }
+
+    void clearTile(size_t tile, uint8_t flags, bool streaming)
+    {
+        const auto x0 = int32_t(tile % m_clearTilesX) * CLEAR_TILE_SIZE;
+        const auto y0 = int32_t(tile / m_clearTilesX) * CLEAR_TILE_SIZE;
+        const auto x1 = std::min(x0 + CLEAR_TILE_SIZE, m_width);
+        const auto y1 = std::min(y0 + CLEAR_TILE_SIZE, m_height);
+
+        for (auto y = y0; y < y1; y++)
+        {
+            if (flags & CLEAR_COLOR)
+            {
+                fillPixels(m_data.data() + x0 + (y * m_width), size_t(x1 - x0), m_clearColor, streaming);
+            }
+
+            if (flags & CLEAR_DEPTH)
+            {
+                visitDepthFormat(m_depthFormat, [&](auto format)
+                                 {
+                                     using Depth = DepthTraits<decltype(format)::value>;
+                                     auto *depth = static_cast<typename Depth::Value *>(getDepthRow(y));
+                                     fillPixels(depth + x0, size_t(x1 - x0), Depth::CLEAR, streaming); });
+            }
+        }
+    }
+
+    void initHierarchicalZ()
+    {
+        m_hizBlocksX = (m_width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+        m_hizBlocksY = (m_height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+
+        m_hizMin.resize(m_hizBlocksX * m_hizBlocksY);
+        m_hizMax.resize(m_hizBlocksX * m_hizBlocksY);
+        m_hizDirty.resize(m_hizBlocksX * m_hizBlocksY);
+    }
+
+    // Pixels a triangle can touch inside clip, with a pixel of slack for rounding
+    static ClipRect getCoveredArea(const Vector3DFloat &p1, const Vector3DFloat &p2, const Vector3DFloat &p3, const ClipRect &clip)
+    {
+        const auto minX = std::min({p1.x, p2.x, p3.x});
+        const auto maxX = std::max({p1.x, p2.x, p3.x});
+        const auto minY = std::min({p1.y, p2.y, p3.y});
+        const auto maxY = std::max({p1.y, p2.y, p3.y});
+
+        // NaNs end up with the whole clip rectangle
+        const auto toPixel = [](float value, int32_t low, int32_t high, int32_t fallback)
+        {
+            return value == value ? static_cast<int32_t>(std::clamp(std::floor(value), float(low), float(high))) : fallback;
+        };
+
+        return {
+            .x0 = toPixel(minX - 1.0f, clip.x0, clip.x1, clip.x0),
+            .y0 = toPixel(minY - 1.0f, clip.y0, clip.y1, clip.y0),
+            .x1 = toPixel(maxX + 2.0f, clip.x0, clip.x1, clip.x1),
+            .y1 = toPixel(maxY + 2.0f, clip.y0, clip.y1, clip.y1)};
+    }
+
+    // A block hides anything whose depth stays above depthLimit if every stored
+    // depth in it is nearer. The minimum is a cheap lower bound that avoids
+    // rescanning dirty blocks for geometry in front of them.
+    bool isBlockOccluded(int64_t block, float depthLimit)
+    {
+        if (!(m_hizMin[block] < depthLimit))
+        {
+            return false;
+        }
+
+        if (m_hizDirty[block])
+        {
+            const auto x0 = int32_t(block % m_hizBlocksX) * HIZ_BLOCK_SIZE;
+            const auto y0 = int32_t(block / m_hizBlocksX) * HIZ_BLOCK_SIZE;
+            const auto x1 = std::min(x0 + HIZ_BLOCK_SIZE, m_width);
+            const auto y1 = std::min(y0 + HIZ_BLOCK_SIZE, m_height);
+
+            // The farthest stored value, as the nearest z it stands for
+            m_hizMax[block] = visitDepthFormat(m_depthFormat, [&](auto format)
+                                               {
+                                                   using Depth = DepthTraits<decltype(format)::value>;
+                                                   const auto *depth = reinterpret_cast<const typename Depth::Value *>(m_depthBuffer.data());
+
+                                                   auto farthest = depth[x0 + (y0 * m_width)];
+                                                   for (auto y = y0; y < y1; y++)
+                                                   {
+                                                       for (auto x = x0; x < x1; x++)
+                                                       {
+                                                           if (Depth::isNearer(farthest, depth[x + (y * m_width)]))
+                                                           {
+                                                               farthest = depth[x + (y * m_width)];
+                                                           }
+                                                       }
+                                                   }
+
+                                                   return Depth::decode(farthest); });
+            m_hizDirty[block] = 0;
+        }
+
+        return m_hizMax[block] < depthLimit;
+    }
+
+    bool isOccludedByHiZ(const ClipRect &area, float minZ)
+    {
+        const auto depthLimit = minZ * (1.0f - HIZ_EPSILON);
+
+        for (auto by = area.y0 / HIZ_BLOCK_SIZE; by <= (area.y1 - 1) / HIZ_BLOCK_SIZE; by++)
+        {
+            for (auto bx = area.x0 / HIZ_BLOCK_SIZE; bx <= (area.x1 - 1) / HIZ_BLOCK_SIZE; bx++)
+            {
+                if (!isBlockOccluded(bx + (by * m_hizBlocksX), depthLimit))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Depths written inside area are all at least minWritten, the block maximums are
+    // only recomputed when a later test needs them
+    void markDepthWritten(const ClipRect &area, float minWritten)
+    {
+        if (area.x0 >= area.x1 || area.y0 >= area.y1)
+        {
+            return;
+        }
+
+        for (auto by = area.y0 / HIZ_BLOCK_SIZE; by <= (area.y1 - 1) / HIZ_BLOCK_SIZE; by++)
+        {
+            for (auto bx = area.x0 / HIZ_BLOCK_SIZE; bx <= (area.x1 - 1) / HIZ_BLOCK_SIZE; bx++)
+            {
+                const auto block = bx + (by * m_hizBlocksX);
+                m_hizMin[block] = std::min(m_hizMin[block], minWritten);
+                m_hizDirty[block] = 1;
+            }
+        }
+    }
+
+    // First whole step from start that can land on pixel bound, callers still skip
+    // the (at most two) leading samples that truncate to a pixel below it
+    static float firstClippedStep(float start, int32_t bound)
+    {
+        return std::max(0.0f, std::floor(bound - start) - 1.0f);
+    }
+
+    // Steps of start + step (step = 0, 1, ...) that stay below end and whose
+    // truncated position lies in [bound0, bound1). Found once per span, so the
+    // loop over them needs no per-pixel bounds checks.
+    static std::pair<float, float> clippedStepRange(float start, float end, int32_t bound0, int32_t bound1)
+    {
+        const auto inside = [=](float step)
+        {
+            return start + step < end && static_cast<int32_t>(start + step) < bound1;
+        };
+
+        auto first = firstClippedStep(start, bound0);
+        while (inside(first) && static_cast<int32_t>(start + first) < bound0)
+        {
+            first++;
+        }
+
+        // Both estimates are at most a step or two short of the end
+        auto last = std::max(first, std::min(firstClippedStep(start, bound1), std::floor(end - start) - 1.0f));
+        while (last > first && !inside(last - 1))
+        {
+            last--;
+        }
+
+        while (inside(last))
+        {
+            last++;
+        }
+
+        return {first, last};
+    }
+
+    std::vector<int32_t> m_ownedData;
+    std::span<int32_t> m_data;
+    // Clears waiting for something to be drawn into their tile, CLEAR_COLOR and
+    // CLEAR_DEPTH bits per CLEAR_TILE_SIZE square. m_clearsPending is false only
+    // when none are.
+    int32_t m_clearTilesX = 0;
+    std::vector<uint8_t> m_pendingClears;
+    int32_t m_clearColor = 0;
+    bool m_clearsPending = false;
+
+    // Width * height values of m_depthFormat, see DepthTraits
+    std::vector<uint8_t> m_depthBuffer;
+    DepthFormat m_depthFormat = DepthFormat::Float;
+    int32_t m_width;
+    int32_t m_height;
+    RasterMode m_rasterMode = RasterMode::Scanline;
+    SimdIsa m_simdIsa = detectSimdIsa();
+    TextureFilter m_textureFilter = TextureFilter::Nearest;
+    FragmentStats m_fragmentStats;
+    bool m_countOverdraw = false;
+    OverdrawStats m_overdrawStats;
+    bool m_triangleDepthSort = false;
+
+    // Hierarchical z: per HIZ_BLOCK_SIZE square lower and upper bounds of the
+    // stored depths. Blocks never straddle a tile of the TiledRasterizer.
+    bool m_hierarchicalZ = true;
+    int32_t m_hizBlocksX = 0;
+    int32_t m_hizBlocksY = 0;
+    std::vector<float> m_hizMin;
+    std::vector<float> m_hizMax;
+    std::vector<uint8_t> m_hizDirty;
+};
+
+struct ScreenBuffer : public PixelBuffer
+{
+    ScreenBuffer(int32_t width, int32_t height, DepthFormat depthFormat = DepthFormat::Float)
+        : PixelBuffer(width, height, depthFormat)
+    {
+    }
+
+    ScreenBuffer(int32_t width, int32_t height, int32_t *externalData, DepthFormat depthFormat = DepthFormat::Float)
+        : PixelBuffer(width, height, externalData, depthFormat)
+    {
+    }
+
+    using PixelBuffer::drawLine;
+    using PixelBuffer::drawTriangle;
+    using PixelBuffer::putPixel;
+};
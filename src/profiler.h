@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+
+enum class ProfileStage
+{
+    Events,
+    Cull,
+    Transform,
+    Raster,
+    Clear,
+    FillOut,
+    Present,
+    // Number of stages, also "no stage" for time outside every ScopedTimer
+    Count,
+};
+
+enum class ProfileCounter
+{
+    VerticesTransformed,
+    TrianglesBackfaceCulled,
+    FragmentsTested,
+    FragmentsShaded,
+    Count,
+};
+
+inline const char *profileStageName(ProfileStage stage)
+{
+    constexpr const char *NAMES[] = {"events", "cull", "transform", "raster", "clear", "fill_out", "present"};
+    return stage < ProfileStage::Count ? NAMES[size_t(stage)] : "other";
+}
+
+inline const char *profileCounterName(ProfileCounter counter)
+{
+    constexpr const char *NAMES[] = {"vertices_transformed", "triangles_backface_culled", "fragments_tested", "fragments_shaded"};
+    return counter < ProfileCounter::Count ? NAMES[size_t(counter)] : "unknown";
+}
+
+constexpr auto PROFILE_STAGE_COUNT = size_t(ProfileStage::Count);
+constexpr auto PROFILE_COUNTER_COUNT = size_t(ProfileCounter::Count);
+
+struct FrameProfile
+{
+    // Stage times and counters only, for the share of a frame profiled on another thread
+    FrameProfile &operator+=(const FrameProfile &other)
+    {
+        for (auto stage = size_t{0}; stage < PROFILE_STAGE_COUNT; stage++)
+        {
+            stageMs[stage] += other.stageMs[stage];
+        }
+
+        for (auto counter = size_t{0}; counter < PROFILE_COUNTER_COUNT; counter++)
+        {
+            counters[counter] += other.counters[counter];
+        }
+
+        return *this;
+    }
+
+    uint64_t frame = 0;
+    double frameMs = 0.0;
+    std::array<double, PROFILE_STAGE_COUNT> stageMs{};
+    std::array<uint64_t, PROFILE_COUNTER_COUNT> counters{};
+    // Fragments shaded per pixel of the target
+    double overdraw = 0.0;
+    // From the input a frame was made of to its presentation, when frames are pipelined
+    double latencyMs = 0.0;
+};
+
+struct ProfilePercentiles
+{
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+// Per frame stage times and counters, with percentiles over the last frames.
+// Stage times are exclusive: a ScopedTimer inside another one pauses the outer
+// stage, so the stages add up to at most the frame time. Instrumented code
+// reports to getCurrent() of its own thread and does nothing while there is none.
+// Threads running stages of a pipelined frame profile into a Profiler of their
+// own, takeFrame() hands their share to the one ending the frame, see merge().
+// Those stages overlap, together they may then exceed the frame time.
+struct Profiler
+{
+    static constexpr size_t DEFAULT_WINDOW = 240;
+
+    explicit Profiler(size_t window = DEFAULT_WINDOW)
+        : m_window(std::max<size_t>(window, 1))
+    {
+        m_history.reserve(m_window);
+    }
+
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    ~Profiler()
+    {
+        if (getCurrent() == this)
+        {
+            setCurrent(nullptr);
+        }
+
+        if (m_jsonFile != nullptr)
+        {
+            fclose(m_jsonFile);
+        }
+    }
+
+    static Profiler *getCurrent()
+    {
+        return s_current;
+    }
+
+    static void setCurrent(Profiler *profiler)
+    {
+        s_current = profiler;
+    }
+
+    // Every finished frame is appended as one JSON object per line
+    bool openJsonLines(const std::string &filename)
+    {
+        m_jsonFile = fopen(filename.c_str(), "w");
+        if (m_jsonFile == nullptr)
+        {
+            fprintf(stderr, "Failed to open %s\n", filename.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    void beginFrame()
+    {
+        m_current = {.frame = m_frameCount};
+        m_frameStart = Clock::now();
+        m_stageStart = m_frameStart;
+        m_activeStage = ProfileStage::Count;
+    }
+
+    // pixels is the size of the target, for the overdraw
+    void endFrame(uint64_t pixels)
+    {
+        const auto now = Clock::now();
+        enter(ProfileStage::Count, now);
+
+        m_current.frameMs = toMs(now - m_frameStart);
+        m_current.overdraw = pixels > 0 ? double(m_current.counters[size_t(ProfileCounter::FragmentsShaded)]) / double(pixels) : 0.0;
+
+        if (m_history.size() < m_window)
+        {
+            m_history.push_back(m_current);
+        }
+        else
+        {
+            m_history[m_frameCount % m_window] = m_current;
+        }
+
+        m_frameCount++;
+
+        if (m_jsonFile != nullptr)
+        {
+            writeJsonLine(m_current);
+        }
+    }
+
+    // Makes stage the running one and returns the one it interrupts
+    ProfileStage enter(ProfileStage stage)
+    {
+        return enter(stage, Clock::now());
+    }
+
+    void add(ProfileCounter counter, uint64_t count)
+    {
+        m_current.counters[size_t(counter)] += count;
+    }
+
+    void setLatency(double ms)
+    {
+        m_current.latencyMs = ms;
+    }
+
+    // What was collected since beginFrame(), without ending the frame
+    FrameProfile takeFrame()
+    {
+        enter(ProfileStage::Count, Clock::now());
+        return m_current;
+    }
+
+    // Adds the stage times and counters another thread collected for this frame
+    void merge(const FrameProfile &other)
+    {
+        m_current += other;
+    }
+
+    uint64_t getFrameCount() const
+    {
+        return m_frameCount;
+    }
+
+    const FrameProfile &getLastFrame() const
+    {
+        return m_history[(m_frameCount + m_history.size() - 1) % m_history.size()];
+    }
+
+    // Over the frames still in the window; ProfileStage::Count gives the frame time
+    ProfilePercentiles getPercentiles(ProfileStage stage) const
+    {
+        return getPercentiles([stage](const FrameProfile &frame)
+                              { return stage < ProfileStage::Count ? frame.stageMs[size_t(stage)] : frame.frameMs; });
+    }
+
+    ProfilePercentiles getLatencyPercentiles() const
+    {
+        return getPercentiles([](const FrameProfile &frame)
+                              { return frame.latencyMs; });
+    }
+
+    // Short lines for an on-screen overlay: frame time percentiles, then the
+    // median of every stage and the counters of the last frame
+    std::vector<std::string> formatOverlay() const
+    {
+        std::vector<std::string> lines;
+        if (m_history.empty())
+        {
+            return lines;
+        }
+
+        char line[128];
+        const auto frame = getPercentiles(ProfileStage::Count);
+        snprintf(line, sizeof(line), "frame ms  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f", frame.p50, frame.p95, frame.p99, frame.max);
+        lines.emplace_back(line);
+
+        const auto latency = getLatencyPercentiles();
+        if (latency.max > 0.0)
+        {
+            snprintf(line, sizeof(line), "latency ms  p50 %.2f  p99 %.2f", latency.p50, latency.p99);
+            lines.emplace_back(line);
+        }
+
+        for (auto stage = size_t{0}; stage < PROFILE_STAGE_COUNT; stage++)
+        {
+            const auto percentiles = getPercentiles(ProfileStage(stage));
+            snprintf(line, sizeof(line), "%-10s p50 %.2f  p99 %.2f", profileStageName(ProfileStage(stage)), percentiles.p50, percentiles.p99);
+            lines.emplace_back(line);
+        }
+
+        const auto &last = getLastFrame();
+        for (auto counter = size_t{0}; counter < PROFILE_COUNTER_COUNT; counter++)
+        {
+            snprintf(line, sizeof(line), "%s %llu", profileCounterName(ProfileCounter(counter)), (unsigned long long)last.counters[counter]);
+            lines.emplace_back(line);
+        }
+
+        snprintf(line, sizeof(line), "overdraw %.2f", last.overdraw);
+        lines.emplace_back(line);
+
+        return lines;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    template <typename Value_T>
+    ProfilePercentiles getPercentiles(const Value_T &getValue) const
+    {
+        std::vector<double> values;
+        values.reserve(m_history.size());
+
+        for (const auto &frame : m_history)
+        {
+            values.push_back(getValue(frame));
+        }
+
+        if (values.empty())
+        {
+            return {};
+        }
+
+        // Nearest rank
+        const auto at = [&](double fraction)
+        {
+            const auto rank = std::min(values.size() - 1, size_t(fraction * double(values.size())));
+            std::nth_element(values.begin(), values.begin() + rank, values.end());
+            return values[rank];
+        };
+
+        return {.p50 = at(0.50), .p95 = at(0.95), .p99 = at(0.99), .max = *std::max_element(values.begin(), values.end())};
+    }
+
+    static double toMs(Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    ProfileStage enter(ProfileStage stage, Clock::time_point now)
+    {
+        const auto previous = m_activeStage;
+        if (previous < ProfileStage::Count)
+        {
+            m_current.stageMs[size_t(previous)] += toMs(now - m_stageStart);
+        }
+
+        m_activeStage = stage;
+        m_stageStart = now;
+
+        return previous;
+    }
+
+    // Frame and stage times, counters and the rolling frame time percentiles
+    void writeJsonLine(const FrameProfile &frame)
+    {
+        const auto percentiles = getPercentiles(ProfileStage::Count);
+
+        fprintf(m_jsonFile, "{\"frame\":%llu,\"frame_ms\":%.4f,\"stages_ms\":{", (unsigned long long)frame.frame, frame.frameMs);
+        auto other = frame.frameMs;
+        for (auto stage = size_t{0}; stage < PROFILE_STAGE_COUNT; stage++)
+        {
+            fprintf(m_jsonFile, "\"%s\":%.4f,", profileStageName(ProfileStage(stage)), frame.stageMs[stage]);
+            other -= frame.stageMs[stage];
+        }
+
+        // Outside every stage
+        fprintf(m_jsonFile, "\"%s\":%.4f", profileStageName(ProfileStage::Count), std::max(other, 0.0));
+
+        fprintf(m_jsonFile, "},\"counters\":{");
+        for (auto counter = size_t{0}; counter < PROFILE_COUNTER_COUNT; counter++)
+        {
+            fprintf(m_jsonFile, "%s\"%s\":%llu", counter > 0 ? "," : "", profileCounterName(ProfileCounter(counter)), (unsigned long long)frame.counters[counter]);
+        }
+
+        fprintf(m_jsonFile, "},\"overdraw\":%.4f,\"latency_ms\":%.4f,\"frame_ms_p50\":%.4f,\"frame_ms_p95\":%.4f,\"frame_ms_p99\":%.4f}\n",
+                frame.overdraw, frame.latencyMs, percentiles.p50, percentiles.p95, percentiles.p99);
+    }
+
+    // Per thread, so stages running on other threads never race on one profiler
+    static inline thread_local Profiler *s_current = nullptr;
+
+    size_t m_window;
+    // Ring buffer of the last m_window frames
+    std::vector<FrameProfile> m_history;
+    uint64_t m_frameCount = 0;
+    FrameProfile m_current;
+    Clock::time_point m_frameStart;
+    Clock::time_point m_stageStart;
+    ProfileStage m_activeStage = ProfileStage::Count;
+    FILE *m_jsonFile = nullptr;
+};
+
+// Charges the time until the end of the scope to stage, if a profiler is current
+struct ScopedTimer
+{
+    explicit ScopedTimer(ProfileStage stage)
+        : m_profiler(Profiler::getCurrent())
+    {
+        if (m_profiler != nullptr)
+        {
+            m_previous = m_profiler->enter(stage);
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    ~ScopedTimer()
+    {
+        if (m_profiler != nullptr)
+        {
+            m_profiler->enter(m_previous);
+        }
+    }
+
+private:
+    Profiler *m_profiler;
+    ProfileStage m_previous = ProfileStage::Count;
+};
+
+inline void profileCount(ProfileCounter counter, uint64_t count)
+{
+    if (auto *profiler = Profiler::getCurrent())
+    {
+        profiler->add(counter, count);
+    }
+}
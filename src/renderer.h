@@ -0,0 +1,1098 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include "geometry.h"
+#include "models.h"
+#include "pixel_buffer.h"
+#include "profiler.h"
+#include "texture.h"
+#include "transform.h"
+
+template <typename T>
+Vector3D<T> crossProduct(const Vector3D<T> &v1, const Vector3D<T> &v2)
+{
+    return Vector3D<T>{
+        .x = (v1.y * v2.z) - (v1.z * v2.y),
+        .y = (v1.z * v2.x) - (v1.x * v2.z),
+        .z = (v1.x * v2.y) - (v1.y * v2.x)};
+}
+
+template <typename T>
+T dotProduct(const Vector3D<T> &v1, const Vector3D<T> &v2)
+{
+    return (v1.x * v2.x) + (v1.y * v2.y) + (v1.z * v2.z);
+}
+
+template <typename T>
+Vector3D<T> calculateTriangleNormal(const Vector3D<T> &v1, const Vector3D<T> &v2, const Vector3D<T> &v3)
+{
+    const auto vv1 = Vector3D<T>{v2.x - v1.x, v2.y - v1.y, v2.z - v1.z};
+    const auto vv2 = Vector3D<T>{v3.x - v1.x, v3.y - v1.y, v3.z - v1.z};
+
+    return crossProduct(vv1, vv2);
+}
+
+// Models with an index buffer reference their vertices per triangle, the others
+// are plain triangle lists
+template <typename Model_T>
+uint32_t getVertexIndex(const Model_T &model, size_t corner)
+{
+    if constexpr (requires { model.indices; })
+    {
+        return model.indices[corner];
+    }
+    else
+    {
+        return static_cast<uint32_t>(corner);
+    }
+}
+
+template <typename Model_T>
+size_t getCornerCount(const Model_T &model)
+{
+    if constexpr (requires { model.indices; })
+    {
+        return model.indices.size();
+    }
+    else
+    {
+        return model.vertices.size();
+    }
+}
+
+// Pixels a triangle may reach past the edges of the target before it is clipped
+// geometrically. Inside the band the rasterizers only intersect their bounding
+// boxes with the target, which is cheaper than creating new vertices.
+static constexpr auto GUARD_BAND = 4096.0f;
+
+// Vertex before the perspective divide: it lands on (x / w, y / w) and w is the
+// view depth. Attributes interpolate linearly in this space.
+struct ClipVertex
+{
+    static ClipVertex fromVertex(const Matrix4DFloat &modelViewProjection, const TexturedVertextFloat &vertice)
+    {
+        const auto &m = modelViewProjection.data;
+
+        return {
+            .x = m[0][0] * vertice.x + m[0][1] * vertice.y + m[0][2] * vertice.z + m[0][3],
+            .y = m[1][0] * vertice.x + m[1][1] * vertice.y + m[1][2] * vertice.z + m[1][3],
+            .w = m[3][0] * vertice.x + m[3][1] * vertice.y + m[3][2] * vertice.z + m[3][3],
+            .u = vertice.u,
+            .v = vertice.v};
+    }
+
+    float x;
+    float y;
+    float w;
+    float u;
+    float v;
+};
+
+// A triangle clipped by the 5 planes gains at most one vertex per plane
+using ClipPolygon = std::array<ClipVertex, 8>;
+
+// Sutherland-Hodgman against the near plane, then the guard band edges. Returns
+// the vertex count of the convex polygon left in polygon, 0 if nothing is.
+inline size_t clipTriangle(const ClipVertex &c1, const ClipVertex &c2, const ClipVertex &c3, int32_t width, int32_t height, ClipPolygon &polygon)
+{
+    // Inside when a * x + b * y + c * w + d >= 0
+    struct Plane
+    {
+        float a, b, c, d;
+    };
+
+    const Plane planes[] = {
+        {0.0f, 0.0f, 1.0f, -NEAR_PLANE},
+        {1.0f, 0.0f, GUARD_BAND, 0.0f},
+        {-1.0f, 0.0f, width + GUARD_BAND, 0.0f},
+        {0.0f, 1.0f, GUARD_BAND, 0.0f},
+        {0.0f, -1.0f, height + GUARD_BAND, 0.0f},
+    };
+
+    ClipPolygon other;
+    auto *in = &polygon;
+    auto *out = &other;
+
+    polygon[0] = c1;
+    polygon[1] = c2;
+    polygon[2] = c3;
+    size_t count = 3;
+
+    for (const auto &plane : planes)
+    {
+        const auto distance = [&plane](const ClipVertex &c)
+        {
+            return plane.a * c.x + plane.b * c.y + plane.c * c.w + plane.d;
+        };
+
+        size_t outCount = 0;
+
+        for (auto i = size_t{0}; i < count; i++)
+        {
+            const auto &from = (*in)[i];
+            const auto &to = (*in)[(i + 1) % count];
+            const auto dFrom = distance(from);
+            const auto dTo = distance(to);
+
+            if (dFrom >= 0)
+            {
+                (*out)[outCount++] = from;
+            }
+
+            if ((dFrom >= 0) != (dTo >= 0))
+            {
+                const auto t = dFrom / (dFrom - dTo);
+                const auto lerp = [t](float a, float b)
+                {
+                    return a + (b - a) * t;
+                };
+
+                (*out)[outCount++] = {lerp(from.x, to.x), lerp(from.y, to.y), lerp(from.w, to.w), lerp(from.u, to.u), lerp(from.v, to.v)};
+            }
+        }
+
+        std::swap(in, out);
+        count = outCount;
+
+        if (count < 3)
+        {
+            return 0;
+        }
+    }
+
+    if (in != &polygon)
+    {
+        std::copy_n(in->begin(), count, polygon.begin());
+    }
+
+    return count;
+}
+
+// Conservative: false can still mean the model ends up outside the target
+inline bool isOutsideFrustum(const BoundingSphere &sphere, const Matrix4DFloat &modelView)
+{
+    if (sphere.radius < 0.0f)
+    {
+        return true;
+    }
+
+    const auto &m = modelView.data;
+    const auto center = modelView.transformPoint(sphere.center);
+
+    // Largest axis scale of the model-view matrix
+    const auto scale = std::sqrt(std::max({m[0][0] * m[0][0] + m[1][0] * m[1][0] + m[2][0] * m[2][0],
+                                           m[0][1] * m[0][1] + m[1][1] * m[1][1] + m[2][1] * m[2][1],
+                                           m[0][2] * m[0][2] + m[1][2] * m[1][2] + m[2][2] * m[2][2]}));
+    const auto radius = sphere.radius * scale;
+
+    if (center.z + radius < NEAR_PLANE)
+    {
+        return true;
+    }
+
+    // Matrix4D::screenProjection spreads x / z and y / z in [-1, 1] over the
+    // target, so the side planes are x = +-z and y = +-z
+    constexpr auto INV_SQRT2 = 0.70710678f;
+
+    return (center.x - center.z) * INV_SQRT2 > radius ||
+           (-center.x - center.z) * INV_SQRT2 > radius ||
+           (center.y - center.z) * INV_SQRT2 > radius ||
+           (-center.y - center.z) * INV_SQRT2 > radius;
+}
+
+// Read-only window on projected positions, indexed like the model's vertices
+struct ProjectedPositions
+{
+    Vector3DFloat operator[](size_t i) const
+    {
+        return {.x = x[i], .y = y[i], .z = z[i]};
+    }
+
+    const float *x;
+    const float *y;
+    const float *z;
+};
+
+// Meshes with fewer triangles keep their own order when the target sorts by
+// depth, the overdraw they can save is not worth a pass over them
+static constexpr size_t DEPTH_SORT_MIN_TRIANGLES = 256;
+static constexpr size_t DEPTH_SORT_BUCKETS = 64;
+
+// Triangle indices nearest first, coarsely: each goes into one of
+// DEPTH_SORT_BUCKETS slices of the depth range of the model by its nearest
+// vertex, and keeps its place in the model within the slice. A counting sort, two
+// passes and no comparisons.
+template <typename Model_T>
+void sortTrianglesByDepth(const Model_T &model, const ProjectedPositions &projected, std::vector<uint32_t> &order)
+{
+    const auto triangleCount = getCornerCount(model) / 3;
+
+    // Depths behind the near plane only come with triangles that get clipped,
+    // they go to the nearest bucket
+    auto minZ = std::numeric_limits<float>::max();
+    auto maxZ = NEAR_PLANE;
+    for (auto i = size_t{0}; i < model.vertices.size(); i++)
+    {
+        const auto z = std::max(projected.z[i], NEAR_PLANE);
+        minZ = std::min(minZ, z);
+        maxZ = std::max(maxZ, z);
+    }
+
+    const auto scale = float(DEPTH_SORT_BUCKETS) / std::max(maxZ - minZ, std::numeric_limits<float>::min());
+
+    thread_local std::vector<uint8_t> buckets;
+    buckets.resize(triangleCount);
+
+    std::array<uint32_t, DEPTH_SORT_BUCKETS + 1> starts{};
+
+    for (auto t = size_t{0}; t < triangleCount; t++)
+    {
+        const auto nearest = std::min({projected.z[getVertexIndex(model, 3 * t)],
+                                       projected.z[getVertexIndex(model, 3 * t + 1)],
+                                       projected.z[getVertexIndex(model, 3 * t + 2)]});
+
+        // Written so NaNs land in bucket 0
+        const auto slice = (nearest - minZ) * scale;
+        const auto bucket = slice > 0.0f ? std::min(size_t(slice), DEPTH_SORT_BUCKETS - 1) : size_t{0};
+
+        buckets[t] = uint8_t(bucket);
+        starts[bucket + 1]++;
+    }
+
+    for (auto b = size_t{1}; b < starts.size(); b++)
+    {
+        starts[b] += starts[b - 1];
+    }
+
+    order.resize(triangleCount);
+    for (auto t = size_t{0}; t < triangleCount; t++)
+    {
+        order[starts[buckets[t]]++] = uint32_t(t);
+    }
+}
+
+// Rasterizes the triangles of a model whose vertices are already projected with
+// modelViewProjection. Triangles crossing the near plane or leaving the guard
+// band are clipped. Large meshes go nearest first if the target asks for it,
+// see PixelBuffer::setTriangleDepthSort.
+template <typename Target_T, typename Model_T>
+void drawProjectedModel(Target_T &target, const Model_T &model, const Matrix4DFloat &modelViewProjection, const ProjectedPositions &projected,
+                        const Texture &texture, bool wireframe, bool backfaceCulling)
+{
+    const auto cornerCount = getCornerCount(model);
+    assert((cornerCount % 3) == 0);
+
+    const auto triangleCount = cornerCount / 3;
+    const auto depthSorted = target.getTriangleDepthSort() && triangleCount >= DEPTH_SORT_MIN_TRIANGLES;
+
+    thread_local std::vector<uint32_t> triangleOrder;
+    if (depthSorted)
+    {
+        sortTrianglesByDepth(model, projected, triangleOrder);
+    }
+
+    const auto width = target.getWidth();
+    const auto height = target.getHeight();
+
+    const auto inGuardBand = [width, height](const Vector3DFloat &p)
+    {
+        return p.z >= NEAR_PLANE &&
+               p.x >= -GUARD_BAND && p.x <= width + GUARD_BAND &&
+               p.y >= -GUARD_BAND && p.y <= height + GUARD_BAND;
+    };
+
+    int32_t i = 0;
+    uint64_t backfaceCulled = 0;
+
+    for (auto triangle = size_t{0}; triangle < triangleCount; triangle++)
+    {
+        const auto corner = 3 * size_t(depthSorted ? triangleOrder[triangle] : triangle);
+        const auto i1 = getVertexIndex(model, corner);
+        const auto i2 = getVertexIndex(model, corner + 1);
+        const auto i3 = getVertexIndex(model, corner + 2);
+
+        const auto p1 = projected[i1];
+        const auto p2 = projected[i2];
+        const auto p3 = projected[i3];
+
+        const auto v1 = model.vertices[i1];
+        const auto v2 = model.vertices[i2];
+        const auto v3 = model.vertices[i3];
+
+        if (inGuardBand(p1) && inGuardBand(p2) && inGuardBand(p3))
+        {
+            // Entirely off one side of the target
+            if ((p1.x < 0 && p2.x < 0 && p3.x < 0) || (p1.x > width && p2.x > width && p3.x > width) ||
+                (p1.y < 0 && p2.y < 0 && p3.y < 0) || (p1.y > height && p2.y > height && p3.y > height))
+            {
+                i++;
+                continue;
+            }
+
+            if (backfaceCulling)
+            {
+                // Facing away from the camera in view space is the same as a clockwise
+                // winding on screen (y points down) once scaled by the depths' signs
+                const auto screenArea = (p2.x - p1.x) * (p3.y - p1.y) - (p3.x - p1.x) * (p2.y - p1.y);
+
+                if (screenArea * p1.z * p2.z * p3.z < 0)
+                {
+                    backfaceCulled++;
+                    i++;
+                    continue;
+                }
+            }
+
+            if (!wireframe)
+            {
+                // Divide u and v by z (to correct for perspective - https://en.wikipedia.org/wiki/Texture_mapping)
+                target.drawTriangle(p1, p2, p3, texture, {v1.u/p1.z, v1.v/p1.z}, {v2.u/p2.z, v2.v/p2.z}, {v3.u/p3.z, v3.v/p3.z});
+            }
+            // else
+            // {
+            //     target.drawLine(p1, p2, colorIndices[i % colorIndices.size()]);
+            //     target.drawLine(p2, p3, colorIndices[i % colorIndices.size()]);
+            //     target.drawLine(p3, p1, colorIndices[i % colorIndices.size()]);
+            // }
+            i++;
+            continue;
+        }
+
+        if (p1.z < NEAR_PLANE && p2.z < NEAR_PLANE && p3.z < NEAR_PLANE)
+        {
+            i++;
+            continue;
+        }
+
+        // The divided positions are meaningless behind the camera, start over from
+        // the homogeneous ones for the few triangles that need clipping
+        const auto c1 = ClipVertex::fromVertex(modelViewProjection, v1);
+        const auto c2 = ClipVertex::fromVertex(modelViewProjection, v2);
+        const auto c3 = ClipVertex::fromVertex(modelViewProjection, v3);
+
+        if (backfaceCulling)
+        {
+            // Same test as above without the divide: the determinant is the screen
+            // area scaled by the three depths
+            const auto det = c1.x * (c2.y * c3.w - c3.y * c2.w) -
+                             c2.x * (c1.y * c3.w - c3.y * c1.w) +
+                             c3.x * (c1.y * c2.w - c2.y * c1.w);
+
+            if (det < 0)
+            {
+                backfaceCulled++;
+                i++;
+                continue;
+            }
+        }
+
+        ClipPolygon polygon;
+        const auto count = clipTriangle(c1, c2, c3, width, height, polygon);
+
+        const auto toScreen = [](const ClipVertex &c)
+        {
+            return Vector3DFloat{c.x / c.w, c.y / c.w, c.w};
+        };
+
+        for (auto k = size_t{1}; !wireframe && k + 1 < count; k++)
+        {
+            const auto &a = polygon[0];
+            const auto &b = polygon[k];
+            const auto &c = polygon[k + 1];
+
+            target.drawTriangle(toScreen(a), toScreen(b), toScreen(c), texture, {a.u / a.w, a.v / a.w}, {b.u / b.w, b.v / b.w}, {c.u / c.w, c.v / c.w});
+        }
+
+        i++;
+    }
+
+    profileCount(ProfileCounter::TrianglesBackfaceCulled, backfaceCulled);
+}
+
+// Placement of a shared mesh in a draw of many instances
+struct MeshInstance
+{
+    Matrix4DFloat transform;
+    const Texture *texture;
+};
+
+// Draws every instance of one immutable mesh. transform takes model space to
+// world space and view world space to view space (camera at the origin looking
+// down +z). Instances whose bounding sphere is outside the view frustum are
+// rejected, the others are transformed straight from the shared vertices into a
+// scratch buffer reused between draws, one aligned slice per instance, and then
+// rasterized. Nothing is copied or allocated per instance once the scratch
+// buffers have grown to the largest draw.
+template <typename Target_T, typename Model_T>
+void drawInstances(Target_T &target, const Model_T &model, const Matrix4DFloat &view, std::span<const MeshInstance> instances,
+                   bool wireframe = false, bool backfaceCulling = true)
+{
+    const auto projection = Matrix4DFloat::screenProjection(target.getWidth(), target.getHeight());
+
+    struct VisibleInstance
+    {
+        Matrix4DFloat modelViewProjection;
+        const Texture *texture;
+    };
+
+    thread_local std::vector<VisibleInstance> visible;
+    visible.clear();
+
+    {
+        const ScopedTimer timer{ProfileStage::Cull};
+
+        for (const auto &instance : instances)
+        {
+            const auto modelView = view * instance.transform;
+
+            if (!isOutsideFrustum(model.boundingSphere, modelView))
+            {
+                visible.push_back({projection * modelView, instance.texture});
+            }
+        }
+    }
+
+    // Slices start on a VERTEX_STREAM_ALIGNMENT boundary for the vector kernels
+    constexpr auto SLICE_ALIGNMENT = VERTEX_STREAM_ALIGNMENT / sizeof(float);
+    const auto stride = (model.vertices.size() + SLICE_ALIGNMENT - 1) / SLICE_ALIGNMENT * SLICE_ALIGNMENT;
+
+    thread_local PositionStreams projected;
+    projected.resize(std::max(projected.size(), visible.size() * stride));
+
+    const auto isa = detectSimdIsa();
+
+    {
+        const ScopedTimer timer{ProfileStage::Transform};
+
+        for (auto k = size_t{0}; k < visible.size(); k++)
+        {
+            projectVertices(visible[k].modelViewProjection, model.vertices,
+                            projected.x.data() + k * stride, projected.y.data() + k * stride, projected.z.data() + k * stride, isa);
+        }
+
+        profileCount(ProfileCounter::VerticesTransformed, visible.size() * model.vertices.size());
+    }
+
+    // With the TiledRasterizer this only bins, the tiles are rasterized when it is flushed
+    const ScopedTimer timer{ProfileStage::Raster};
+
+    for (auto k = size_t{0}; k < visible.size(); k++)
+    {
+        const auto slice = ProjectedPositions{projected.x.data() + k * stride, projected.y.data() + k * stride, projected.z.data() + k * stride};
+        drawProjectedModel(target, model, visible[k].modelViewProjection, slice, *visible[k].texture, wireframe, backfaceCulling);
+    }
+}
+
+// Single instance: modelView takes model space to view space, the projection to
+// screen space is composed with it once per draw. Models whose bounding sphere is
+// outside the view frustum are rejected before any vertex is transformed.
+template <typename Target_T, typename Model_T>
+void drawModel(Target_T &target, const Model_T &model, const Matrix4DFloat &modelView, const Texture &texture, bool wireframe = false, bool backfaceCulling = true)
+{
+    const auto instance = MeshInstance{modelView, &texture};
+    drawInstances(target, model, Matrix4DFloat::identity(), std::span{&instance, 1}, wireframe, backfaceCulling);
+}
+
+template <typename Target_T, typename Model_T>
+void drawModel(Target_T &target, const Model_T &model, float anglez, float anglex, float angley, Vector3DFloat pos, const Texture &texture, bool wireframe = false, bool backfaceCulling = true)
+{
+    drawModel(target, model, getModelMatrix(anglez, anglex, angley, pos), texture, wireframe, backfaceCulling);
+}
+
+enum class DrawOrder
+{
+    // As added
+    Submission,
+    // Nearest bounding sphere center first, so the depth test rejects more of
+    // what is drawn after it instead of shading it over
+    FrontToBack,
+};
+
+// The opaque draws of a frame, collected so they can be reordered before any of
+// them is rasterized. Models and textures have to outlive submit().
+template <typename Target_T>
+struct DrawList
+{
+    template <typename Model_T>
+    void add(const Model_T &model, const Matrix4DFloat &modelView, const Texture &texture, bool backfaceCulling = true)
+    {
+        m_draws.push_back({.depth = modelView.transformPoint(model.boundingSphere.center).z,
+                           .model = &model,
+                           .modelView = modelView,
+                           .texture = &texture,
+                           .backfaceCulling = backfaceCulling,
+                           .draw = [](Target_T &target, const Draw &draw)
+                           { drawModel(target, *static_cast<const Model_T *>(draw.model), draw.modelView, *draw.texture, false, draw.backfaceCulling); }});
+    }
+
+    // Draws everything added since the last submit(), draws at the same depth
+    // keep the order they were added in
+    void submit(Target_T &target, DrawOrder order)
+    {
+        if (order == DrawOrder::FrontToBack)
+        {
+            std::stable_sort(m_draws.begin(), m_draws.end(), [](const Draw &a, const Draw &b)
+                             { return a.depth < b.depth; });
+        }
+
+        for (const auto &draw : m_draws)
+        {
+            draw.draw(target, draw);
+        }
+
+        m_draws.clear();
+    }
+
+private:
+    struct Draw
+    {
+        // View space z of the bounding sphere center
+        float depth;
+        const void *model;
+        Matrix4DFloat modelView;
+        const Texture *texture;
+        bool backfaceCulling;
+        void (*draw)(Target_T &, const Draw &);
+    };
+
+    std::vector<Draw> m_draws;
+};
+
+struct SceneStats
+{
+    SceneStats &operator+=(const SceneStats &other)
+    {
+        visitedNodes += other.visitedNodes;
+        drawnInstances += other.drawnInstances;
+        frustumCulled += other.frustumCulled;
+        occlusionCulled += other.occlusionCulled;
+        return *this;
+    }
+
+    uint64_t visitedNodes = 0;
+    uint64_t drawnInstances = 0;
+    // Instances skipped with a whole subtree
+    uint64_t frustumCulled = 0;
+    uint64_t occlusionCulled = 0;
+};
+
+// Instances of shared meshes inside a bounding volume hierarchy. Moving an
+// instance only refits the boxes above it; drawing walks the tree front to back,
+// skips subtrees outside the view frustum or hidden behind the hierarchical
+// z-buffer and submits the remaining instances.
+struct Scene
+{
+    using MeshId = uint32_t;
+    using InstanceId = uint32_t;
+
+    // Instances per leaf
+    static constexpr uint32_t LEAF_SIZE = 4;
+    // Drawn instances between flushes of a tiled target, so the hierarchical
+    // z-buffer gets to see them before the next occlusion tests
+    static constexpr uint32_t FLUSH_INTERVAL = 32;
+
+    MeshId addMesh(ObjModel mesh)
+    {
+        m_meshes.push_back(std::move(mesh));
+        return MeshId(m_meshes.size() - 1);
+    }
+
+    InstanceId addInstance(MeshId mesh, const Matrix4DFloat &transform, const Texture &texture, bool backfaceCulling = true)
+    {
+        assert(mesh < m_meshes.size());
+
+        m_instances.push_back({mesh, transform, &texture, backfaceCulling, {}, 0});
+        m_instances.back().bounds = getWorldBounds(m_instances.back());
+        m_needsBuild = true;
+
+        return InstanceId(m_instances.size() - 1);
+    }
+
+    void setTransform(InstanceId id, const Matrix4DFloat &transform)
+    {
+        auto &instance = m_instances[id];
+        instance.transform = transform;
+
+        const auto bounds = getWorldBounds(instance);
+        if (bounds.min.x != instance.bounds.min.x || bounds.min.y != instance.bounds.min.y || bounds.min.z != instance.bounds.min.z ||
+            bounds.max.x != instance.bounds.max.x || bounds.max.y != instance.bounds.max.y || bounds.max.z != instance.bounds.max.z)
+        {
+            instance.bounds = bounds;
+            m_movedInstances.push_back(id);
+        }
+    }
+
+    size_t getInstanceCount() const
+    {
+        return m_instances.size();
+    }
+
+    template <typename Target_T>
+    SceneStats draw(Target_T &target, const Matrix4DFloat &view)
+    {
+        const ScopedTimer timer{ProfileStage::Cull};
+
+        update();
+
+        SceneStats stats;
+        if (m_nodes.empty())
+        {
+            return stats;
+        }
+
+        const auto planes = getFrustumPlanes(view);
+        const auto viewProjection = Matrix4DFloat::screenProjection(target.getWidth(), target.getHeight()) * view;
+        const auto allPlanes = uint32_t((1 << planes.size()) - 1);
+
+        struct Entry
+        {
+            uint32_t node;
+            // Planes the node is not known to be entirely inside of
+            uint32_t planeMask;
+        };
+
+        thread_local std::vector<Entry> stack;
+        stack.clear();
+        stack.push_back({0, allPlanes});
+
+        uint32_t sinceFlush = 0;
+
+        while (!stack.empty())
+        {
+            const auto [nodeIndex, parentMask] = stack.back();
+            stack.pop_back();
+
+            const auto &node = m_nodes[nodeIndex];
+            stats.visitedNodes++;
+
+            auto planeMask = parentMask;
+            if (!isInsideFrustum(node.bounds, planes, planeMask))
+            {
+                stats.frustumCulled += node.instanceCount;
+                continue;
+            }
+
+            if constexpr (requires { target.isAreaOccluded(ClipRect{}, 0.0f); })
+            {
+                ClipRect area;
+                float minZ;
+
+                if (getScreenArea(node.bounds, viewProjection, target.getWidth(), target.getHeight(), area, minZ) &&
+                    target.isAreaOccluded(area, minZ))
+                {
+                    stats.occlusionCulled += node.instanceCount;
+                    continue;
+                }
+            }
+
+            if (node.isLeaf())
+            {
+                for (auto i = node.first; i < node.first + node.instanceCount; i++)
+                {
+                    const auto &instance = m_instances[m_order[i]];
+                    drawModel(target, m_meshes[instance.mesh], view * instance.transform, *instance.texture, false, instance.backfaceCulling);
+                    stats.drawnInstances++;
+                    sinceFlush++;
+                }
+
+                if constexpr (requires { target.flush(); })
+                {
+                    if (sinceFlush >= FLUSH_INTERVAL)
+                    {
+                        target.flush();
+                        sinceFlush = 0;
+                    }
+                }
+
+                continue;
+            }
+
+            // Nearer child on top of the stack, so it is drawn (and fills the
+            // z-buffer) first
+            const auto depth = [&](uint32_t child)
+            {
+                const auto center = BoundingSphere::getBoxCenter(m_nodes[child].bounds);
+                return view.transformPoint(center).z;
+            };
+
+            auto nearChild = node.left;
+            auto farChild = node.right;
+            if (depth(farChild) < depth(nearChild))
+            {
+                std::swap(nearChild, farChild);
+            }
+
+            stack.push_back({farChild, planeMask});
+            stack.push_back({nearChild, planeMask});
+        }
+
+        return stats;
+    }
+
+private:
+    static constexpr uint32_t NO_NODE = std::numeric_limits<uint32_t>::max();
+
+    struct Instance
+    {
+        MeshId mesh;
+        Matrix4DFloat transform;
+        const Texture *texture;
+        bool backfaceCulling;
+        // World space box around the transformed bounding sphere, which does not
+        // change when the instance only rotates
+        BoundingBox bounds;
+        uint32_t leaf;
+    };
+
+    struct Node
+    {
+        bool isLeaf() const
+        {
+            return left == NO_NODE;
+        }
+
+        BoundingBox bounds;
+        uint32_t left = NO_NODE;
+        uint32_t right = NO_NODE;
+        uint32_t parent = NO_NODE;
+        // Leaves: instances m_order[first, first + instanceCount)
+        uint32_t first = 0;
+        // Instances in the whole subtree
+        uint32_t instanceCount = 0;
+    };
+
+    // Inside when a * x + b * y + c * z + d >= 0, world space
+    struct Plane
+    {
+        float a, b, c, d;
+    };
+
+    using FrustumPlanes = std::array<Plane, 5>;
+
+    BoundingBox getWorldBounds(const Instance &instance) const
+    {
+        const auto &sphere = m_meshes[instance.mesh].boundingSphere;
+        if (sphere.radius < 0.0f)
+        {
+            return {};
+        }
+
+        const auto &m = instance.transform.data;
+        const auto scale = std::sqrt(std::max({m[0][0] * m[0][0] + m[1][0] * m[1][0] + m[2][0] * m[2][0],
+                                               m[0][1] * m[0][1] + m[1][1] * m[1][1] + m[2][1] * m[2][1],
+                                               m[0][2] * m[0][2] + m[1][2] * m[1][2] + m[2][2] * m[2][2]}));
+        const auto center = instance.transform.transformPoint(sphere.center);
+        const auto radius = sphere.radius * scale;
+
+        return {{center.x - radius, center.y - radius, center.z - radius}, {center.x + radius, center.y + radius, center.z + radius}};
+    }
+
+    static BoundingBox merge(const BoundingBox &a, const BoundingBox &b)
+    {
+        auto res = a;
+        if (!b.isEmpty())
+        {
+            res.extend(b.min);
+            res.extend(b.max);
+        }
+
+        return res;
+    }
+
+    void update()
+    {
+        if (m_needsBuild)
+        {
+            build();
+        }
+        else
+        {
+            refit();
+        }
+
+        m_movedInstances.clear();
+    }
+
+    void build()
+    {
+        m_nodes.clear();
+        m_order.resize(m_instances.size());
+        std::iota(m_order.begin(), m_order.end(), 0);
+
+        if (!m_instances.empty())
+        {
+            m_nodes.reserve(2 * m_instances.size() / LEAF_SIZE + 1);
+            buildNode(0, uint32_t(m_instances.size()), NO_NODE);
+        }
+
+        m_needsBuild = false;
+    }
+
+    // Median split along the longest axis of the instance centers
+    uint32_t buildNode(uint32_t first, uint32_t count, uint32_t parent)
+    {
+        const auto index = uint32_t(m_nodes.size());
+        m_nodes.push_back({});
+        m_nodes[index].parent = parent;
+        m_nodes[index].instanceCount = count;
+
+        BoundingBox bounds;
+        BoundingBox centers;
+        for (auto i = first; i < first + count; i++)
+        {
+            const auto &instanceBounds = m_instances[m_order[i]].bounds;
+            bounds = merge(bounds, instanceBounds);
+            centers.extend(BoundingSphere::getBoxCenter(instanceBounds));
+        }
+
+        m_nodes[index].bounds = bounds;
+
+        if (count <= LEAF_SIZE)
+        {
+            m_nodes[index].first = first;
+            for (auto i = first; i < first + count; i++)
+            {
+                m_instances[m_order[i]].leaf = index;
+            }
+
+            return index;
+        }
+
+        const auto extentX = centers.max.x - centers.min.x;
+        const auto extentY = centers.max.y - centers.min.y;
+        const auto extentZ = centers.max.z - centers.min.z;
+        const auto axis = extentX >= extentY && extentX >= extentZ ? 0 : (extentY >= extentZ ? 1 : 2);
+
+        const auto key = [this, axis](uint32_t instance)
+        {
+            const auto center = BoundingSphere::getBoxCenter(m_instances[instance].bounds);
+            return axis == 0 ? center.x : (axis == 1 ? center.y : center.z);
+        };
+
+        const auto half = count / 2;
+        std::nth_element(m_order.begin() + first, m_order.begin() + first + half, m_order.begin() + first + count,
+                         [&key](uint32_t a, uint32_t b)
+                         { return key(a) < key(b); });
+
+        const auto left = buildNode(first, half, index);
+        const auto right = buildNode(first + half, count - half, index);
+        m_nodes[index].left = left;
+        m_nodes[index].right = right;
+
+        return index;
+    }
+
+    // Grows or shrinks the boxes from the leaves of the moved instances up to the
+    // root, stopping where a box no longer changes. The tree topology stays, so a
+    // scene whose instances wander far gets looser boxes until it is rebuilt.
+    void refit()
+    {
+        for (const auto id : m_movedInstances)
+        {
+            auto nodeIndex = m_instances[id].leaf;
+
+            while (nodeIndex != NO_NODE)
+            {
+                auto &node = m_nodes[nodeIndex];
+
+                BoundingBox bounds;
+                if (node.isLeaf())
+                {
+                    for (auto i = node.first; i < node.first + node.instanceCount; i++)
+                    {
+                        bounds = merge(bounds, m_instances[m_order[i]].bounds);
+                    }
+                }
+                else
+                {
+                    bounds = merge(m_nodes[node.left].bounds, m_nodes[node.right].bounds);
+                }
+
+                if (bounds.min.x == node.bounds.min.x && bounds.min.y == node.bounds.min.y && bounds.min.z == node.bounds.min.z &&
+                    bounds.max.x == node.bounds.max.x && bounds.max.y == node.bounds.max.y && bounds.max.z == node.bounds.max.z)
+                {
+                    break;
+                }
+
+                node.bounds = bounds;
+                nodeIndex = node.parent;
+            }
+        }
+    }
+
+    // Near plane and the four side planes of Matrix4D::screenProjection (x = +-z,
+    // y = +-z in view space), taken to world space through the view matrix
+    static FrustumPlanes getFrustumPlanes(const Matrix4DFloat &view)
+    {
+        const Plane viewPlanes[] = {
+            {0.0f, 0.0f, 1.0f, -NEAR_PLANE},
+            {-1.0f, 0.0f, 1.0f, 0.0f},
+            {1.0f, 0.0f, 1.0f, 0.0f},
+            {0.0f, -1.0f, 1.0f, 0.0f},
+            {0.0f, 1.0f, 1.0f, 0.0f},
+        };
+
+        FrustumPlanes res;
+        const auto &m = view.data;
+
+        for (auto i = size_t{0}; i < res.size(); i++)
+        {
+            const auto &p = viewPlanes[i];
+            res[i] = {p.a * m[0][0] + p.b * m[1][0] + p.c * m[2][0],
+                      p.a * m[0][1] + p.b * m[1][1] + p.c * m[2][1],
+                      p.a * m[0][2] + p.b * m[1][2] + p.c * m[2][2],
+                      p.a * m[0][3] + p.b * m[1][3] + p.c * m[2][3] + p.d};
+        }
+
+        return res;
+    }
+
+    // Clears the bits of the planes the box is entirely inside of, so the
+    // children skip them. False when the box is entirely outside one plane.
+    static bool isInsideFrustum(const BoundingBox &box, const FrustumPlanes &planes, uint32_t &planeMask)
+    {
+        if (box.isEmpty())
+        {
+            return false;
+        }
+
+        for (auto i = size_t{0}; i < planes.size(); i++)
+        {
+            if (!(planeMask & (1u << i)))
+            {
+                continue;
+            }
+
+            const auto &p = planes[i];
+
+            // Corner farthest along the plane normal, then the nearest one
+            const auto farthest = p.a * (p.a > 0 ? box.max.x : box.min.x) +
+                                  p.b * (p.b > 0 ? box.max.y : box.min.y) +
+                                  p.c * (p.c > 0 ? box.max.z : box.min.z) + p.d;
+            if (farthest < 0)
+            {
+                return false;
+            }
+
+            const auto nearest = p.a * (p.a > 0 ? box.min.x : box.max.x) +
+                                 p.b * (p.b > 0 ? box.min.y : box.max.y) +
+                                 p.c * (p.c > 0 ? box.min.z : box.max.z) + p.d;
+            if (nearest >= 0)
+            {
+                planeMask &= ~(1u << i);
+            }
+        }
+
+        return true;
+    }
+
+    // Screen rectangle and nearest depth of a box entirely in front of the near
+    // plane, false otherwise
+    static bool getScreenArea(const BoundingBox &box, const Matrix4DFloat &viewProjection, int32_t width, int32_t height, ClipRect &area, float &minZ)
+    {
+        auto minX = std::numeric_limits<float>::max();
+        auto minY = std::numeric_limits<float>::max();
+        auto maxX = std::numeric_limits<float>::lowest();
+        auto maxY = std::numeric_limits<float>::lowest();
+        minZ = std::numeric_limits<float>::max();
+
+        for (auto corner = 0; corner < 8; corner++)
+        {
+            const Vector3DFloat point{corner & 1 ? box.max.x : box.min.x,
+                                      corner & 2 ? box.max.y : box.min.y,
+                                      corner & 4 ? box.max.z : box.min.z};
+
+            const auto &m = viewProjection.data;
+            const auto w = m[3][0] * point.x + m[3][1] * point.y + m[3][2] * point.z + m[3][3];
+            if (!(w >= NEAR_PLANE))
+            {
+                return false;
+            }
+
+            const auto projected = viewProjection.projectPoint(point);
+            minX = std::min(minX, projected.x);
+            minY = std::min(minY, projected.y);
+            maxX = std::max(maxX, projected.x);
+            maxY = std::max(maxY, projected.y);
+            minZ = std::min(minZ, projected.z);
+        }
+
+        // Same slack as the triangle bounds of the rasterizers
+        area = {
+            .x0 = int32_t(std::clamp(std::floor(minX) - 1.0f, 0.0f, float(width))),
+            .y0 = int32_t(std::clamp(std::floor(minY) - 1.0f, 0.0f, float(height))),
+            .x1 = int32_t(std::clamp(std::floor(maxX) + 2.0f, 0.0f, float(width))),
+            .y1 = int32_t(std::clamp(std::floor(maxY) + 2.0f, 0.0f, float(height)))};
+
+        return area.x0 < area.x1 && area.y0 < area.y1;
+    }
+
+    std::vector<ObjModel> m_meshes;
+    std::vector<Instance> m_instances;
+    std::vector<Node> m_nodes;
+    // Instance ids grouped by leaf
+    std::vector<uint32_t> m_order;
+    std::vector<InstanceId> m_movedInstances;
+    bool m_needsBuild = false;
+};
+
+template <typename Target_T>
+void drawCube(Target_T &target, float anglez, float anglex, float angley, Vector3DFloat pos, const Texture &texture)
+{
+    static const auto model = CubeModel{};
+    drawModel(target, model, anglez, anglex, angley, pos, texture);
+}
+
+inline float clampAngle(float angle)
+{
+    if (angle > M_PI)
+    {
+        angle = -M_PI;
+    }
+    else if (angle < -M_PI)
+    {
+        angle = M_PI;
+    }
+
+    return angle;
+}
+
+inline Texture makeCheckerTexture()
+{
+    const auto texture_width = 26.0;
+    const auto texture_height = 26.0;
+    return Texture{int32_t(texture_width), int32_t(texture_height), [](int32_t x, int32_t y)
+                   {
+                       const auto max_color = uint8_t{255};
+                       //   const auto r = static_cast<uint8_t>((x / texture_width) * max_color);
+                       //   const auto g = static_cast<uint8_t>((y / texture_height) * max_color);
+
+                       //   const auto max_mod = sqrt((texture_width * texture_width) + (texture_height * texture_height));
+
+                       //   const auto b = static_cast<uint8_t>(((x * x + y * y) / max_mod) * max_color);
+
+                       // const auto dist_x = x -(texture_width/2);
+                       // const auto dist_y = y -(texture_width / 2);
+
+                       // const auto dist = sqrtf((dist_x*dist_x) + (dist_y*dist_y));
+                       // const auto radius = 0.25f*texture_width;
+                       // const uint8_t r = dist < radius ? 255 : 0;
+                       const uint8_t r = (x + y) % 2 == 0 ? 255 : 0; //(y > 0.45*texture_width && y < 0.55*texture_width) || (x >= 0.45*texture_width && x < 0.55*texture_width) || (y < 0.05*texture_height) ? 255 : 0;
+                       const uint8_t g = 0;
+                       const uint8_t b = 0;
+
+                       const auto a = max_color;
+
+                       const int32_t argb = (a << 24) | (r << 16) | (g << 8) | (b << 0);
+
+                       return argb;
+                   }};
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Bounded queue between exactly one producing and one consuming thread. Neither
+// side takes a lock: each owns one counter and only reads the other's. The
+// blocking calls sleep on the other side's counter with std::atomic::wait.
+template <typename T, size_t Capacity>
+struct SpscQueue
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    bool tryPush(T value)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+
+        m_items[head % Capacity] = std::move(value);
+        m_head.store(head + 1, std::memory_order_release);
+        m_head.notify_one();
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (m_head.load(std::memory_order_acquire) == tail)
+        {
+            return false;
+        }
+
+        value = std::move(m_items[tail % Capacity]);
+        m_tail.store(tail + 1, std::memory_order_release);
+        m_tail.notify_one();
+        return true;
+    }
+
+    // Waits while the queue is full
+    void push(T value)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        m_tail.wait(head - Capacity, std::memory_order_acquire);
+
+        // Only this thread moves the head, the slot is free now
+        tryPush(std::move(value));
+    }
+
+    // Waits while the queue is empty
+    T pop()
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        m_head.wait(tail, std::memory_order_acquire);
+
+        T value;
+        tryPop(value);
+        return value;
+    }
+
+private:
+    // Apart, so the two threads do not keep stealing one cache line from each other
+    alignas(64) std::atomic<uint64_t> m_head = 0;
+    alignas(64) std::atomic<uint64_t> m_tail = 0;
+    std::array<T, Capacity> m_items;
+};
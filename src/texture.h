@@ -0,0 +1,335 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "image_loader.h"
+#include "mapped_file.h"
+
+enum class TextureFilter
+{
+    // Closest texel of the full resolution image
+    Nearest,
+    // Four texels of the mip level closest to the pixel footprint
+    Bilinear,
+    // Bilinear samples of the two mip levels around the footprint, blended
+    Trilinear,
+};
+
+// One mip level. Texels are stored in TILE_SIZE x TILE_SIZE tiles (one cache line
+// of ARGB texels), tiles row by row, so neighbouring rows share cache lines.
+// Fields are int32_t so the vector kernels can gather them.
+struct TextureLevel
+{
+    int32_t width;
+    int32_t height;
+    int32_t tilesX;
+    // First texel of the level in Texture::m_texels
+    int32_t offset;
+};
+
+struct Texture
+{
+    static constexpr int32_t TILE_BITS = 2;
+    static constexpr int32_t TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int32_t TILE_MASK = TILE_SIZE - 1;
+    static constexpr int32_t MAX_LEVELS = 16;
+    // Levels of detail and blend weights are fixed point with this many fraction bits
+    static constexpr int32_t LOD_FRACTION_BITS = 8;
+    static constexpr int32_t LOD_ONE = 1 << LOD_FRACTION_BITS;
+
+    uint32_t m_width{0U};
+    uint32_t m_height{0U};
+    int32_t m_levelCount{0};
+    std::array<TextureLevel, MAX_LEVELS> m_levels{};
+    // Every mip level, largest first
+    std::vector<int32_t> m_texels;
+
+    // Empty, isValid() is false
+    Texture() = default;
+
+    // Black image of the given size
+    Texture(uint32_t width, uint32_t height)
+        : m_width(width),
+          m_height(height)
+    {
+        allocateLevels();
+    }
+
+    template <typename T>
+    Texture(int32_t width, int32_t height, const T &colorProvider)
+        : m_width(width),
+          m_height(height)
+    {
+        allocateLevels();
+
+        for (auto x = 0u; x < m_width; x++)
+        {
+            for (auto y = 0u; y < m_height; y++)
+            {
+                putPixel(x, y, colorProvider(x, y));
+            }
+        }
+
+        generateMips();
+    }
+
+    // PPM, TGA or BMP file, see decodeImage. The rows are decoded from the file
+    // mapping straight into the tiles. Errors are printed and give an empty texture.
+    static Texture fromFile(const std::string &filename)
+    {
+        const MappedFile file{filename};
+        if (!file.isOpen())
+        {
+            fprintf(stderr, "Failed to open %s\n", filename.c_str());
+            return {};
+        }
+
+        Texture texture;
+        const auto decoded = decodeImage(
+            file.contents(),
+            [&](uint32_t width, uint32_t height)
+            { texture = Texture{width, height}; },
+            [&](uint32_t y, const int32_t *row)
+            { texture.putRow(y, row); });
+
+        if (!decoded)
+        {
+            fprintf(stderr, "Unsupported or malformed image %s\n", filename.c_str());
+            return {};
+        }
+
+        texture.generateMips();
+
+        return texture;
+    }
+
+    bool isValid() const
+    {
+        return m_levelCount > 0;
+    }
+
+    // Bytes of texel storage, every mip level included
+    size_t getMemorySize() const
+    {
+        return m_texels.size() * sizeof(int32_t);
+    }
+
+    // Writes the full resolution image, generateMips() brings the smaller
+    // levels up to date afterwards
+    void putPixel(uint32_t x, uint32_t y, int32_t argb)
+    {
+        assert(x < m_width);
+        assert(y < m_height);
+
+        m_texels[getTexelIndex(m_levels[0], x, y)] = argb;
+    }
+
+    // A whole row of the full resolution image, tile row by tile row
+    void putRow(uint32_t y, const int32_t *argb)
+    {
+        assert(y < m_height);
+
+        for (auto x = uint32_t{0}; x < m_width; x += TILE_SIZE)
+        {
+            const auto count = std::min<uint32_t>(TILE_SIZE, m_width - x);
+            memcpy(&m_texels[getTexelIndex(m_levels[0], x, y)], argb + x, count * sizeof(int32_t));
+        }
+    }
+
+    int32_t getTexel(uint32_t x, uint32_t y, int32_t level = 0) const
+    {
+        assert(level < m_levelCount);
+        assert(int32_t(x) < m_levels[level].width);
+        assert(int32_t(y) < m_levels[level].height);
+
+        return m_texels[getTexelIndex(m_levels[level], x, y)];
+    }
+
+    // Box filters every level down from the one above it
+    void generateMips()
+    {
+        for (auto level = 1; level < m_levelCount; level++)
+        {
+            const auto &source = m_levels[level - 1];
+            const auto &target = m_levels[level];
+
+            for (auto y = 0; y < target.height; y++)
+            {
+                for (auto x = 0; x < target.width; x++)
+                {
+                    // Odd sizes repeat the last row or column
+                    const auto x0 = 2 * x, x1 = std::min(2 * x + 1, source.width - 1);
+                    const auto y0 = 2 * y, y1 = std::min(2 * y + 1, source.height - 1);
+
+                    const uint32_t texels[] = {uint32_t(m_texels[getTexelIndex(source, x0, y0)]), uint32_t(m_texels[getTexelIndex(source, x1, y0)]),
+                                               uint32_t(m_texels[getTexelIndex(source, x0, y1)]), uint32_t(m_texels[getTexelIndex(source, x1, y1)])};
+
+                    uint32_t average = 0;
+                    for (auto shift = 0; shift < 32; shift += 8)
+                    {
+                        uint32_t sum = 2;
+                        for (const auto texel : texels)
+                        {
+                            sum += (texel >> shift) & 0xFF;
+                        }
+                        average |= (sum / 4) << shift;
+                    }
+
+                    m_texels[getTexelIndex(target, x, y)] = int32_t(average);
+                }
+            }
+        }
+    }
+
+    // Point sample of the full resolution image
+    int32_t getPixel(float u, float v) const
+    {
+        const auto u_clamped = std::max(std::min(1.0f, u), 0.0f);
+        const auto v_clamped = std::max(std::min(1.0f, v), 0.0f);
+
+        const auto x = static_cast<uint32_t>(u_clamped * (m_width - 1));
+        const auto y = static_cast<uint32_t>(v_clamped * (m_height - 1));
+
+        assert(x < m_width);
+        assert(y < m_height);
+
+        return m_texels[getTexelIndex(m_levels[0], x, y)];
+    }
+
+    // lod is log2 of the pixel footprint in full resolution texels, in
+    // LOD_FRACTION_BITS fixed point (see getLod). The vector span kernels repeat
+    // this arithmetic step for step and produce the same colors.
+    int32_t sample(float u, float v, int32_t lod, TextureFilter filter) const
+    {
+        switch (filter)
+        {
+        case TextureFilter::Nearest:
+            break;
+        case TextureFilter::Bilinear:
+            return sampleBilinear(std::clamp((lod + LOD_ONE / 2) >> LOD_FRACTION_BITS, 0, m_levelCount - 1), u, v);
+        case TextureFilter::Trilinear:
+        {
+            if (lod <= 0)
+            {
+                return sampleBilinear(0, u, v);
+            }
+
+            const auto level = lod >> LOD_FRACTION_BITS;
+            if (level >= m_levelCount - 1)
+            {
+                return sampleBilinear(m_levelCount - 1, u, v);
+            }
+
+            return blend(sampleBilinear(level, u, v), sampleBilinear(level + 1, u, v), lod & (LOD_ONE - 1));
+        }
+        }
+
+        return getPixel(u, v);
+    }
+
+    int32_t sampleBilinear(int32_t levelIndex, float u, float v) const
+    {
+        const auto &level = m_levels[levelIndex];
+
+        const auto tx = std::max(std::min(1.0f, u), 0.0f) * float(level.width) - 0.5f;
+        const auto ty = std::max(std::min(1.0f, v), 0.0f) * float(level.height) - 0.5f;
+        const auto floorX = std::floor(tx);
+        const auto floorY = std::floor(ty);
+
+        const auto fx = int32_t((tx - floorX) * float(LOD_ONE));
+        const auto fy = int32_t((ty - floorY) * float(LOD_ONE));
+
+        // Clamped to the edge
+        const auto x0 = std::max(int32_t(floorX), 0);
+        const auto y0 = std::max(int32_t(floorY), 0);
+        const auto x1 = std::min(int32_t(floorX) + 1, level.width - 1);
+        const auto y1 = std::min(int32_t(floorY) + 1, level.height - 1);
+
+        // Weights sum to LOD_ONE exactly
+        const auto w00 = ((LOD_ONE - fx) * (LOD_ONE - fy)) >> LOD_FRACTION_BITS;
+        const auto w10 = (fx * (LOD_ONE - fy)) >> LOD_FRACTION_BITS;
+        const auto w01 = ((LOD_ONE - fx) * fy) >> LOD_FRACTION_BITS;
+        const auto w11 = LOD_ONE - w00 - w10 - w01;
+
+        return weightedSum({m_texels[getTexelIndex(level, x0, y0)], m_texels[getTexelIndex(level, x1, y0)],
+                            m_texels[getTexelIndex(level, x0, y1)], m_texels[getTexelIndex(level, x1, y1)]},
+                           {w00, w10, w01, w11});
+    }
+
+    // Piecewise linear log2 of a squared footprint length (exponent plus mantissa
+    // bits of the float), halved, in LOD_FRACTION_BITS fixed point
+    static int32_t getLod(float lengthSquared)
+    {
+        uint32_t bits;
+        memcpy(&bits, &lengthSquared, sizeof(bits));
+
+        return int32_t(bits - (127u << 23)) >> (23 - LOD_FRACTION_BITS + 1);
+    }
+
+    static int32_t blend(int32_t argb0, int32_t argb1, int32_t weight1)
+    {
+        return weightedSum<2>({argb0, argb1}, {LOD_ONE - weight1, weight1});
+    }
+
+    // Per channel sum of texel * weight / LOD_ONE for weights summing to LOD_ONE.
+    // Red and blue (alpha and green) are weighted together in the two 16 bit
+    // halves of a word, which cannot carry into each other.
+    template <size_t N = 4>
+    static int32_t weightedSum(const std::array<int32_t, N> &texels, const std::array<int32_t, N> &weights)
+    {
+        uint32_t redBlue = 0;
+        uint32_t alphaGreen = 0;
+
+        for (auto i = size_t{0}; i < N; i++)
+        {
+            redBlue += (uint32_t(texels[i]) & 0x00FF00FFu) * uint32_t(weights[i]);
+            alphaGreen += ((uint32_t(texels[i]) >> 8) & 0x00FF00FFu) * uint32_t(weights[i]);
+        }
+
+        return int32_t(((redBlue >> LOD_FRACTION_BITS) & 0x00FF00FFu) | (alphaGreen & 0xFF00FF00u));
+    }
+
+    static int32_t getTexelIndex(const TextureLevel &level, int32_t x, int32_t y)
+    {
+        return level.offset + (((y >> TILE_BITS) * level.tilesX + (x >> TILE_BITS)) << (2 * TILE_BITS)) +
+               ((y & TILE_MASK) << TILE_BITS) + (x & TILE_MASK);
+    }
+
+private:
+    // Halves down to 1x1, rounding down
+    void allocateLevels()
+    {
+        auto width = int32_t(m_width);
+        auto height = int32_t(m_height);
+        auto texelCount = int32_t{0};
+
+        m_levelCount = 0;
+
+        while (m_levelCount < MAX_LEVELS)
+        {
+            const auto tilesX = (width + TILE_MASK) >> TILE_BITS;
+            const auto tilesY = (height + TILE_MASK) >> TILE_BITS;
+
+            m_levels[m_levelCount++] = {width, height, tilesX, texelCount};
+            texelCount += (tilesX * tilesY) << (2 * TILE_BITS);
+
+            if (width == 1 && height == 1)
+            {
+                break;
+            }
+
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+
+        m_texels.assign(texelCount, 0);
+    }
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "texture.h"
+
+struct TextureManagerStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t loads = 0;
+    uint64_t failures = 0;
+    uint64_t evictions = 0;
+    size_t residentBytes = 0;
+    size_t residentCount = 0;
+};
+
+// Texture files by path, decoded on a background thread and kept within a memory
+// budget. Each path is loaded at most once while it stays resident. When the
+// resident textures outgrow the budget the least recently used ones are
+// dropped; a draw still holding one keeps it alive until it lets go, and the
+// next request loads it again. Files that fail to load are remembered and not
+// retried.
+struct TextureManager
+{
+    explicit TextureManager(size_t budgetBytes)
+        : m_budgetBytes(budgetBytes),
+          m_worker([this](std::stop_token stop)
+                   { decodeLoop(stop); })
+    {
+    }
+
+    TextureManager(const TextureManager &) = delete;
+    TextureManager &operator=(const TextureManager &) = delete;
+
+    // The texture if it is resident, counting as a use. Otherwise it is queued
+    // for loading and null is returned, callers draw with a fallback meanwhile.
+    std::shared_ptr<const Texture> get(const std::string &path)
+    {
+        std::lock_guard lock{m_mutex};
+        return find(path).texture;
+    }
+
+    // Loads ahead of the first get()
+    void prefetch(const std::string &path)
+    {
+        std::lock_guard lock{m_mutex};
+        find(path);
+    }
+
+    // Waits for the texture, null if the file could not be loaded
+    std::shared_ptr<const Texture> load(const std::string &path)
+    {
+        std::unique_lock lock{m_mutex};
+
+        // Other loads may evict it again before this thread wakes up, find()
+        // queues it once more then
+        while (true)
+        {
+            const auto &entry = find(path);
+            if (entry.state != State::Queued)
+            {
+                return entry.texture;
+            }
+
+            m_loaded.wait(lock);
+        }
+    }
+
+    void setBudget(size_t budgetBytes)
+    {
+        std::lock_guard lock{m_mutex};
+        m_budgetBytes = budgetBytes;
+        evictOverBudget();
+    }
+
+    size_t getBudget() const
+    {
+        std::lock_guard lock{m_mutex};
+        return m_budgetBytes;
+    }
+
+    TextureManagerStats getStats() const
+    {
+        std::lock_guard lock{m_mutex};
+        return m_stats;
+    }
+
+private:
+    enum class State
+    {
+        Queued,
+        Resident,
+        Failed,
+    };
+
+    struct Entry
+    {
+        State state = State::Queued;
+        std::shared_ptr<const Texture> texture;
+        // Into m_lru, only while resident
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    // Entry of path, queued for loading if it is not known yet. Call with m_mutex held.
+    Entry &find(const std::string &path)
+    {
+        const auto [found, inserted] = m_entries.try_emplace(path);
+        auto &entry = found->second;
+
+        if (inserted)
+        {
+            m_stats.misses++;
+            m_queue.push_back(path);
+            m_wakeWorker.notify_one();
+        }
+        else if (entry.state == State::Resident)
+        {
+            m_stats.hits++;
+            m_lru.splice(m_lru.begin(), m_lru, entry.lruPosition);
+        }
+
+        return entry;
+    }
+
+    void decodeLoop(std::stop_token stop)
+    {
+        while (true)
+        {
+            std::string path;
+            {
+                std::unique_lock lock{m_mutex};
+                m_wakeWorker.wait(lock, stop, [this]()
+                                  { return !m_queue.empty(); });
+
+                if (stop.stop_requested())
+                {
+                    return;
+                }
+
+                path = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            // Decoded outside the lock, get() keeps answering meanwhile
+            auto texture = std::make_shared<Texture>(Texture::fromFile(path));
+
+            {
+                std::lock_guard lock{m_mutex};
+
+                auto found = m_entries.find(path);
+                if (found != m_entries.end())
+                {
+                    auto &entry = found->second;
+
+                    if (texture->isValid())
+                    {
+                        m_lru.push_front(path);
+                        entry.state = State::Resident;
+                        entry.lruPosition = m_lru.begin();
+                        entry.texture = std::move(texture);
+
+                        m_stats.loads++;
+                        m_stats.residentCount++;
+                        m_stats.residentBytes += entry.texture->getMemorySize();
+
+                        evictOverBudget();
+                    }
+                    else
+                    {
+                        entry.state = State::Failed;
+                        m_stats.failures++;
+                    }
+                }
+            }
+
+            m_loaded.notify_all();
+        }
+    }
+
+    // Least recently used first, the most recent one stays even if it alone is
+    // over the budget
+    void evictOverBudget()
+    {
+        while (m_stats.residentBytes > m_budgetBytes && m_lru.size() > 1)
+        {
+            const auto found = m_entries.find(m_lru.back());
+            m_lru.pop_back();
+
+            m_stats.residentBytes -= found->second.texture->getMemorySize();
+            m_stats.residentCount--;
+            m_stats.evictions++;
+            m_entries.erase(found);
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::condition_variable_any m_wakeWorker;
+    std::condition_variable_any m_loaded;
+    size_t m_budgetBytes;
+    std::unordered_map<std::string, Entry> m_entries;
+    // Resident paths, most recently used first
+    std::list<std::string> m_lru;
+    std::deque<std::string> m_queue;
+    TextureManagerStats m_stats;
+    // Last, so it starts after everything it uses is constructed and is stopped
+    // and joined before any of it is destroyed
+    std::jthread m_worker;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pixel_buffer.h"
+
+// Fixed set of workers running one batch of indexed jobs at a time. The calling
+// thread takes part in every batch, so a pool of N threads spawns N - 1 workers.
+struct ThreadPool
+{
+    explicit ThreadPool(size_t threadCount)
+    {
+        for (auto i = size_t{1}; i < threadCount; i++)
+        {
+            m_workers.emplace_back([this]()
+                                   { workerLoop(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock{m_mutex};
+            m_stopping = true;
+        }
+        m_wakeUp.notify_all();
+
+        for (auto &worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t getThreadCount() const
+    {
+        return m_workers.size() + 1;
+    }
+
+    // Calls job(i) for every i in [0, jobCount) and returns once all of them
+    // finished. Batches submitted from several threads run one after another.
+    void run(size_t jobCount, const std::function<void(size_t)> &job)
+    {
+        std::lock_guard batchLock{m_batchMutex};
+
+        if (m_workers.empty())
+        {
+            for (auto i = size_t{0}; i < jobCount; i++)
+            {
+                job(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard lock{m_mutex};
+            m_job = &job;
+            m_jobCount = jobCount;
+            m_nextJob = 0;
+            m_busyWorkers = m_workers.size();
+            m_generation++;
+        }
+        m_wakeUp.notify_all();
+
+        runJobs(job, jobCount);
+
+        std::unique_lock lock{m_mutex};
+        m_done.wait(lock, [this]()
+                    { return m_busyWorkers == 0; });
+        m_job = nullptr;
+    }
+
+private:
+    void runJobs(const std::function<void(size_t)> &job, size_t jobCount)
+    {
+        for (auto i = m_nextJob.fetch_add(1); i < jobCount; i = m_nextJob.fetch_add(1))
+        {
+            job(i);
+        }
+    }
+
+    void workerLoop()
+    {
+        auto seenGeneration = uint64_t{0};
+
+        while (true)
+        {
+            const std::function<void(size_t)> *job = nullptr;
+            size_t jobCount = 0;
+            {
+                std::unique_lock lock{m_mutex};
+                m_wakeUp.wait(lock, [this, seenGeneration]()
+                              { return m_stopping || m_generation != seenGeneration; });
+
+                if (m_stopping)
+                {
+                    return;
+                }
+
+                seenGeneration = m_generation;
+                job = m_job;
+                jobCount = m_jobCount;
+            }
+
+            runJobs(*job, jobCount);
+
+            {
+                std::lock_guard lock{m_mutex};
+                m_busyWorkers--;
+            }
+            m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    // Held by the thread whose batch is running
+    std::mutex m_batchMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::condition_variable m_done;
+    const std::function<void(size_t)> *m_job = nullptr;
+    size_t m_jobCount = 0;
+    std::atomic<size_t> m_nextJob = 0;
+    size_t m_busyWorkers = 0;
+    uint64_t m_generation = 0;
+    bool m_stopping = false;
+};
+
+// Collects post-projection triangles into screen tiles and rasterizes the tiles
+// in parallel. Each tile only touches its own rectangle of the target's color and
+// depth buffers and sees its triangles in submission order, so the output matches
+// drawing straight into the PixelBuffer pixel for pixel.
+struct TiledRasterizer
+{
+    static constexpr int32_t TILE_SIZE = 64;
+    // Workers then resolve the deferred clears of their own tiles only
+    static_assert(TILE_SIZE % PixelBuffer::CLEAR_TILE_SIZE == 0);
+
+    TiledRasterizer(PixelBuffer &target, ThreadPool &threadPool)
+        : m_target(target),
+          m_threadPool(threadPool),
+          m_tilesX((target.getWidth() + TILE_SIZE - 1) / TILE_SIZE),
+          m_tilesY((target.getHeight() + TILE_SIZE - 1) / TILE_SIZE),
+          m_bins(m_tilesX * m_tilesY),
+          m_tileStats(m_bins.size())
+    {
+    }
+
+    void drawTriangle(Vector3DFloat p1, Vector3DFloat p2, Vector3DFloat p3, const Texture &texture, PointFloat uv1, PointFloat uv2, PointFloat uv3)
+    {
+        const auto minXf = std::min({p1.x, p2.x, p3.x});
+        const auto maxXf = std::max({p1.x, p2.x, p3.x});
+        const auto minYf = std::min({p1.y, p2.y, p3.y});
+        const auto maxYf = std::max({p1.y, p2.y, p3.y});
+
+        // Also rejects NaNs coming from vertices projected at z == 0
+        if (!(maxXf >= -1.0f && maxYf >= -1.0f && minXf < m_target.getWidth() && minYf < m_target.getHeight()))
+        {
+            return;
+        }
+
+        // One pixel of slack on each side covers the rounding of the scanline walk
+        const auto clampX = [this](float x)
+        { return std::clamp(static_cast<int32_t>(std::max(std::floor(x), -2.0f)), 0, m_target.getWidth() - 1); };
+        const auto clampY = [this](float y)
+        { return std::clamp(static_cast<int32_t>(std::max(std::floor(y), -2.0f)), 0, m_target.getHeight() - 1); };
+
+        const auto firstTileX = clampX(minXf - 1.0f) / TILE_SIZE;
+        const auto lastTileX = clampX(std::min(maxXf + 1.0f, float(m_target.getWidth()))) / TILE_SIZE;
+        const auto firstTileY = clampY(minYf - 1.0f) / TILE_SIZE;
+        const auto lastTileY = clampY(std::min(maxYf + 1.0f, float(m_target.getHeight()))) / TILE_SIZE;
+
+        const auto index = static_cast<uint32_t>(m_triangles.size());
+        m_triangles.push_back({p1, p2, p3, uv1, uv2, uv3, &texture});
+
+        for (auto tileY = firstTileY; tileY <= lastTileY; tileY++)
+        {
+            for (auto tileX = firstTileX; tileX <= lastTileX; tileX++)
+            {
+                m_bins[tileX + (tileY * m_tilesX)].push_back(index);
+            }
+        }
+    }
+
+    // Direct writes have to land after everything queued before them
+    void putPixel(const PointInt32 &point, int32_t color)
+    {
+        flush();
+        m_target.putPixel(point, color);
+    }
+
+    void flush()
+    {
+        if (m_triangles.empty())
+        {
+            return;
+        }
+
+        m_threadPool.run(m_bins.size(), [this](size_t tile)
+                         { m_tileStats[tile] = rasterizeTile(tile); });
+
+        for (const auto &stats : m_tileStats)
+        {
+            m_target.addFragmentStats(stats);
+        }
+
+        m_triangles.clear();
+        for (auto &bin : m_bins)
+        {
+            bin.clear();
+        }
+    }
+
+    // Only knows about the triangles of previous flushes
+    bool isAreaOccluded(const ClipRect &area, float minZ)
+    {
+        return m_target.isAreaOccluded(area, minZ);
+    }
+
+    bool getTriangleDepthSort() const
+    {
+        return m_target.getTriangleDepthSort();
+    }
+
+    int32_t getWidth() const
+    {
+        return m_target.getWidth();
+    }
+
+    int32_t getHeight() const
+    {
+        return m_target.getHeight();
+    }
+
+private:
+    struct BinnedTriangle
+    {
+        Vector3DFloat p1;
+        Vector3DFloat p2;
+        Vector3DFloat p3;
+        PointFloat uv1;
+        PointFloat uv2;
+        PointFloat uv3;
+        const Texture *texture;
+    };
+
+    FragmentStats rasterizeTile(size_t tile)
+    {
+        const auto tileX = static_cast<int32_t>(tile % m_tilesX);
+        const auto tileY = static_cast<int32_t>(tile / m_tilesX);
+
+        const auto clip = ClipRect{
+            .x0 = tileX * TILE_SIZE,
+            .y0 = tileY * TILE_SIZE,
+            .x1 = std::min((tileX + 1) * TILE_SIZE, m_target.getWidth()),
+            .y1 = std::min((tileY + 1) * TILE_SIZE, m_target.getHeight())};
+
+        FragmentStats stats;
+
+        for (const auto index : m_bins[tile])
+        {
+            const auto &t = m_triangles[index];
+            stats += m_target.drawTriangle(t.p1, t.p2, t.p3, *t.texture, t.uv1, t.uv2, t.uv3, clip);
+        }
+
+        return stats;
+    }
+
+    PixelBuffer &m_target;
+    ThreadPool &m_threadPool;
+    int32_t m_tilesX;
+    int32_t m_tilesY;
+    std::vector<BinnedTriangle> m_triangles;
+    std::vector<std::vector<uint32_t>> m_bins;
+    // Written by the thread that rasterized the tile, summed once the batch is done
+    std::vector<FragmentStats> m_tileStats;
+};
@@ -0,0 +1,661 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <span>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "geometry.h"
+#include "mesh_cache.h"
+
+// Row major, column vectors: the transform applied first is the rightmost factor
+template <typename T>
+struct Matrix4D
+{
+    static Matrix4D identity()
+    {
+        return {{{1, 0, 0, 0},
+                 {0, 1, 0, 0},
+                 {0, 0, 1, 0},
+                 {0, 0, 0, 1}}};
+    }
+
+    static Matrix4D scale(T factor)
+    {
+        return {{{factor, 0, 0, 0},
+                 {0, factor, 0, 0},
+                 {0, 0, factor, 0},
+                 {0, 0, 0, 1}}};
+    }
+
+    static Matrix4D translation(const Vector3D<T> &transl)
+    {
+        return {{{1, 0, 0, transl.x},
+                 {0, 1, 0, transl.y},
+                 {0, 0, 1, transl.z},
+                 {0, 0, 0, 1}}};
+    }
+
+    // Same conventions as getRotatedX/Y/Z
+    static Matrix4D rotationX(T angle)
+    {
+        const auto c = std::cos(angle);
+        const auto s = std::sin(angle);
+
+        return {{{1, 0, 0, 0},
+                 {0, c, -s, 0},
+                 {0, s, c, 0},
+                 {0, 0, 0, 1}}};
+    }
+
+    static Matrix4D rotationY(T angle)
+    {
+        const auto c = std::cos(angle);
+        const auto s = std::sin(angle);
+
+        return {{{c, 0, s, 0},
+                 {0, 1, 0, 0},
+                 {-s, 0, c, 0},
+                 {0, 0, 0, 1}}};
+    }
+
+    static Matrix4D rotationZ(T angle)
+    {
+        const auto c = std::cos(angle);
+        const auto s = std::sin(angle);
+
+        return {{{c, -s, 0, 0},
+                 {s, c, 0, 0},
+                 {0, 0, 1, 0},
+                 {0, 0, 0, 1}}};
+    }
+
+    // applyNonOrthoProj followed by toScreenSpace: x and y end up divided by
+    // w (the view depth) and z keeps the view depth for the z-buffer
+    static Matrix4D screenProjection(int32_t screenWidth, int32_t screenHeight)
+    {
+        const auto halfWidth = T(screenWidth) / 2;
+        const auto halfHeight = T(screenHeight) / 2;
+
+        return {{{halfWidth, 0, halfWidth, 0},
+                 {0, -halfHeight, halfHeight, 0},
+                 {0, 0, 1, 0},
+                 {0, 0, 1, 0}}};
+    }
+
+    Matrix4D operator*(const Matrix4D &rhs) const
+    {
+        Matrix4D res{};
+
+        for (auto row = 0; row < 4; row++)
+        {
+            for (auto col = 0; col < 4; col++)
+            {
+                for (auto k = 0; k < 4; k++)
+                {
+                    res.data[row][col] += data[row][k] * rhs.data[k][col];
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // Point with w = 1 through an affine transform
+    Vector3D<T> transformPoint(const Vector3D<T> &v) const
+    {
+        return {
+            .x = data[0][0] * v.x + data[0][1] * v.y + data[0][2] * v.z + data[0][3],
+            .y = data[1][0] * v.x + data[1][1] * v.y + data[1][2] * v.z + data[1][3],
+            .z = data[2][0] * v.x + data[2][1] * v.y + data[2][2] * v.z + data[2][3]};
+    }
+
+    // Point with w = 1 through a projective transform, followed by the divide by w
+    // for x and y
+    Vector3D<T> projectPoint(const Vector3D<T> &v) const
+    {
+        const auto w = data[3][0] * v.x + data[3][1] * v.y + data[3][2] * v.z + data[3][3];
+        const auto invW = 1 / w;
+
+        return {
+            .x = (data[0][0] * v.x + data[0][1] * v.y + data[0][2] * v.z + data[0][3]) * invW,
+            .y = (data[1][0] * v.x + data[1][1] * v.y + data[1][2] * v.z + data[1][3]) * invW,
+            .z = data[2][0] * v.x + data[2][1] * v.y + data[2][2] * v.z + data[2][3]};
+    }
+
+    T data[4][4];
+};
+
+using Matrix4DFloat = Matrix4D<float>;
+
+// Rotations are applied around the model origin in Z, X, Y order, then the model is moved to pos
+inline Matrix4DFloat getModelMatrix(float anglez, float anglex, float angley, const Vector3DFloat &pos)
+{
+    return Matrix4DFloat::translation(pos) *
+           Matrix4DFloat::rotationY(angley) *
+           Matrix4DFloat::rotationX(anglex) *
+           Matrix4DFloat::rotationZ(anglez);
+}
+
+struct Camera
+{
+    // World to view space: undo the camera position, then its orientation
+    Matrix4DFloat getViewMatrix() const
+    {
+        return Matrix4DFloat::rotationX(-pitch) *
+               Matrix4DFloat::rotationY(-yaw) *
+               Matrix4DFloat::translation({-position.x, -position.y, -position.z});
+    }
+
+    Vector3DFloat position = {0.0f, 0.0f, 0.0f};
+    float yaw = 0.0f;
+    float pitch = 0.0f;
+};
+
+inline Vector3DFloat toScreenSpace(const Vector3DFloat &vec, int32_t screenWidth, int32_t screenHeight)
+{
+    return {
+        .x = (vec.x + 1.0f) * (screenWidth / 2.0f),
+        .y = (-vec.y + 1.0f) * (screenHeight / 2.0f),
+        .z = vec.z};
+}
+
+inline Vector3DFloat applyNonOrthoProj(const Vector3DFloat &vec)
+{
+    return {
+        .x = vec.x / vec.z,
+        .y = vec.y / vec.z,
+        .z = vec.z};
+}
+
+inline std::vector<TexturedVertextFloat> getTranslated(const Vector3DFloat &transl, const std::vector<TexturedVertextFloat> &vertices)
+{
+    std::vector<TexturedVertextFloat> res = vertices;
+
+    for (auto &vertice : res)
+    {
+        vertice.x += transl.x;
+        vertice.y += transl.y;
+        vertice.z += transl.z;
+    }
+
+    return res;
+}
+
+inline std::vector<TexturedVertextFloat> getRotatedZ(float angle, const std::vector<TexturedVertextFloat> &vertices)
+{
+    const auto cosangle = cosf(angle);
+    const auto sinangle = sinf(angle);
+
+    std::vector<TexturedVertextFloat> res = vertices;
+
+    for (auto &vertice : res)
+    {
+        const auto nx = cosangle * vertice.x - sinangle * vertice.y;
+        const auto ny = sinangle * vertice.x + cosangle * vertice.y;
+
+        vertice.x = nx;
+        vertice.y = ny;
+    }
+
+    return res;
+}
+
+inline std::vector<TexturedVertextFloat> getRotatedX(float angle, const std::vector<TexturedVertextFloat> &vertices)
+{
+    const auto cosangle = cosf(angle);
+    const auto sinangle = sinf(angle);
+
+    std::vector<TexturedVertextFloat> res = vertices;
+
+    for (auto &vertice : res)
+    {
+        const auto ny = cosangle * vertice.y - sinangle * vertice.z;
+        const auto nz = sinangle * vertice.y + cosangle * vertice.z;
+
+        vertice.y = ny;
+        vertice.z = nz;
+    }
+
+    return res;
+}
+
+inline std::vector<TexturedVertextFloat> getRotatedY(float angle, const std::vector<TexturedVertextFloat> &vertices)
+{
+    const auto cosangle = cosf(angle);
+    const auto sinangle = sinf(angle);
+
+    std::vector<TexturedVertextFloat> res = vertices;
+
+    for (auto &vertice : res)
+    {
+        const auto nx = cosangle * vertice.x + sinangle * vertice.z;
+        const auto nz = -sinangle * vertice.x + cosangle * vertice.z;
+
+        vertice.x = nx;
+        vertice.z = nz;
+    }
+
+    return res;
+}
+
+// Instruction sets the vertex transform and edge-function span kernels are built for
+enum class SimdIsa
+{
+    Scalar,
+    Sse41,
+    Avx2,
+};
+
+inline const char *simdIsaName(SimdIsa isa)
+{
+    switch (isa)
+    {
+    case SimdIsa::Sse41:
+        return "sse4.1";
+    case SimdIsa::Avx2:
+        return "avx2";
+    case SimdIsa::Scalar:
+        break;
+    }
+
+    return "scalar";
+}
+
+inline bool isSimdIsaSupported(SimdIsa isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    switch (isa)
+    {
+    case SimdIsa::Sse41:
+        return __builtin_cpu_supports("sse4.1");
+    case SimdIsa::Avx2:
+        return __builtin_cpu_supports("avx2");
+    case SimdIsa::Scalar:
+        break;
+    }
+#endif
+
+    return isa == SimdIsa::Scalar;
+}
+
+inline SimdIsa detectSimdIsa()
+{
+    if (isSimdIsaSupported(SimdIsa::Avx2))
+    {
+        return SimdIsa::Avx2;
+    }
+
+    if (isSimdIsaSupported(SimdIsa::Sse41))
+    {
+        return SimdIsa::Sse41;
+    }
+
+    return SimdIsa::Scalar;
+}
+
+// Keeps vector loads of the SoA streams aligned
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &)
+    {
+    }
+
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(::operator new(count * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T *ptr, size_t)
+    {
+        ::operator delete(ptr, std::align_val_t{Alignment});
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const
+    {
+        return true;
+    }
+};
+
+// One AVX register
+static constexpr size_t VERTEX_STREAM_ALIGNMENT = 32;
+
+using FloatStream = std::vector<float, AlignedAllocator<float, VERTEX_STREAM_ALIGNMENT>>;
+
+// Transformed positions, one stream per coordinate
+struct PositionStreams
+{
+    size_t size() const
+    {
+        return x.size();
+    }
+
+    void resize(size_t count)
+    {
+        x.resize(count);
+        y.resize(count);
+        z.resize(count);
+    }
+
+    Vector3DFloat operator[](size_t i) const
+    {
+        return {.x = x[i], .y = y[i], .z = z[i]};
+    }
+
+    FloatStream x;
+    FloatStream y;
+    FloatStream z;
+};
+
+// Structure-of-arrays counterpart of std::vector<TexturedVertextFloat>: each
+// attribute is its own aligned stream so the transform kernels load 8 vertices
+// with one instruction
+struct VertexStreams
+{
+    static VertexStreams fromVertices(std::span<const TexturedVertextFloat> vertices)
+    {
+        VertexStreams res;
+        res.reserve(vertices.size());
+
+        for (const auto &vertice : vertices)
+        {
+            res.push_back(vertice);
+        }
+
+        return res;
+    }
+
+    size_t size() const
+    {
+        return x.size();
+    }
+
+    void reserve(size_t count)
+    {
+        x.reserve(count);
+        y.reserve(count);
+        z.reserve(count);
+        u.reserve(count);
+        v.reserve(count);
+    }
+
+    void push_back(const TexturedVertextFloat &vertice)
+    {
+        x.push_back(vertice.x);
+        y.push_back(vertice.y);
+        z.push_back(vertice.z);
+        u.push_back(vertice.u);
+        v.push_back(vertice.v);
+    }
+
+    TexturedVertextFloat operator[](size_t i) const
+    {
+        return {x[i], y[i], z[i], u[i], v[i]};
+    }
+
+    FloatStream x;
+    FloatStream y;
+    FloatStream z;
+    FloatStream u;
+    FloatStream v;
+};
+
+// Non-owning VertexStreams, over owned streams or the buffers of a mapped mesh
+// cache. The streams are VERTEX_STREAM_ALIGNMENT aligned.
+struct VertexStreamsView
+{
+    VertexStreamsView() = default;
+
+    VertexStreamsView(const float *x, const float *y, const float *z, const float *u, const float *v, size_t count)
+        : x(x),
+          y(y),
+          z(z),
+          u(u),
+          v(v),
+          count(count)
+    {
+    }
+
+    VertexStreamsView(const VertexStreams &streams)
+        : VertexStreamsView(streams.x.data(), streams.y.data(), streams.z.data(), streams.u.data(), streams.v.data(), streams.size())
+    {
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    TexturedVertextFloat operator[](size_t i) const
+    {
+        return {x[i], y[i], z[i], u[i], v[i]};
+    }
+
+    const float *x = nullptr;
+    const float *y = nullptr;
+    const float *z = nullptr;
+    const float *u = nullptr;
+    const float *v = nullptr;
+    size_t count = 0;
+};
+
+static_assert(MESH_CACHE_ALIGNMENT % VERTEX_STREAM_ALIGNMENT == 0);
+
+// Input and output streams of a position transform, count entries each
+struct PositionStreamsView
+{
+    const float *x;
+    const float *y;
+    const float *z;
+    float *outX;
+    float *outY;
+    float *outZ;
+    size_t count;
+};
+
+using PositionTransformKernel = void (*)(const Matrix4DFloat &, const PositionStreamsView &);
+
+// Same arithmetic as Matrix4D::projectPoint. An affine matrix has w = 1, so the
+// divide leaves the result untouched and one kernel covers both cases.
+inline void transformPositionsScalar(const Matrix4DFloat &m, const PositionStreamsView &streams)
+{
+    for (auto i = size_t{0}; i < streams.count; i++)
+    {
+        const auto projected = m.projectPoint({streams.x[i], streams.y[i], streams.z[i]});
+
+        streams.outX[i] = projected.x;
+        streams.outY[i] = projected.y;
+        streams.outZ[i] = projected.z;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector kernels keep the scalar operation order (no fused multiply-add,
+// IEEE division) and produce the same results. Leftover vertices go through
+// the scalar kernel.
+
+__attribute__((target("sse4.1"))) inline void transformPositionsSse41(const Matrix4DFloat &m, const PositionStreamsView &streams)
+{
+    __m128 row[4][4];
+    for (auto r = 0; r < 4; r++)
+    {
+        for (auto c = 0; c < 4; c++)
+        {
+            row[r][c] = _mm_set1_ps(m.data[r][c]);
+        }
+    }
+
+    const auto one = _mm_set1_ps(1.0f);
+
+    auto i = size_t{0};
+
+    // 8 vertices per iteration as two 4-wide halves (lambdas would not inherit
+    // the target attribute, hence the inner loop)
+    for (; i + 8 <= streams.count; i += 8)
+    {
+        for (auto half = i; half < i + 8; half += 4)
+        {
+            const auto x = _mm_load_ps(streams.x + half);
+            const auto y = _mm_load_ps(streams.y + half);
+            const auto z = _mm_load_ps(streams.z + half);
+
+            __m128 dot[4];
+            for (auto r = 0; r < 4; r++)
+            {
+                dot[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(row[r][0], x), _mm_mul_ps(row[r][1], y)), _mm_mul_ps(row[r][2], z)), row[r][3]);
+            }
+
+            const auto invW = _mm_div_ps(one, dot[3]);
+
+            _mm_store_ps(streams.outX + half, _mm_mul_ps(dot[0], invW));
+            _mm_store_ps(streams.outY + half, _mm_mul_ps(dot[1], invW));
+            _mm_store_ps(streams.outZ + half, dot[2]);
+        }
+    }
+
+    transformPositionsScalar(m, {streams.x + i, streams.y + i, streams.z + i,
+                                 streams.outX + i, streams.outY + i, streams.outZ + i, streams.count - i});
+}
+
+__attribute__((target("avx2"))) inline void transformPositionsAvx2(const Matrix4DFloat &m, const PositionStreamsView &streams)
+{
+    __m256 row[4][4];
+    for (auto r = 0; r < 4; r++)
+    {
+        for (auto c = 0; c < 4; c++)
+        {
+            row[r][c] = _mm256_set1_ps(m.data[r][c]);
+        }
+    }
+
+    const auto one = _mm256_set1_ps(1.0f);
+
+    auto i = size_t{0};
+
+    for (; i + 8 <= streams.count; i += 8)
+    {
+        const auto x = _mm256_load_ps(streams.x + i);
+        const auto y = _mm256_load_ps(streams.y + i);
+        const auto z = _mm256_load_ps(streams.z + i);
+
+        __m256 dot[4];
+        for (auto r = 0; r < 4; r++)
+        {
+            dot[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(row[r][0], x), _mm256_mul_ps(row[r][1], y)), _mm256_mul_ps(row[r][2], z)), row[r][3]);
+        }
+
+        const auto invW = _mm256_div_ps(one, dot[3]);
+
+        _mm256_store_ps(streams.outX + i, _mm256_mul_ps(dot[0], invW));
+        _mm256_store_ps(streams.outY + i, _mm256_mul_ps(dot[1], invW));
+        _mm256_store_ps(streams.outZ + i, dot[2]);
+    }
+
+    transformPositionsScalar(m, {streams.x + i, streams.y + i, streams.z + i,
+                                 streams.outX + i, streams.outY + i, streams.outZ + i, streams.count - i});
+}
+
+#endif
+
+inline PositionTransformKernel getPositionTransformKernel(SimdIsa isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    switch (isa)
+    {
+    case SimdIsa::Avx2:
+        return &transformPositionsAvx2;
+    case SimdIsa::Sse41:
+        return &transformPositionsSse41;
+    case SimdIsa::Scalar:
+        break;
+    }
+#endif
+    (void)isa;
+
+    return &transformPositionsScalar;
+}
+
+// Model (or view) space to screen space in one pass: covers the rotations,
+// translation, applyNonOrthoProj and toScreenSpace when m is the composed MVP
+// The out pointers must be VERTEX_STREAM_ALIGNMENT aligned and have room for
+// vertices.size() entries
+inline void projectVertices(const Matrix4DFloat &m, const VertexStreamsView &vertices, float *outX, float *outY, float *outZ, SimdIsa isa = detectSimdIsa())
+{
+    getPositionTransformKernel(isa)(m, {vertices.x, vertices.y, vertices.z, outX, outY, outZ, vertices.size()});
+}
+
+// AoS path, kept for the models that are not stored as streams
+inline void projectVertices(const Matrix4DFloat &m, const std::vector<TexturedVertextFloat> &vertices, float *outX, float *outY, float *outZ, SimdIsa = SimdIsa::Scalar)
+{
+    for (auto i = size_t{0}; i < vertices.size(); i++)
+    {
+        const auto projected = m.projectPoint(vertices[i].getPointVector());
+
+        outX[i] = projected.x;
+        outY[i] = projected.y;
+        outZ[i] = projected.z;
+    }
+}
+
+template <typename Vertices_T>
+void projectVertices(const Matrix4DFloat &m, const Vertices_T &vertices, PositionStreams &out, SimdIsa isa = detectSimdIsa())
+{
+    out.resize(vertices.size());
+    projectVertices(m, vertices, out.x.data(), out.y.data(), out.z.data(), isa);
+}
+
+// Affine transform of the positions, texture coordinates are carried over
+inline VertexStreams getTransformed(const Matrix4DFloat &m, const VertexStreamsView &vertices)
+{
+    VertexStreams res;
+    res.x.resize(vertices.size());
+    res.y.resize(vertices.size());
+    res.z.resize(vertices.size());
+    res.u.assign(vertices.u, vertices.u + vertices.size());
+    res.v.assign(vertices.v, vertices.v + vertices.size());
+
+    getPositionTransformKernel(detectSimdIsa())(m, {vertices.x, vertices.y, vertices.z,
+                                                    res.x.data(), res.y.data(), res.z.data(), vertices.size()});
+
+    return res;
+}
+
+// Conservative: the box around the transformed corners
+inline BoundingBox getTransformed(const Matrix4DFloat &m, const BoundingBox &bounds)
+{
+    if (bounds.isEmpty())
+    {
+        return bounds;
+    }
+
+    BoundingBox res;
+    for (auto corner = 0; corner < 8; corner++)
+    {
+        res.extend(m.transformPoint({corner & 1 ? bounds.max.x : bounds.min.x,
+                                     corner & 2 ? bounds.max.y : bounds.min.y,
+                                     corner & 4 ? bounds.max.z : bounds.min.z}));
+    }
+
+    return res;
+}
@@ -0,0 +1,447 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "obj_loader.h"
+#include "texture.h"
+#include "transform.h"
+#include "models.h"
+#include "pixel_buffer.h"
+#include "renderer.h"
+
+// Hot paths of the renderer timed in isolation. Every benchmark is calibrated to
+// a batch size, then timed over several batches; the median batch is reported,
+// which keeps one-off stalls (page faults, a busy neighbour) out of the numbers.
+
+struct BenchmarkOptions
+{
+    std::string assets = "assets";
+    std::string output;
+    // Only benchmarks whose name contains it
+    std::string filter;
+    double minTimeMs = 500.0;
+};
+
+struct BenchmarkResult
+{
+    std::string name;
+    uint64_t iterations = 0;
+    double nsPerOp = 0.0;
+    double minNsPerOp = 0.0;
+    // Per operation, zero when it does not apply
+    double triangles = 0.0;
+    double pixels = 0.0;
+};
+
+// Keeps the compiler from dropping a computation whose result is unused
+template <typename T>
+void keep(const T &value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct BenchmarkRunner
+{
+    static constexpr int32_t BATCHES = 7;
+
+    explicit BenchmarkRunner(const BenchmarkOptions &options)
+        : m_options(options)
+    {
+    }
+
+    bool isSelected(const std::string &name) const
+    {
+        return name.find(m_options.filter) != std::string::npos;
+    }
+
+    // op runs one operation; triangles and pixels are what one operation processes
+    void run(const std::string &name, const std::function<void()> &op, double triangles = 0.0, double pixels = 0.0)
+    {
+        if (!isSelected(name))
+        {
+            return;
+        }
+
+        using Clock = std::chrono::steady_clock;
+
+        const auto timeBatch = [&](uint64_t count)
+        {
+            const auto start = Clock::now();
+            for (auto i = uint64_t{0}; i < count; i++)
+            {
+                op();
+            }
+            return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        };
+
+        // Warms the caches, then doubles the batch until it is long enough to time
+        op();
+        const auto batchNs = m_options.minTimeMs * 1e6 / BATCHES;
+        auto batchSize = uint64_t{1};
+        auto elapsed = timeBatch(batchSize);
+        while (elapsed < batchNs / 4)
+        {
+            batchSize *= 2;
+            elapsed = timeBatch(batchSize);
+        }
+        batchSize = std::max<uint64_t>(1, uint64_t(double(batchSize) * batchNs / elapsed));
+
+        std::vector<double> nsPerOp;
+        for (auto batch = 0; batch < BATCHES; batch++)
+        {
+            nsPerOp.push_back(timeBatch(batchSize) / double(batchSize));
+        }
+        std::sort(nsPerOp.begin(), nsPerOp.end());
+
+        m_results.push_back({.name = name,
+                             .iterations = batchSize * BATCHES,
+                             .nsPerOp = nsPerOp[BATCHES / 2],
+                             .minNsPerOp = nsPerOp.front(),
+                             .triangles = triangles,
+                             .pixels = pixels});
+
+        fprintf(stderr, "%-36s %14.1f ns/op\n", name.c_str(), m_results.back().nsPerOp);
+    }
+
+    bool writeJson() const
+    {
+        auto *file = m_options.output.empty() ? stdout : fopen(m_options.output.c_str(), "w");
+        if (file == nullptr)
+        {
+            fprintf(stderr, "Failed to open %s\n", m_options.output.c_str());
+            return false;
+        }
+
+        fprintf(file, "{\n  \"batches\": %d,\n  \"benchmarks\": [\n", BATCHES);
+        for (auto i = size_t{0}; i < m_results.size(); i++)
+        {
+            const auto &result = m_results[i];
+            fprintf(file, "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f",
+                    result.name.c_str(), (unsigned long long)result.iterations, result.nsPerOp, result.minNsPerOp);
+            if (result.triangles > 0.0)
+            {
+                fprintf(file, ", \"triangles_per_s\": %.0f", result.triangles * 1e9 / result.nsPerOp);
+            }
+            if (result.pixels > 0.0)
+            {
+                fprintf(file, ", \"pixels_per_s\": %.0f", result.pixels * 1e9 / result.nsPerOp);
+            }
+            fprintf(file, "}%s\n", i + 1 < m_results.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+
+        if (file != stdout)
+        {
+            fclose(file);
+        }
+
+        return true;
+    }
+
+private:
+    const BenchmarkOptions &m_options;
+    std::vector<BenchmarkResult> m_results;
+};
+
+// Grid of quads with texture coordinates, size x size vertices
+bool writeGridObj(const std::string &filename, int32_t size)
+{
+    auto *file = fopen(filename.c_str(), "w");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Failed to open %s\n", filename.c_str());
+        return false;
+    }
+
+    for (auto y = 0; y < size; y++)
+    {
+        for (auto x = 0; x < size; x++)
+        {
+            const auto u = float(x) / float(size - 1);
+            const auto v = float(y) / float(size - 1);
+            fprintf(file, "v %.5f %.5f %.5f\nvt %.5f %.5f\n", u * 2.0f - 1.0f, v * 2.0f - 1.0f, 0.1f * u * v, u, v);
+        }
+    }
+
+    for (auto y = 0; y < size - 1; y++)
+    {
+        for (auto x = 0; x < size - 1; x++)
+        {
+            const auto i = y * size + x + 1;
+            fprintf(file, "f %d/%d %d/%d %d/%d\nf %d/%d %d/%d %d/%d\n", i, i, i + 1, i + 1, i + size, i + size,
+                    i + 1, i + 1, i + size + 1, i + size + 1, i + size, i + size);
+        }
+    }
+
+    return fclose(file) == 0;
+}
+
+void benchmarkObjLoading(BenchmarkRunner &runner, const BenchmarkOptions &options)
+{
+    const auto small = options.assets + "/teapot.obj";
+    if (runner.isSelected("load_obj_small"))
+    {
+        const auto triangles = loadObjFile(small).size() / 3;
+        runner.run("load_obj_small", [&]()
+                   { keep(loadObjFile(small)); }, double(triangles));
+    }
+
+    if (runner.isSelected("load_obj_large"))
+    {
+        // Big enough for the parallel parser
+        const auto large = (std::filesystem::temp_directory_path() / "benchmark_grid.obj").string();
+        if (writeGridObj(large, 400))
+        {
+            const auto triangles = loadObjFile(large).size() / 3;
+            runner.run("load_obj_large", [&]()
+                       { keep(loadObjFile(large)); }, double(triangles));
+            std::filesystem::remove(large);
+        }
+    }
+}
+
+void benchmarkTransforms(BenchmarkRunner &runner, const std::vector<TexturedVertextFloat> &vertices)
+{
+    const auto triangles = double(vertices.size() / 3);
+
+    runner.run("transform_rotate_x", [&]()
+               { keep(getRotatedX(0.3f, vertices)); }, triangles);
+    runner.run("transform_rotate_y", [&]()
+               { keep(getRotatedY(0.3f, vertices)); }, triangles);
+    runner.run("transform_rotate_z", [&]()
+               { keep(getRotatedZ(0.3f, vertices)); }, triangles);
+    runner.run("transform_translate", [&]()
+               { keep(getTranslated({0.5f, -1.0f, 8.0f}, vertices)); }, triangles);
+}
+
+void benchmarkTriangles(BenchmarkRunner &runner, const Texture &texture)
+{
+    constexpr auto WIDTH = 1280;
+    constexpr auto HEIGHT = 720;
+    // Draws between depth clears, every draw is nearer than the previous one so
+    // all of its fragments pass
+    constexpr auto DRAWS_PER_CLEAR = 1024;
+
+    struct Triangle
+    {
+        const char *name;
+        Vector3DFloat p1, p2, p3;
+    };
+
+    const Triangle triangles[] = {
+        {"small", {100.0f, 100.0f, 0.0f}, {104.0f, 100.0f, 0.0f}, {100.0f, 104.0f, 0.0f}},
+        {"large", {0.0f, 0.0f, 0.0f}, {WIDTH - 1.0f, 0.0f, 0.0f}, {0.0f, HEIGHT - 1.0f, 0.0f}},
+        {"sliver", {10.0f, 10.0f, 0.0f}, {WIDTH - 10.0f, 14.0f, 0.0f}, {10.0f, 12.0f, 0.0f}},
+    };
+
+    ScreenBuffer screenBuffer{WIDTH, HEIGHT};
+
+    for (const auto mode : {RasterMode::Scanline, RasterMode::EdgeFunction})
+    {
+        screenBuffer.setRasterMode(mode);
+
+        for (const auto &triangle : triangles)
+        {
+            auto draw = 0;
+            const auto op = [&]()
+            {
+                if (draw == DRAWS_PER_CLEAR)
+                {
+                    screenBuffer.clearZBuffer();
+                    draw = 0;
+                }
+
+                const auto z = 1000.0f - float(draw++) * 0.5f;
+                auto p1 = triangle.p1, p2 = triangle.p2, p3 = triangle.p3;
+                p1.z = p2.z = p3.z = z;
+
+                screenBuffer.drawTriangle(p1, p2, p3, texture, {0.0f, 0.0f}, {1.0f / z, 0.0f}, {0.0f, 1.0f / z});
+            };
+
+            // Fragments of one draw
+            screenBuffer.clearZBuffer();
+            screenBuffer.resetFragmentStats();
+            op();
+            const auto pixels = double(screenBuffer.getFragmentStats().shaded);
+
+            const auto name = std::string{"draw_triangle_"} + triangle.name + (mode == RasterMode::Scanline ? "_scanline" : "_edge");
+            runner.run(name, op, 1.0, pixels);
+        }
+    }
+}
+
+void benchmarkTextureSampling(BenchmarkRunner &runner, const Texture &checker)
+{
+    // Bigger than the L1 cache
+    const Texture large{512, 512, [](int32_t x, int32_t y)
+                        { return int32_t(0xFF000000u | uint32_t(x * 131 + y * 7919)); }};
+
+    constexpr auto GRID = 64;
+
+    for (const auto &[name, texture] : {std::pair{"texture_get_pixel_small", &checker}, std::pair{"texture_get_pixel_large", &large}})
+    {
+        runner.run(name, [&]()
+                   {
+                       auto sum = int32_t{0};
+                       for (auto y = 0; y < GRID; y++)
+                       {
+                           for (auto x = 0; x < GRID; x++)
+                           {
+                               sum ^= texture->getPixel(float(x) / GRID, float(y) / GRID);
+                           }
+                       }
+                       keep(sum); }, 0.0, double(GRID * GRID));
+    }
+}
+
+void benchmarkClears(BenchmarkRunner &runner)
+{
+    ScreenBuffer screenBuffer{1280, 720};
+    const auto pixels = double(screenBuffer.getWidth()) * screenBuffer.getHeight();
+
+    // Clears are deferred to the first draw into each tile, finishClears() writes
+    // the color of the tiles nothing was drawn into
+    runner.run("clear", [&]()
+               {
+                   screenBuffer.cleanScreen();
+                   screenBuffer.clearZBuffer();
+                   screenBuffer.finishClears(); }, 0.0, pixels);
+}
+
+void benchmarkDrawModel(BenchmarkRunner &runner, const BenchmarkOptions &options, const Texture &texture)
+{
+    if (!runner.isSelected("draw_model_teapot"))
+    {
+        return;
+    }
+
+    const auto teapot = ObjModel::fromObjFile(options.assets + "/teapot.obj");
+    const auto triangles = double(teapot.indices.size() / 3);
+
+    ScreenBuffer screenBuffer{1280, 720};
+
+    for (const auto mode : {RasterMode::Scanline, RasterMode::EdgeFunction})
+    {
+        screenBuffer.setRasterMode(mode);
+
+        const auto op = [&]()
+        {
+            screenBuffer.cleanScreen();
+            screenBuffer.clearZBuffer();
+            drawModel(screenBuffer, teapot, 0.4f, 0.3f, 0.8f, {0.0f, -1.0f, 6.0f}, texture);
+        };
+
+        screenBuffer.resetFragmentStats();
+        op();
+        const auto pixels = double(screenBuffer.getFragmentStats().shaded);
+
+        runner.run(mode == RasterMode::Scanline ? "draw_model_teapot_scanline" : "draw_model_teapot_edge", op, triangles, pixels);
+    }
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --assets <dir>       Directory with teapot.obj (default assets)\n"
+           "  --output <file>      Write the JSON results to file instead of stdout\n"
+           "  --filter <text>      Only run benchmarks whose name contains text\n"
+           "  --min-time <ms>      Time spent measuring each benchmark (default 500)\n"
+           "  --help               Show this help\n",
+           program);
+}
+
+bool parseOptions(int argc, char **argv, BenchmarkOptions &options)
+{
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+
+        const auto nextValue = [&]() -> const char *
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                return nullptr;
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--help")
+        {
+            printUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else if (arg == "--assets" || arg == "--output" || arg == "--filter" || arg == "--min-time")
+        {
+            const auto *value = nextValue();
+            if (value == nullptr)
+            {
+                return false;
+            }
+
+            if (arg == "--assets")
+            {
+                options.assets = value;
+            }
+            else if (arg == "--output")
+            {
+                options.output = value;
+            }
+            else if (arg == "--filter")
+            {
+                options.filter = value;
+            }
+            else
+            {
+                options.minTimeMs = atof(value);
+                if (options.minTimeMs <= 0.0)
+                {
+                    fprintf(stderr, "Invalid time %s\n", value);
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    const auto teapot = loadObjFile(options.assets + "/teapot.obj");
+    if (teapot.empty())
+    {
+        fprintf(stderr, "No teapot in %s, see --assets\n", options.assets.c_str());
+        return EXIT_FAILURE;
+    }
+
+    const auto texture = makeCheckerTexture();
+
+    BenchmarkRunner runner{options};
+    benchmarkObjLoading(runner, options);
+    benchmarkTransforms(runner, teapot);
+    benchmarkTriangles(runner, texture);
+    benchmarkTextureSampling(runner, texture);
+    benchmarkClears(runner);
+    benchmarkDrawModel(runner, options, texture);
+
+    return runner.writeJson() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,602 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "texture.h"
+#include "models.h"
+#include "pixel_buffer.h"
+#include "renderer.h"
+#include "tiled_rasterizer.h"
+
+// Renders the canonical scenes headless and compares color and depth against
+// the references in tests/golden. Each scene also has a frame time budget. A
+// failing scene leaves <scene>.<config>.diff.ppm behind: reference, rendered
+// frame and a mask of the mismatches (red color, blue depth, magenta both) side
+// by side. The rasterizer, span kernel, depth format, filter, hierarchical z and
+// thread count are options, every combination of them must match the same
+// references. Only the edge rasterizer and the texture filters have their own.
+
+static constexpr int32_t WIDTH = 256;
+static constexpr int32_t HEIGHT = 256;
+// Largest per channel difference still counted as equal
+static constexpr int32_t COLOR_TOLERANCE = 2;
+// Largest relative depth difference still counted as equal
+static constexpr float DEPTH_TOLERANCE = 1e-4f;
+// Mismatching pixels tolerated, as a fraction of the frame: rounding may move
+// an edge pixel with another compiler or SIMD path
+static constexpr double MAX_MISMATCH_FRACTION = 0.001;
+// Frames timed for the budget, the median one is compared
+static constexpr int32_t TIMED_FRAMES = 31;
+// Exit code of a run the CPU cannot do, ctest reports it as skipped
+static constexpr int32_t SKIPPED = 77;
+
+struct GoldenOptions
+{
+    std::string assets = "assets";
+    std::string references = "golden";
+    std::string diffDir = ".";
+    // Empty runs every scene
+    std::string scene;
+    // Renders the references instead of comparing against them
+    bool update = false;
+    // Multiplies the budgets, for slower machines
+    double budgetScale = 1.0;
+
+    RasterMode rasterMode = RasterMode::Scanline;
+    SimdIsa simdIsa = detectSimdIsa();
+    DepthFormat depthFormat = DepthFormat::Float;
+    TextureFilter textureFilter = TextureFilter::Nearest;
+    bool hierarchicalZ = true;
+    // More than one goes through the TiledRasterizer
+    int32_t threads = 1;
+};
+
+struct GoldenScene
+{
+    const char *name;
+    // Name of the references, another scene's where both must render the same
+    const char *reference;
+    // Median frame time, clears included
+    double budgetMs;
+    // See PixelBuffer::setTriangleDepthSort
+    bool triangleDepthSort;
+    // The same draws into either target
+    std::function<void(ScreenBuffer &)> draw;
+    std::function<void(TiledRasterizer &)> drawTiled;
+};
+
+template <typename Draw_T>
+GoldenScene makeScene(const char *name, const char *reference, double budgetMs, bool triangleDepthSort, const Draw_T &draw)
+{
+    return {name, reference, budgetMs, triangleDepthSort, draw, draw};
+}
+
+struct GoldenFrame
+{
+    std::vector<int32_t> color;
+    std::vector<float> depth;
+};
+
+// Portable float map, one channel: rows bottom to top, negative scale for little endian
+bool writePfm(const std::string &filename, const std::vector<float> &values, int32_t width, int32_t height)
+{
+    auto *file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Failed to open %s\n", filename.c_str());
+        return false;
+    }
+
+    fprintf(file, "Pf\n%d %d\n-1.0\n", width, height);
+    for (auto y = height - 1; y >= 0; y--)
+    {
+        fwrite(&values[size_t(y) * width], sizeof(float), width, file);
+    }
+
+    return fclose(file) == 0;
+}
+
+std::vector<float> readPfm(const std::string &filename, int32_t width, int32_t height)
+{
+    auto *file = fopen(filename.c_str(), "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Failed to open %s\n", filename.c_str());
+        return {};
+    }
+
+    std::vector<float> values(size_t(width) * height);
+
+    int32_t fileWidth = 0, fileHeight = 0;
+    float scale = 0.0f;
+    auto valid = fscanf(file, "Pf %d %d %f", &fileWidth, &fileHeight, &scale) == 3 && fgetc(file) == '\n' &&
+                 fileWidth == width && fileHeight == height && scale < 0.0f;
+
+    for (auto y = height - 1; valid && y >= 0; y--)
+    {
+        valid = fread(&values[size_t(y) * width], sizeof(float), width, file) == size_t(width);
+    }
+
+    fclose(file);
+
+    if (!valid)
+    {
+        fprintf(stderr, "Malformed depth reference %s, expected %dx%d\n", filename.c_str(), width, height);
+        return {};
+    }
+
+    return values;
+}
+
+// The models of the headless scenes, drawn through drawModel at fixed angles
+std::vector<GoldenScene> makeScenes(const ObjModel &teapot, const Texture &texture)
+{
+    static const auto quad = SimpleQuadModel{};
+
+    return {
+        makeScene("quad", "quad", 1.0, false, [&](auto &target)
+                  { drawModel(target, quad, 0.3f, 0.2f, 0.5f, {0.2f, 0.0f, 1.2f}, texture, false, false); }),
+        makeScene("cube", "cube", 1.0, false, [&](auto &target)
+                  { drawCube(target, 0.5f, 0.6f, 0.7f, {0.0f, 0.0f, 3.0f}, texture); }),
+        makeScene("teapot", "teapot", 4.0, false, [&](auto &target)
+                  { drawModel(target, teapot, 0.2f, 0.4f, 0.8f, {-0.5f, -1.0f, 5.0f}, texture); }),
+        // Reordering the triangles must not change what ends up on top
+        makeScene("teapot_sorted", "teapot", 4.0, true, [&](auto &target)
+                  { drawModel(target, teapot, 0.2f, 0.4f, 0.8f, {-0.5f, -1.0f, 5.0f}, texture); }),
+    };
+}
+
+static constexpr SimdIsa ALL_SIMD_ISAS[] = {SimdIsa::Scalar, SimdIsa::Sse41, SimdIsa::Avx2};
+static constexpr DepthFormat ALL_DEPTH_FORMATS[] = {DepthFormat::Float, DepthFormat::ReversedFloat, DepthFormat::Unorm16, DepthFormat::Unorm24};
+static constexpr TextureFilter ALL_TEXTURE_FILTERS[] = {TextureFilter::Nearest, TextureFilter::Bilinear, TextureFilter::Trilinear};
+
+const char *textureFilterName(TextureFilter filter)
+{
+    switch (filter)
+    {
+    case TextureFilter::Bilinear:
+        return "bilinear";
+    case TextureFilter::Trilinear:
+        return "trilinear";
+    case TextureFilter::Nearest:
+        break;
+    }
+
+    return "nearest";
+}
+
+// Tells the runs of one scene apart, e.g. edge-avx2-unorm16-nearest-4t
+std::string getConfigName(const GoldenOptions &options)
+{
+    const auto edge = options.rasterMode == RasterMode::EdgeFunction;
+
+    return std::string{edge ? "edge-" : "scanline-"} + (edge ? std::string{simdIsaName(options.simdIsa)} + "-" : "") +
+           depthFormatName(options.depthFormat) + "-" + textureFilterName(options.textureFilter) + "-" +
+           std::to_string(options.threads) + "t" + (options.hierarchicalZ ? "" : "-nohiz");
+}
+
+// The edge rasterizer covers pixels slightly differently (see the top-left rule
+// of drawTriangleEdgeFunction), so its frames have references of their own. So
+// do filtered colors, the depth is the same with every filter.
+std::string getDepthReference(const GoldenOptions &options, const GoldenScene &scene)
+{
+    return options.references + "/" + scene.reference + (options.rasterMode == RasterMode::EdgeFunction ? "_edge" : "");
+}
+
+std::string getColorReference(const GoldenOptions &options, const GoldenScene &scene)
+{
+    return getDepthReference(options, scene) +
+           (options.textureFilter == TextureFilter::Nearest ? "" : std::string{"_"} + textureFilterName(options.textureFilter));
+}
+
+// Unorm depth decodes to the near end of its code, a whole code step from the
+// float reference: 2^-(Bits - 5) relative, see UnormDepthTraits
+float getDepthTolerance(DepthFormat format)
+{
+    switch (format)
+    {
+    case DepthFormat::Unorm16:
+        return std::max(DEPTH_TOLERANCE, 2.0f / float(1 << 11));
+    case DepthFormat::Unorm24:
+        return std::max(DEPTH_TOLERANCE, 2.0f / float(1 << 19));
+    case DepthFormat::Float:
+    case DepthFormat::ReversedFloat:
+        break;
+    }
+
+    return DEPTH_TOLERANCE;
+}
+
+// What the scenes are drawn into: the buffer, through a TiledRasterizer when
+// more than one thread is asked for
+struct GoldenTarget
+{
+    explicit GoldenTarget(const GoldenOptions &options)
+        : buffer(WIDTH, HEIGHT, options.depthFormat),
+          threadPool(size_t(options.threads)),
+          tiledRasterizer(buffer, threadPool),
+          threads(options.threads)
+    {
+        buffer.setRasterMode(options.rasterMode);
+        buffer.setSimdIsa(options.simdIsa);
+        buffer.setTextureFilter(options.textureFilter);
+        buffer.setHierarchicalZ(options.hierarchicalZ);
+    }
+
+    void draw(const GoldenScene &scene)
+    {
+        buffer.cleanScreen();
+        buffer.clearZBuffer();
+        buffer.setTriangleDepthSort(scene.triangleDepthSort);
+
+        if (threads > 1)
+        {
+            scene.drawTiled(tiledRasterizer);
+            tiledRasterizer.flush();
+        }
+        else
+        {
+            scene.draw(buffer);
+        }
+    }
+
+    ScreenBuffer buffer;
+    ThreadPool threadPool;
+    TiledRasterizer tiledRasterizer;
+    int32_t threads;
+};
+
+GoldenFrame renderFrame(GoldenTarget &target, const GoldenScene &scene)
+{
+    target.draw(scene);
+
+    GoldenFrame frame{std::vector<int32_t>(size_t(WIDTH) * HEIGHT), std::vector<float>(size_t(WIDTH) * HEIGHT)};
+    target.buffer.fillOutBuffer(frame.color.data());
+
+    for (auto y = 0; y < HEIGHT; y++)
+    {
+        for (auto x = 0; x < WIDTH; x++)
+        {
+            frame.depth[x + (y * WIDTH)] = target.buffer.getDepth(x, y);
+        }
+    }
+
+    return frame;
+}
+
+double getMedianFrameMs(GoldenTarget &target, const GoldenScene &scene)
+{
+    std::vector<double> frameMs;
+    for (auto frame = 0; frame < TIMED_FRAMES; frame++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        target.draw(scene);
+        target.buffer.finishClears();
+        frameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::nth_element(frameMs.begin(), frameMs.begin() + TIMED_FRAMES / 2, frameMs.end());
+    return frameMs[TIMED_FRAMES / 2];
+}
+
+bool isColorEqual(int32_t a, int32_t b)
+{
+    for (auto shift = 0; shift < 24; shift += 8)
+    {
+        if (std::abs(((a >> shift) & 0xFF) - ((b >> shift) & 0xFF)) > COLOR_TOLERANCE)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool isDepthEqual(float a, float b, float tolerance)
+{
+    return a == b || std::abs(a - b) <= tolerance * std::max(std::abs(a), std::abs(b));
+}
+
+bool writeDiffImage(const std::string &filename, const GoldenFrame &reference, const GoldenFrame &rendered, float depthTolerance)
+{
+    PixelBuffer diff{3 * WIDTH, HEIGHT};
+
+    for (auto y = 0; y < HEIGHT; y++)
+    {
+        for (auto x = 0; x < WIDTH; x++)
+        {
+            const auto i = x + (y * WIDTH);
+            const auto expected = reference.color.empty() ? 0 : reference.color[i];
+            const auto colorDiffers = reference.color.empty() || !isColorEqual(expected, rendered.color[i]);
+            const auto depthDiffers = reference.depth.empty() || !isDepthEqual(reference.depth[i], rendered.depth[i], depthTolerance);
+
+            diff.putPixel(x, y, expected);
+            diff.putPixel(WIDTH + x, y, rendered.color[i]);
+            diff.putPixel(2 * WIDTH + x, y, int32_t(0xFF000000u | (colorDiffers ? 0xFF0000u : 0u) | (depthDiffers ? 0x0000FFu : 0u)));
+        }
+    }
+
+    if (!diff.writePpm(filename))
+    {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
+        return false;
+    }
+
+    printf("  diff image %s\n", filename.c_str());
+    return true;
+}
+
+bool updateReference(const GoldenOptions &options, const GoldenScene &scene, PixelBuffer &target, const GoldenFrame &frame)
+{
+    if (std::string_view{scene.reference} != scene.name)
+    {
+        printf("%-8s checks the references of %s, left alone\n", scene.name, scene.reference);
+        return true;
+    }
+
+    const auto colorBase = getColorReference(options, scene);
+    const auto depthBase = getDepthReference(options, scene);
+    if (!target.writePpm(colorBase + ".ppm") || !writePfm(depthBase + ".pfm", frame.depth, WIDTH, HEIGHT))
+    {
+        fprintf(stderr, "Failed to write the references of %s\n", scene.name);
+        return false;
+    }
+
+    printf("%-8s updated %s.ppm and %s.pfm\n", scene.name, colorBase.c_str(), depthBase.c_str());
+    return true;
+}
+
+bool checkScene(const GoldenOptions &options, const GoldenScene &scene)
+{
+    GoldenTarget target{options};
+    const auto frame = renderFrame(target, scene);
+
+    if (options.update)
+    {
+        return updateReference(options, scene, target.buffer, frame);
+    }
+
+    const auto colorBase = getColorReference(options, scene);
+    const auto depthBase = getDepthReference(options, scene);
+    const auto depthTolerance = getDepthTolerance(options.depthFormat);
+
+    GoldenFrame reference;
+    const auto referenceImage = Texture::fromFile(colorBase + ".ppm");
+    if (referenceImage.m_width == uint32_t(WIDTH) && referenceImage.m_height == uint32_t(HEIGHT))
+    {
+        reference.color.resize(frame.color.size());
+        for (auto y = 0; y < HEIGHT; y++)
+        {
+            for (auto x = 0; x < WIDTH; x++)
+            {
+                reference.color[x + (y * WIDTH)] = referenceImage.getTexel(x, y);
+            }
+        }
+    }
+    else if (referenceImage.isValid())
+    {
+        fprintf(stderr, "%s.ppm is not %dx%d\n", colorBase.c_str(), WIDTH, HEIGHT);
+    }
+    reference.depth = readPfm(depthBase + ".pfm", WIDTH, HEIGHT);
+
+    auto colorMismatches = size_t{0};
+    auto depthMismatches = size_t{0};
+    for (auto i = size_t{0}; i < frame.color.size(); i++)
+    {
+        colorMismatches += reference.color.empty() || !isColorEqual(reference.color[i], frame.color[i]);
+        depthMismatches += reference.depth.empty() || !isDepthEqual(reference.depth[i], frame.depth[i], depthTolerance);
+    }
+
+    const auto maxMismatches = size_t(MAX_MISMATCH_FRACTION * double(frame.color.size()));
+    const auto imageMatches = colorMismatches <= maxMismatches && depthMismatches <= maxMismatches;
+
+    const auto budgetMs = scene.budgetMs * options.budgetScale;
+    const auto frameMs = getMedianFrameMs(target, scene);
+    const auto withinBudget = frameMs <= budgetMs;
+
+    printf("%-8s color mismatches %zu, depth mismatches %zu (max %zu), frame %.3f ms (budget %.3f ms)%s\n",
+           scene.name, colorMismatches, depthMismatches, maxMismatches, frameMs, budgetMs,
+           imageMatches && withinBudget ? "" : imageMatches ? "  OVER BUDGET"
+                                                            : "  MISMATCH");
+
+    if (!imageMatches || !withinBudget)
+    {
+        writeDiffImage(options.diffDir + "/" + scene.name + "." + getConfigName(options) + ".diff.ppm", reference, frame, depthTolerance);
+        return false;
+    }
+
+    return true;
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --scene <name>          Only check quad, cube, teapot or teapot_sorted\n"
+           "  --assets <dir>          Directory with teapot.obj (default assets)\n"
+           "  --references <dir>      Directory with the reference images (default golden)\n"
+           "  --diff-dir <dir>        Where failing scenes write their diff image (default .)\n"
+           "  --budget-scale <f>      Multiplies the frame time budgets (default 1)\n"
+           "  --raster <mode>         scanline or edge (default scanline)\n"
+           "  --isa <isa>             Edge span kernel: scalar, sse4.1 or avx2 (default: best supported)\n"
+           "  --depth-format <format> float, reversed, unorm16 or unorm24 (default float)\n"
+           "  --filter <mode>         nearest, bilinear or trilinear (default nearest)\n"
+           "  --threads <count>       More than 1 draws through the TiledRasterizer (default 1)\n"
+           "  --no-hiz                Disable hierarchical z rejection\n"
+           "  --update                Render the references instead of checking them\n"
+           "  --help                  Show this help\n",
+           program);
+}
+
+bool parseOptions(int argc, char **argv, GoldenOptions &options)
+{
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+
+        if (arg == "--help")
+        {
+            printUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else if (arg == "--update")
+        {
+            options.update = true;
+        }
+        else if (arg == "--no-hiz")
+        {
+            options.hierarchicalZ = false;
+        }
+        else if (arg == "--scene" || arg == "--assets" || arg == "--references" || arg == "--diff-dir" || arg == "--budget-scale" ||
+                 arg == "--raster" || arg == "--isa" || arg == "--depth-format" || arg == "--filter" || arg == "--threads")
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                return false;
+            }
+
+            const std::string value = argv[++i];
+            if (arg == "--scene")
+            {
+                options.scene = value;
+            }
+            else if (arg == "--assets")
+            {
+                options.assets = value;
+            }
+            else if (arg == "--references")
+            {
+                options.references = value;
+            }
+            else if (arg == "--diff-dir")
+            {
+                options.diffDir = value;
+            }
+            else if (arg == "--raster")
+            {
+                if (value != "scanline" && value != "edge")
+                {
+                    fprintf(stderr, "Unknown raster mode %s\n", value.c_str());
+                    return false;
+                }
+
+                options.rasterMode = value == "edge" ? RasterMode::EdgeFunction : RasterMode::Scanline;
+            }
+            else if (arg == "--isa")
+            {
+                const auto isa = std::find_if(std::begin(ALL_SIMD_ISAS), std::end(ALL_SIMD_ISAS), [&](SimdIsa isa)
+                                              { return value == simdIsaName(isa); });
+                if (isa == std::end(ALL_SIMD_ISAS))
+                {
+                    fprintf(stderr, "Unknown instruction set %s\n", value.c_str());
+                    return false;
+                }
+
+                options.simdIsa = *isa;
+            }
+            else if (arg == "--depth-format")
+            {
+                const auto format = std::find_if(std::begin(ALL_DEPTH_FORMATS), std::end(ALL_DEPTH_FORMATS), [&](DepthFormat format)
+                                                 { return value == depthFormatName(format); });
+                if (format == std::end(ALL_DEPTH_FORMATS))
+                {
+                    fprintf(stderr, "Unknown depth format %s\n", value.c_str());
+                    return false;
+                }
+
+                options.depthFormat = *format;
+            }
+            else if (arg == "--filter")
+            {
+                const auto filter = std::find_if(std::begin(ALL_TEXTURE_FILTERS), std::end(ALL_TEXTURE_FILTERS), [&](TextureFilter filter)
+                                                 { return value == textureFilterName(filter); });
+                if (filter == std::end(ALL_TEXTURE_FILTERS))
+                {
+                    fprintf(stderr, "Unknown texture filter %s\n", value.c_str());
+                    return false;
+                }
+
+                options.textureFilter = *filter;
+            }
+            else if (arg == "--threads")
+            {
+                options.threads = atoi(value.c_str());
+                if (options.threads <= 0)
+                {
+                    fprintf(stderr, "Invalid thread count %s\n", value.c_str());
+                    return false;
+                }
+            }
+            else
+            {
+                options.budgetScale = atof(value.c_str());
+                if (options.budgetScale <= 0.0)
+                {
+                    fprintf(stderr, "Invalid budget scale %s\n", value.c_str());
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    GoldenOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // PixelBuffer::setSimdIsa would quietly fall back to the scalar kernel
+    if (!isSimdIsaSupported(options.simdIsa))
+    {
+        printf("This CPU does not support %s, skipped\n", simdIsaName(options.simdIsa));
+        return SKIPPED;
+    }
+
+    printf("Configuration %s\n", getConfigName(options).c_str());
+
+    const auto teapot = ObjModel::fromObjFile(options.assets + "/teapot.obj");
+    if (teapot.indices.empty())
+    {
+        fprintf(stderr, "No teapot in %s, see --assets\n", options.assets.c_str());
+        return EXIT_FAILURE;
+    }
+
+    const auto texture = makeCheckerTexture();
+
+    auto found = false;
+    auto passed = true;
+    for (const auto &scene : makeScenes(teapot, texture))
+    {
+        if (options.scene.empty() || options.scene == scene.name)
+        {
+            found = true;
+            passed &= checkScene(options, scene);
+        }
+    }
+
+    if (!found)
+    {
+        fprintf(stderr, "Unknown scene %s\n", options.scene.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
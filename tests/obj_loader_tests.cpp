@@ -0,0 +1,130 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "obj_loader.h"
+
+// Parses the same OBJ text split into different numbers of chunks and expects
+// the same mesh every time. Relative (negative) face indices reaching back into
+// earlier chunks are the case that used to depend on the core count.
+
+static constexpr size_t CHUNK_COUNTS[] = {2, 3, 4, 7, 16};
+
+// Grid of quads, size x size vertices, every face indexed relative to the
+// vertices written just before it, withTexcoords adds a vt per v
+std::string makeRelativeGridObj(int32_t size, bool withTexcoords)
+{
+    std::string text;
+    char line[128];
+
+    for (auto y = 0; y < size; y++)
+    {
+        for (auto x = 0; x < size; x++)
+        {
+            snprintf(line, sizeof(line), "v %d %d 0\n", x, y);
+            text += line;
+            if (withTexcoords)
+            {
+                snprintf(line, sizeof(line), "vt %g %g\n", x / float(size - 1), y / float(size - 1));
+                text += line;
+            }
+        }
+
+        if (y == 0)
+        {
+            continue;
+        }
+
+        // The row above is size vertices further back than this one
+        for (auto x = 0; x + 1 < size; x++)
+        {
+            const auto v00 = x - 2 * size;
+            const auto v10 = v00 + 1;
+            const auto v01 = x - size;
+            const auto v11 = v01 + 1;
+
+            if (withTexcoords)
+            {
+                snprintf(line, sizeof(line), "f %d/%d %d/%d %d/%d %d/%d\n", v00, v00, v10, v10, v11, v11, v01, v01);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "f %d %d %d %d\n", v00, v10, v11, v01);
+            }
+            text += line;
+        }
+    }
+
+    return text;
+}
+
+bool isSameMesh(const IndexedMesh &a, const IndexedMesh &b)
+{
+    if (a.indices != b.indices || a.vertices.size() != b.vertices.size())
+    {
+        return false;
+    }
+
+    for (auto i = size_t{0}; i < a.vertices.size(); i++)
+    {
+        const auto &va = a.vertices[i];
+        const auto &vb = b.vertices[i];
+        if (va.x != vb.x || va.y != vb.y || va.z != vb.z || va.u != vb.u || va.v != vb.v)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool checkChunkCounts(const char *name, const std::string &text, size_t expectedIndices)
+{
+    const auto reference = parseIndexedObj(text, 1, name);
+    if (reference.indices.size() != expectedIndices)
+    {
+        printf("%-20s 1 chunk: %zu indices, expected %zu  FAILED\n", name, reference.indices.size(), expectedIndices);
+        return false;
+    }
+
+    auto passed = true;
+    for (const auto chunkCount : CHUNK_COUNTS)
+    {
+        if (!isSameMesh(reference, parseIndexedObj(text, chunkCount, name)))
+        {
+            printf("%-20s %zu chunks: mesh differs from 1 chunk  FAILED\n", name, chunkCount);
+            passed = false;
+        }
+    }
+
+    if (passed)
+    {
+        printf("%-20s %zu vertices, %zu indices, same for every chunk count\n", name, reference.vertices.size(), reference.indices.size());
+    }
+
+    return passed;
+}
+
+int main()
+{
+    constexpr auto SIZE = 64;
+    constexpr auto INDICES = size_t(SIZE - 1) * (SIZE - 1) * 6;
+
+    auto passed = checkChunkCounts("relative", makeRelativeGridObj(SIZE, false), INDICES);
+    passed &= checkChunkCounts("relative_texcoords", makeRelativeGridObj(SIZE, true), INDICES);
+
+    // Reaching back before the first vertex fails however the file is split
+    const auto outOfRange = makeRelativeGridObj(SIZE, false) + "f -1 -2 -" + std::to_string(SIZE * SIZE + 1) + "\n";
+    for (const auto chunkCount : {size_t{1}, size_t{4}})
+    {
+        if (!parseIndexedObj(outOfRange, chunkCount, "out_of_range").indices.empty())
+        {
+            printf("%-20s %zu chunks: loaded a face before the first vertex  FAILED\n", "out_of_range", chunkCount);
+            passed = false;
+        }
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}